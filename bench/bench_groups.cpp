@@ -0,0 +1,130 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+// Measures creating, opening by name and iterating the children of a large
+// group for the CPH5Group link storage options: the default, creation order
+// tracking and dense link storage.
+
+#include "cph5.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+enum LinkOptions
+{
+    LINKS_DEFAULT,
+    LINKS_CRT_ORDER,
+    LINKS_DENSE
+};
+
+static const char *OPTION_NAMES[] = {"default", "crt-order", "dense(0,0)"};
+static const int NUM_LOOKUPS = 20000;
+
+struct ManyGroup : public CPH5Group
+{
+    explicit ManyGroup(CPH5Group *parent)
+        : CPH5Group(parent, "many") {} // NOOP
+};
+
+struct GroupFile : public CPH5Group
+{
+    explicit GroupFile(LinkOptions options)
+        : CPH5Group(),
+          many(this)
+    {
+        if (options == LINKS_CRT_ORDER) {
+            many.setLinkCreationOrder(true, true);
+        } else if (options == LINKS_DENSE) {
+            many.setLinkPhaseChange(0, 0);
+        }
+    }
+
+    ManyGroup many;
+};
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::string childName(int i) {
+    char name[32];
+    snprintf(name, sizeof(name), "ds%06d", i);
+    return name;
+}
+
+int main(int argc, char *argv[]) {
+    std::string path = argc > 1 ? argv[1] : "bench_groups.h5";
+
+    printf("%7s  %-10s  %8s  %10s  %13s  %12s\n",
+           "n", "options", "create", "open/name", "iterate(name)", "iterate(crt)");
+    const int counts[] = {1000, 10000, 100000};
+    for (int n : counts) {
+        for (int o = LINKS_DEFAULT; o <= LINKS_DENSE; ++o) {
+            LinkOptions options = static_cast<LinkOptions>(o);
+
+            // Create n 1-element datasets, in a scrambled name order
+            double create;
+            {
+                GroupFile file(options);
+                file.createOrOverwriteFile(path);
+                hid_t groupId = file.many.getH5Group()->getId();
+                hsize_t dims[1] = {1};
+                hid_t space = H5Screate_simple(1, dims, 0);
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                for (int i = 0; i < n; ++i) {
+                    hid_t ds = H5Dcreate2(groupId, childName((i * 7919) % n).c_str(),
+                                          H5T_NATIVE_INT, space,
+                                          H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+                    H5Dclose(ds);
+                }
+                create = secondsSince(start);
+                H5Sclose(space);
+                file.close();
+            }
+
+            GroupFile file(options);
+            file.openFile(path, true);
+            hid_t groupId = file.many.getH5Group()->getId();
+
+            std::mt19937 rng(1);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (int i = 0; i < NUM_LOOKUPS; ++i) {
+                hid_t ds = H5Dopen2(groupId, childName(rng() % n).c_str(), H5P_DEFAULT);
+                H5Dclose(ds);
+            }
+            double lookup = secondsSince(start) / NUM_LOOKUPS;
+
+            start = std::chrono::steady_clock::now();
+            std::vector<std::string> names = file.many.getLinkNames(false);
+            double byName = secondsSince(start);
+            if (names.size() != static_cast<std::size_t>(n)) {
+                printf("MISMATCH: %zu links listed, %d created\n", names.size(), n);
+                return 1;
+            }
+
+            char crtOrder[16] = "-";
+            if (options == LINKS_CRT_ORDER) {
+                start = std::chrono::steady_clock::now();
+                names = file.many.getLinkNames(true);
+                snprintf(crtOrder, sizeof(crtOrder), "%.2fms", secondsSince(start) * 1e3);
+                if (names.size() < 2 || names[1] != childName(7919 % n)) {
+                    printf("MISMATCH: links not listed in creation order\n");
+                    return 1;
+                }
+            }
+            file.close();
+
+            printf("%7d  %-10s  %7.3fs  %8.1fus  %11.2fms  %12s\n",
+                   n, OPTION_NAMES[o], create, lookup * 1e6, byName * 1e3, crtOrder);
+        }
+    }
+    remove(path.c_str());
+    return 0;
+}
@@ -0,0 +1,124 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+// Compares CPH5ReadInterleaved against per-pixel operator[] access for
+// reading pixel-interleaved (BIP) spectra out of a band-sequential cube,
+// and the blocked transpose kernel against a naive loop.
+
+#include "cph5.h"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static const hsize_t BANDS = 64;
+static const hsize_t ROWS = 512;
+static const hsize_t COLS = 512;
+static const hsize_t WINDOW = 32;
+
+struct CubeFile : public CPH5Group
+{
+    CubeFile()
+        : CPH5Group(),
+          cube(this, "cube", H5::PredType::NATIVE_UINT16)
+    {
+        hsize_t dims[3] = {BANDS, ROWS, COLS};
+        hsize_t chunk[3] = {16, 64, 64};
+        cube.setDimensions(dims, dims);
+        cube.setChunkSize(chunk);
+    }
+
+    CPH5Dataset<uint16_t, 3> cube;
+};
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+    std::string path = argc > 1 ? argv[1] : "bench_interleave.h5";
+
+    std::vector<uint16_t> data(BANDS * ROWS * COLS);
+    for (std::size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<uint16_t>(i * 31 + 7);
+    }
+    {
+        CubeFile file;
+        file.createOrOverwriteFile(path);
+        file.cube.write(data.data());
+        file.close();
+    }
+
+    CubeFile file;
+    file.openFile(path, true);
+    printf("cube %llux%llux%llu uint16, chunks 16x64x64\n",
+           (unsigned long long)BANDS, (unsigned long long)ROWS, (unsigned long long)COLS);
+
+    // Full scene to BIP
+    std::vector<uint16_t> bip(BANDS * ROWS * COLS);
+    const int reps = 5;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int rep = 0; rep < reps; ++rep) {
+        CPH5ReadInterleaved(file.cube, 0, 0, COLS, ROWS, CPH5_INTERLEAVE_BIP, bip.data());
+    }
+    double interleaved = secondsSince(start) / reps;
+    printf("CPH5ReadInterleaved, full scene to BIP: %8.1f ms (%.2f Mpixel/s)\n",
+           interleaved * 1e3, ROWS * COLS / interleaved / 1e6);
+
+    // Per-pixel spectra through operator[] on a small window
+    std::vector<uint16_t> naive(WINDOW * WINDOW * BANDS);
+    start = std::chrono::steady_clock::now();
+    for (hsize_t r = 0; r < WINDOW; ++r) {
+        for (hsize_t c = 0; c < WINDOW; ++c) {
+            for (hsize_t b = 0; b < BANDS; ++b) {
+                naive[(r * WINDOW + c) * BANDS + b] = file.cube[b][r][c];
+            }
+        }
+    }
+    double perPixel = secondsSince(start) / (WINDOW * WINDOW);
+    printf("operator[] per pixel, %llux%llu window: %8.3f ms/pixel (%.1f s extrapolated to the scene)\n",
+           (unsigned long long)WINDOW, (unsigned long long)WINDOW,
+           perPixel * 1e3, perPixel * ROWS * COLS);
+    for (hsize_t r = 0; r < WINDOW; ++r) {
+        for (hsize_t c = 0; c < WINDOW; ++c) {
+            for (hsize_t b = 0; b < BANDS; ++b) {
+                if (naive[(r * WINDOW + c) * BANDS + b] != bip[(r * COLS + c) * BANDS + b]) {
+                    printf("MISMATCH at row %llu column %llu band %llu\n",
+                           (unsigned long long)r, (unsigned long long)c, (unsigned long long)b);
+                    return 1;
+                }
+            }
+        }
+    }
+    file.close();
+    remove(path.c_str());
+
+    // Transpose kernel alone
+    const std::size_t numRows = BANDS;
+    const std::size_t numCols = ROWS * COLS;
+    std::vector<uint16_t> src(data.begin(), data.end());
+    std::vector<uint16_t> dst(numRows * numCols);
+    const int kernelReps = 10;
+    start = std::chrono::steady_clock::now();
+    for (int rep = 0; rep < kernelReps; ++rep) {
+        CPH5Transpose::transpose(src.data(), dst.data(), numRows, numCols, numCols, numRows);
+    }
+    double blocked = secondsSince(start) / kernelReps;
+    start = std::chrono::steady_clock::now();
+    for (int rep = 0; rep < kernelReps; ++rep) {
+        for (std::size_t r = 0; r < numRows; ++r) {
+            for (std::size_t c = 0; c < numCols; ++c) {
+                dst[c * numRows + r] = src[r * numCols + c];
+            }
+        }
+    }
+    double loop = secondsSince(start) / kernelReps;
+    printf("transpose %zux%zu uint16: blocked %.2f ms, naive loop %.2f ms\n",
+           numRows, numCols, blocked * 1e3, loop * 1e3);
+    return 0;
+}
@@ -0,0 +1,101 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+// Measures per-row write latency, including the tail (p99.99 and worst
+// case), of plain CPH5Dataset row writes against CPH5RealTimeWriter on a
+// dataset in real-time mode.
+
+#include "cph5.h"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+static const hsize_t NUM_ROWS = 4000000;
+static const hsize_t ROW_SIZE = 16;
+
+struct TelemetryFile : public CPH5Group
+{
+    explicit TelemetryFile(bool realTime)
+        : CPH5Group(),
+          telemetry(this, "telemetry", H5::PredType::NATIVE_DOUBLE)
+    {
+        hsize_t dims[2] = {NUM_ROWS, ROW_SIZE};
+        telemetry.setDimensions(dims, dims);
+        if (realTime) {
+            telemetry.setRealTimeMode();
+        }
+    }
+
+    CPH5Dataset<double, 2> telemetry;
+};
+
+static uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void report(const char *label, const CPH5LatencyRecorder &lat) {
+    printf("%-24s n=%llu mean=%.0f p50=%llu p99=%llu p99.99=%llu max=%llu (ns)\n",
+           label,
+           (unsigned long long)lat.getCount(),
+           lat.getMean(),
+           (unsigned long long)lat.getPercentile(50),
+           (unsigned long long)lat.getPercentile(99),
+           (unsigned long long)lat.getPercentile(99.99),
+           (unsigned long long)lat.getMax());
+}
+
+int main(int argc, char *argv[]) {
+    std::string path = argc > 1 ? argv[1] : "bench_realtime.h5";
+
+    double row[ROW_SIZE];
+    for (hsize_t i = 0; i < ROW_SIZE; ++i) {
+        row[i] = static_cast<double>(i);
+    }
+    printf("%llu rows of %llu doubles, contiguous\n",
+           (unsigned long long)NUM_ROWS, (unsigned long long)ROW_SIZE);
+
+    {
+        TelemetryFile file(false);
+        file.createOrOverwriteFile(path);
+        CPH5LatencyRecorder lat;
+        for (hsize_t r = 0; r < NUM_ROWS; ++r) {
+            row[0] = static_cast<double>(r);
+            uint64_t start = nowNs();
+            file.telemetry[r].write(row);
+            lat.record(nowNs() - start);
+        }
+        report("telemetry[r].write()", lat);
+        file.close();
+    }
+
+    {
+        TelemetryFile file(true);
+        file.createOrOverwriteFile(path);
+        CPH5RealTimeWriter writer(file.telemetry);
+        // Warm up the library's free lists outside the measured loop
+        writer.writeRow(0, row);
+        CPH5LatencyRecorder lat;
+        for (hsize_t r = 0; r < NUM_ROWS; ++r) {
+            row[0] = static_cast<double>(r);
+            uint64_t start = nowNs();
+            bool ok = writer.append(row);
+            lat.record(nowNs() - start);
+            if (!ok) {
+                printf("CPH5RealTimeWriter::append failed at row %llu\n",
+                       (unsigned long long)r);
+                return 1;
+            }
+        }
+        report("CPH5RealTimeWriter", lat);
+        file.close();
+    }
+
+    remove(path.c_str());
+    return 0;
+}
@@ -19,3 +19,24 @@
 #include "cph5attribute.h"
 #include "cph5comptype.h"
 #include "cph5varlenstr.h"
+#include "cph5blob.h"
+#include "cph5parallel.h"
+#include "cph5ragged.h"
+#include "cph5image.h"
+#include "cph5pyramid.h"
+#include "cph5transpose.h"
+#include "cph5interleave.h"
+#include "cph5multiio.h"
+#include "cph5memberview.h"
+#include "cph5chunkbuffer.h"
+#include "cph5realtime.h"
+#include "cph5filepool.h"
+#include "cph5procscan.h"
+#include "cph5batch.h"
+#include "cph5directread.h"
+#include "cph5query.h"
+#include "cph5join.h"
+#include "cph5resample.h"
+#include "cph5sort.h"
+#include "cph5columnstore.h"
+#include "cph5rechunk.h"
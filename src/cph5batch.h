@@ -0,0 +1,482 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5BATCH_H
+#define CPH5BATCH_H
+
+#include "cph5utilities.h"
+#include "cph5group.h"
+#include "cph5parallel.h"
+
+#ifndef _WIN32
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+/*!
+ * \brief Progress of a CPH5BatchProcess run.
+ */
+struct CPH5BatchProgress
+{
+    std::size_t filesTotal;  //!< Files in the batch
+    std::size_t filesDone;   //!< Files finished, failed ones included
+    std::size_t filesFailed; //!< Files that could not be opened or processed
+    uint64_t bytesTotal;     //!< Size on disk of all the files
+    uint64_t bytesDone;      //!< Size on disk of the finished files
+    double elapsed;          //!< Seconds since the start of the run
+
+    /*!
+     * \brief Returns the number of files finished per second.
+     * \return Throughput in files per second.
+     */
+    double getFilesPerSecond() const {
+        return elapsed > 0.0 ? static_cast<double>(filesDone) / elapsed : 0.0;
+    }
+
+    /*!
+     * \brief Returns the number of bytes (of file size) finished per second.
+     * \return Throughput in bytes per second.
+     */
+    double getBytesPerSecond() const {
+        return elapsed > 0.0 ? static_cast<double>(bytesDone) / elapsed : 0.0;
+    }
+};
+
+
+/*!
+ * \brief The CPH5BatchProcess class applies a function to every file of a
+ *        list, spread over worker processes, and gathers one result per
+ *        file.
+ *
+ * G is the root group class describing the files (a default constructible
+ * subclass of CPH5Group). Every worker builds one G and moves it from file
+ * to file with rebindFile, so the tree is constructed once per worker and
+ * not once per file. The files are opened read only.
+ *
+ * The files are handed out one at a time from a shared counter, largest
+ * first, so a worker that finishes early takes the next file instead of
+ * idling behind a static split, and the big files do not end up last.
+ *
+ * The workers are forked processes, each with its own copy of the HDF5
+ * library, and send their results back through pipes; R must therefore be
+ * trivially copyable. With a thread-safe HDF5 build (H5_HAVE_THREADSAFE),
+ * setUseThreads switches to worker threads instead. A file whose open or
+ * function throws, or whose worker dies, is counted as failed and keeps a
+ * default constructed result.
+ *
+ * Example: <pre>
+ * CPH5BatchProcess<DayFile, Summary> batch(
+ *     [](DayFile &f, const std::string &) { return summarize(f); });
+ * batch.setProgressCallback([](const CPH5BatchProgress &p) {
+ *     std::cerr << p.filesDone << "/" << p.filesTotal << " "
+ *               << p.getFilesPerSecond() << " files/s\n";
+ * });
+ * std::vector<Summary> perFile = batch.run(
+ *     CPH5BatchProcess<DayFile, Summary>::listFiles("/data/2017-06-01"));
+ * </pre>
+ */
+template<class G, class R>
+class CPH5BatchProcess
+{
+public:
+
+    typedef std::function<R(G &root, const std::string &filename)> Function;
+    typedef std::function<void(const CPH5BatchProgress &progress)> ProgressCallback;
+
+    /*!
+     * \brief Constructor.
+     * \param fn Function applied to the open tree of every file.
+     * \param numWorkers Number of workers, 0 for one per online core.
+     */
+    explicit CPH5BatchProcess(Function fn, int numWorkers = 0)
+        : mFunction(fn),
+          mNumWorkers(numWorkers),
+          mUseThreads(false),
+          mProgressInterval(1.0)
+    {
+        if (mNumWorkers <= 0) {
+            long n = sysconf(_SC_NPROCESSORS_ONLN);
+            mNumWorkers = n > 0 ? static_cast<int>(n) : 1;
+        }
+        memset(&mProgress, 0, sizeof(mProgress));
+    }
+
+    /*!
+     * \brief Sets a function called with the progress while the batch runs:
+     *        at most once per interval as files finish, and once at the end.
+     * \param callback Progress function, called on the calling thread (from
+     *        a worker thread, one at a time, when using threads).
+     * \param interval Minimum number of seconds between calls.
+     */
+    void setProgressCallback(ProgressCallback callback, double interval = 1.0) {
+        mProgressCallback = callback;
+        mProgressInterval = interval;
+    }
+
+    /*!
+     * \brief Sets whether to use worker threads instead of processes. Only
+     *        has an effect with a thread-safe HDF5 build.
+     * \param useThreads True for threads.
+     */
+    void setUseThreads(bool useThreads) {
+        mUseThreads = useThreads;
+    }
+
+    /*!
+     * \brief Processes a list of files. Blocks until every file is done.
+     * \param files Names of the HDF5 files.
+     * \return The result of every file, in the order of files.
+     */
+    std::vector<R> run(const std::vector<std::string> &files) {
+        static_assert(std::is_trivially_copyable<R>::value,
+                      "CPH5BatchProcess: the result type must be trivially copyable");
+        std::size_t n = files.size();
+        mResults.assign(n, R());
+        mSucceeded.assign(n, false);
+        memset(&mProgress, 0, sizeof(mProgress));
+        mProgress.filesTotal = n;
+        mStart = std::chrono::steady_clock::now();
+        mLastReport = mStart;
+
+        // Largest files first.
+        std::vector<uint64_t> sizes(n, 0);
+        for (std::size_t i = 0; i < n; ++i) {
+            std::error_code ec;
+            uintmax_t size = std::filesystem::file_size(files[i], ec);
+            sizes[i] = ec ? 0 : static_cast<uint64_t>(size);
+            mProgress.bytesTotal += sizes[i];
+        }
+        mOrder.resize(n);
+        for (std::size_t i = 0; i < n; ++i)
+            mOrder[i] = i;
+        std::stable_sort(mOrder.begin(), mOrder.end(),
+                         [&](std::size_t a, std::size_t b) { return sizes[a] > sizes[b]; });
+
+        if (n > 0) {
+            int workers = mNumWorkers;
+            if (static_cast<std::size_t>(workers) > n)
+                workers = static_cast<int>(n);
+#ifdef H5_HAVE_THREADSAFE
+            if (mUseThreads)
+                runThreads(files, sizes, workers);
+            else
+#endif
+            runProcesses(files, sizes, workers);
+        }
+        mProgress.elapsed = secondsSinceStart();
+        if (mProgressCallback)
+            mProgressCallback(mProgress);
+        return mResults;
+    }
+
+    /*!
+     * \brief Returns whether a file of the last run was processed.
+     * \param i Index of the file in the list given to run.
+     * \return True if its result is valid.
+     */
+    bool succeeded(std::size_t i) const {
+        return i < mSucceeded.size() && mSucceeded[i];
+    }
+
+    /*!
+     * \brief Returns the progress of the last (or current) run.
+     * \return Progress, final once run returns.
+     */
+    const CPH5BatchProgress &getProgress() const {
+        return mProgress;
+    }
+
+    /*!
+     * \brief Combines the results of the files of the last run that were
+     *        processed.
+     * \param init Initial value.
+     * \param merge Called as merge(R &total, const R &fileResult) for every
+     *        file in list order.
+     * \return The merged result.
+     */
+    template<class Merge>
+    R merge(R init, Merge fn) const {
+        for (std::size_t i = 0; i < mResults.size(); ++i) {
+            if (mSucceeded[i])
+                fn(init, static_cast<const R&>(mResults[i]));
+        }
+        return init;
+    }
+
+    /*!
+     * \brief Lists the files of a directory with a given extension, sorted
+     *        by name.
+     * \param directory Directory to list.
+     * \param extension Extension to keep, including the dot; empty for all
+     *        regular files.
+     * \param recursive True to descend into sub-directories.
+     * \return Paths of the files.
+     */
+    static std::vector<std::string> listFiles(const std::string &directory,
+                                              const std::string &extension = ".h5",
+                                              bool recursive = false) {
+        std::vector<std::string> files;
+        std::error_code ec;
+        if (recursive) {
+            for (std::filesystem::recursive_directory_iterator it(directory, ec), end;
+                 !ec && it != end; it.increment(ec)) {
+                addFile(*it, extension, files);
+            }
+        } else {
+            for (std::filesystem::directory_iterator it(directory, ec), end;
+                 !ec && it != end; it.increment(ec)) {
+                addFile(*it, extension, files);
+            }
+        }
+        std::sort(files.begin(), files.end());
+        return files;
+    }
+
+private:
+
+    // Disable copy & assignment
+    CPH5BatchProcess(const CPH5BatchProcess &other);
+    CPH5BatchProcess &operator=(const CPH5BatchProcess &other);
+
+    // What a worker sends back for every file.
+    struct Record
+    {
+        uint64_t index;
+        uint64_t ok;
+        R result;
+    };
+
+    static void addFile(const std::filesystem::directory_entry &entry,
+                        const std::string &extension,
+                        std::vector<std::string> &files) {
+        std::error_code ec;
+        if (!entry.is_regular_file(ec))
+            return;
+        if (!extension.empty() && entry.path().extension() != extension)
+            return;
+        files.push_back(entry.path().string());
+    }
+
+    double secondsSinceStart() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - mStart).count();
+    }
+
+    // Worker loop: processes files until the counter runs out, handing
+    // every record to emit.
+    template<class Emit>
+    void work(const std::vector<std::string> &files,
+              std::atomic<uint64_t> &next,
+              Emit emit) {
+        G root;
+        uint64_t k;
+        while ((k = next.fetch_add(1)) < mOrder.size()) {
+            Record record = Record();
+            record.index = mOrder[k];
+            try {
+                if (root.rebindFile(files[record.index], true)) {
+                    record.result = mFunction(root, files[record.index]);
+                    record.ok = 1;
+                }
+            } catch (...) {
+                // Counted as failed
+            }
+            emit(record);
+        }
+        try {
+            root.close();
+        } catch (...) {
+            // NOOP
+        }
+    }
+
+    void collect(const Record &record, const std::vector<uint64_t> &sizes) {
+        if (record.index >= mResults.size() || mProgress.filesDone >= mResults.size())
+            return;
+        if (record.ok) {
+            mResults[record.index] = record.result;
+            mSucceeded[record.index] = true;
+        } else {
+            ++mProgress.filesFailed;
+        }
+        ++mProgress.filesDone;
+        mProgress.bytesDone += sizes[record.index];
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (mProgressCallback
+                && std::chrono::duration<double>(now - mLastReport).count() >= mProgressInterval
+                && mProgress.filesDone < mProgress.filesTotal) {
+            mLastReport = now;
+            mProgress.elapsed = secondsSinceStart();
+            mProgressCallback(mProgress);
+        }
+    }
+
+    void runProcesses(const std::vector<std::string> &files,
+                      const std::vector<uint64_t> &sizes,
+                      int workers) {
+        void *shared = mmap(0, sizeof(std::atomic<uint64_t>), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (shared == MAP_FAILED) {
+            throw std::runtime_error("CPH5BatchProcess: could not map shared memory");
+        }
+        std::atomic<uint64_t> *pNext = new (shared) std::atomic<uint64_t>(0);
+
+        std::vector<pid_t> pids;
+        std::vector<int> fds;
+        {
+            // Held across the forks so that no thread of this process is
+            // inside the HDF5 library, holding its global mutex, while a
+            // worker is forked.
+            CPH5LibraryLock lock;
+            for (int w = 0; w < workers; ++w) {
+                int pipeFds[2];
+                if (pipe(pipeFds) != 0)
+                    break;
+                pid_t pid = fork();
+                if (pid < 0) {
+                    close(pipeFds[0]);
+                    close(pipeFds[1]);
+                    break;
+                }
+                if (pid == 0) {
+                    CPH5LibraryLock::resetAfterFork();
+                    close(pipeFds[0]);
+                    for (std::size_t i = 0; i < fds.size(); ++i)
+                        close(fds[i]);
+                    int out = pipeFds[1];
+                    work(files, *pNext, [out](const Record &record) {
+                        const char *pos = reinterpret_cast<const char*>(&record);
+                        std::size_t left = sizeof(Record);
+                        while (left > 0) {
+                            ssize_t n = write(out, pos, left);
+                            if (n < 0 && errno == EINTR)
+                                continue;
+                            if (n <= 0)
+                                _exit(1);
+                            pos += n;
+                            left -= static_cast<std::size_t>(n);
+                        }
+                    });
+                    close(out);
+                    _exit(0);
+                }
+                close(pipeFds[1]);
+                pids.push_back(pid);
+                fds.push_back(pipeFds[0]);
+            }
+        }
+
+        if (pids.empty()) {
+            // Could not fork at all, work in this process instead.
+            work(files, *pNext, [&](const Record &record) { collect(record, sizes); });
+        }
+
+        // Read the records as they come, until every worker hung up.
+        std::vector<std::vector<char> > pending(fds.size());
+        std::vector<struct pollfd> polls(fds.size());
+        std::size_t open = fds.size();
+        char buf[65536];
+        while (open > 0) {
+            for (std::size_t i = 0; i < fds.size(); ++i) {
+                polls[i].fd = fds[i];
+                polls[i].events = POLLIN;
+                polls[i].revents = 0;
+            }
+            if (poll(polls.data(), polls.size(), -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            for (std::size_t i = 0; i < fds.size(); ++i) {
+                if (fds[i] < 0 || polls[i].revents == 0)
+                    continue;
+                ssize_t got = read(fds[i], buf, sizeof(buf));
+                if (got < 0 && errno == EINTR)
+                    continue;
+                if (got <= 0) {
+                    close(fds[i]);
+                    fds[i] = -1;
+                    --open;
+                    continue;
+                }
+                pending[i].insert(pending[i].end(), buf, buf + got);
+                std::size_t used = 0;
+                while (pending[i].size() - used >= sizeof(Record)) {
+                    Record record;
+                    memcpy(&record, pending[i].data() + used, sizeof(Record));
+                    collect(record, sizes);
+                    used += sizeof(Record);
+                }
+                pending[i].erase(pending[i].begin(), pending[i].begin() + used);
+            }
+        }
+        for (std::size_t i = 0; i < pids.size(); ++i) {
+            int status = 0;
+            while (waitpid(pids[i], &status, 0) < 0 && errno == EINTR) {} // NOOP
+        }
+        munmap(shared, sizeof(std::atomic<uint64_t>));
+
+        // Files claimed by a worker that died never reported back.
+        std::size_t missing = mProgress.filesTotal - mProgress.filesDone;
+        mProgress.filesFailed += missing;
+        mProgress.filesDone += missing;
+    }
+
+#ifdef H5_HAVE_THREADSAFE
+    void runThreads(const std::vector<std::string> &files,
+                    const std::vector<uint64_t> &sizes,
+                    int workers) {
+        std::atomic<uint64_t> next(0);
+        std::mutex collectMutex;
+        std::vector<std::thread> threads;
+        for (int w = 0; w < workers; ++w) {
+            threads.push_back(std::thread([&]() {
+                work(files, next, [&](const Record &record) {
+                    std::lock_guard<std::mutex> lock(collectMutex);
+                    collect(record, sizes);
+                });
+            }));
+        }
+        for (std::size_t i = 0; i < threads.size(); ++i)
+            threads[i].join();
+    }
+#endif
+
+    Function mFunction;
+    int mNumWorkers;
+    bool mUseThreads;
+    ProgressCallback mProgressCallback;
+    double mProgressInterval;
+    CPH5BatchProgress mProgress;
+    std::chrono::steady_clock::time_point mStart;
+    std::chrono::steady_clock::time_point mLastReport;
+    std::vector<std::size_t> mOrder;
+    std::vector<R> mResults;
+    std::vector<bool> mSucceeded;
+};
+
+#endif // _WIN32
+
+#endif // CPH5BATCH_H
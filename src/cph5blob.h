@@ -0,0 +1,657 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5BLOB_H
+#define CPH5BLOB_H
+
+#include "cph5utilities.h"
+#include "cph5group.h"
+#include "cph5dataset.h"
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+/*!
+ * \brief The CPH5ByteSpan struct is a non-owning view of a block of bytes,
+ *        used to hand binary records to and from the blob datasets without
+ *        copying them.
+ */
+struct CPH5ByteSpan
+{
+    const void *data;
+    std::size_t size;
+};
+
+
+/*!
+ * \brief The CPH5ByteArena class is a simple bump allocator for the bytes
+ *        read from variable length datasets. Every allocation is released at
+ *        once with reset() (or destruction), so reading thousands of
+ *        records costs a handful of heap allocations instead of one per
+ *        record.
+ *
+ * The arena can either own its memory, growing by blocks as needed, or be
+ * laid over a caller supplied buffer, in which case it never grows and
+ * allocate() returns 0 once the buffer is exhausted.
+ */
+class CPH5ByteArena
+{
+public:
+
+    /*!
+     * \brief Constructor for an arena that owns its memory.
+     * \param blockSize Size of each block allocated when the arena grows.
+     *        Requests larger than this get a block of their own.
+     */
+    explicit CPH5ByteArena(std::size_t blockSize = 1048576) // Default: 1MB
+        : mpCur(0),
+          mRemaining(0),
+          mBlockSize(blockSize),
+          mUsed(0),
+          mExternal(false),
+          mpExternal(0),
+          mCapacity(0)
+    {} // NOOP
+
+    /*!
+     * \brief Constructor for an arena laid over a caller supplied buffer.
+     * \param buffer Buffer to allocate from. Must outlive the arena.
+     * \param capacity Size of the buffer in bytes.
+     */
+    CPH5ByteArena(void *buffer, std::size_t capacity)
+        : mpCur(static_cast<char*>(buffer)),
+          mRemaining(capacity),
+          mBlockSize(0),
+          mUsed(0),
+          mExternal(true),
+          mpExternal(static_cast<char*>(buffer)),
+          mCapacity(capacity)
+    {} // NOOP
+
+    /*!
+     * \brief Allocates n bytes from the arena.
+     * \param n Number of bytes.
+     * \return Pointer to the bytes, or 0 if an external buffer is exhausted.
+     */
+    void *allocate(std::size_t n) {
+        if (n > mRemaining) {
+            if (mExternal) {
+                return 0;
+            }
+            std::size_t size = n > mBlockSize ? n : mBlockSize;
+            mBlocks.push_back(std::unique_ptr<char[]>(new char[size]));
+            mpCur = mBlocks.back().get();
+            mRemaining = size;
+        }
+        void *ret = mpCur;
+        mpCur += n;
+        mRemaining -= n;
+        mUsed += n;
+        return ret;
+    }
+
+    /*!
+     * \brief Releases every allocation made from the arena. An owning arena
+     *        that had to grow more than once coalesces into one block large
+     *        enough for everything it held, so the next fill of the same
+     *        size does not allocate at all.
+     */
+    void reset() {
+        if (mExternal) {
+            mpCur = mpExternal;
+            mRemaining = mCapacity;
+        } else if (!mBlocks.empty()) {
+            if (mBlocks.size() > 1) {
+                if (mUsed > mBlockSize) {
+                    mBlockSize = mUsed;
+                }
+                mBlocks.clear();
+                mBlocks.push_back(std::unique_ptr<char[]>(new char[mBlockSize]));
+                mpCur = mBlocks.back().get();
+                mRemaining = mBlockSize;
+            } else {
+                mRemaining += mpCur - mBlocks.back().get();
+                mpCur = mBlocks.back().get();
+            }
+        }
+        mUsed = 0;
+    }
+
+    /*!
+     * \brief Returns the number of bytes handed out since the last reset.
+     * \return Number of bytes in use.
+     */
+    std::size_t bytesUsed() const {
+        return mUsed;
+    }
+
+    /*!
+     * \brief Allocation callback for H5Pset_vlen_mem_manager.
+     */
+    static void *h5Allocate(std::size_t size, void *info) {
+        return static_cast<CPH5ByteArena*>(info)->allocate(size);
+    }
+
+    /*!
+     * \brief Free callback for H5Pset_vlen_mem_manager. Does nothing, the
+     *        memory is released by reset().
+     */
+    static void h5Free(void * /*mem*/, void * /*info*/) {} // NOOP
+
+private:
+
+    // Disable copy & assignment
+    CPH5ByteArena(const CPH5ByteArena &other);
+    CPH5ByteArena &operator=(const CPH5ByteArena &other);
+
+    std::vector<std::unique_ptr<char[]> > mBlocks;
+    char *mpCur;
+    std::size_t mRemaining;
+    std::size_t mBlockSize;
+    std::size_t mUsed;
+    bool mExternal;
+    char *mpExternal;
+    std::size_t mCapacity;
+};
+
+
+/*!
+ * \brief The CPH5BlobDatasetBase class holds the functionality common to the
+ *        one dimensional, extendible binary record datasets: creating or
+ *        opening the H5::DataSet, extending it for appends and setting up
+ *        the record selections. It is not meant to be used directly, see
+ *        CPH5OpaqueDataset and CPH5VarLenBytes.
+ *
+ * Blob datasets are leaves of the group tree and do not take part in the
+ * CPH5TreeNode indexing interface.
+ */
+class CPH5BlobDatasetBase : public CPH5GroupMember, public CPH5DatasetIdBase
+{
+public:
+
+    /*!
+     * \brief Destructor. Calls closeR.
+     */
+    virtual ~CPH5BlobDatasetBase() {
+        closeR();
+    }
+
+    /*!
+     * \brief Recursive open function called from the parent group. Creates
+     *        the dataset with zero records or opens it and reads the number
+     *        of records stored.
+     * \param create Flag for whether to create the dataset or open it.
+     */
+    void openR(bool create) {
+        if (mpGroupParent == 0)
+            return;
+        if (create) {
+            hsize_t dims[1] = {0};
+            hsize_t maxDims[1] = {H5S_UNLIMITED};
+            H5::DataSpace space(1, dims, maxDims);
+            mPropList.setChunk(1, &mChunkSize);
+            mpDataSet = mpGroupParent->createDataSet(mName, mType, space, mPropList);
+            mNumRecords = 0;
+        } else {
+            mpDataSet = mpGroupParent->openDataSet(mName);
+            H5::DataSpace filespace(mpDataSet->getSpace());
+            if (filespace.getSimpleExtentNdims() != 1) {
+                // Future: proper error. For now just return
+                return;
+            }
+            filespace.getSimpleExtentDims(&mNumRecords);
+            typeOpened(mpDataSet->getDataType());
+        }
+    }
+
+    /*!
+     * \brief Recursive close function. Deletes the H5::DataSet if it exists.
+     */
+    void closeR() {
+        if (mpDataSet != 0) {
+            mpDataSet->close();
+            delete mpDataSet;
+            mpDataSet = 0;
+        }
+    }
+
+    /*!
+     * \brief Sets the number of records per chunk. Blob datasets are always
+     *        chunked since they are extendible. Must be called before the
+     *        file is created.
+     * \param records Number of records in each chunk.
+     */
+    void setChunkSize(hsize_t records) {
+        mChunkSize = records;
+    }
+
+    /*!
+     * \brief Sets the compression to use to store this dataset in the target
+     *        HDF5 file. Must be called before the file is created.
+     * \param level Integer with the level of compression (1-9) to use.
+     */
+    void setDeflateLevel(int level) {
+        mPropList.setDeflate(level);
+    }
+
+    /*!
+     * \brief Returns the number of records currently in the dataset.
+     * \return Number of records.
+     */
+    hsize_t getNumRecords() const {
+        return mNumRecords;
+    }
+
+    /*!
+     * \brief getDims Returns vector with the single dimension of the dataset.
+     * \return Vector of dimensions for this dataset.
+     */
+    std::vector<int> getDims() const {
+        return std::vector<int>(1, static_cast<int>(mNumRecords));
+    }
+
+    /*!
+     * \brief Returns a pointer to the H5::DataSet object maintained by this
+     *        object, or 0 if the file has not been opened or created.
+     * \return Pointer to H5::DataSet object.
+     */
+    H5::DataSet *getDataSet() const {
+        return mpDataSet;
+    }
+
+    CPH5LeafType getLeafType() const override {
+        return CPH5TreeNode::LT_IS_NOT_LEAF;
+    }
+
+    bool getValIfLeaf(void * /*p*/) override {
+        return false;
+    }
+
+    bool canIndexInto() const override {
+        return false;
+    }
+
+    CPH5TreeNode *indexInto(int /*i*/) override {
+        return 0;
+    }
+
+    int getIndexableSize() const override {
+        return 0;
+    }
+
+    CPH5LeafType getElementType() const override {
+        return CPH5TreeNode::LT_IS_NOT_LEAF;
+    }
+
+    int getMemorySizeBelow() const override {
+        return 0;
+    }
+
+    bool readAllBelow(void * /*p*/) override {
+        return false;
+    }
+
+    void *getMemoryLocation() const override {
+        return 0;
+    }
+
+    std::vector<std::string> getChildrenNames() const override {
+        return std::vector<std::string>();
+    }
+
+    CPH5TreeNode *getChildByName(std::string /*name*/) const override {
+        return 0;
+    }
+
+protected:
+
+    /*!
+     * \brief Constructor, registers with the parent group.
+     * \param parent The group to which this dataset belongs.
+     * \param name The name of the dataset visible in the HDF5 file.
+     * \param type The record type.
+     */
+    CPH5BlobDatasetBase(CPH5Group *parent,
+                        std::string name,
+                        H5::DataType type)
+        : CPH5GroupMember(name),
+          mpGroupParent(parent),
+          mpDataSet(0),
+          mNumRecords(0),
+          mChunkSize(1024)
+    {
+        mType = type;
+        if (mpGroupParent != 0)
+            mpGroupParent->registerChild(this);
+    }
+
+    /*!
+     * \brief Called when an existing dataset is opened, with the type found
+     *        in the file. Subclasses can pick up parameters from it.
+     * \param type Type of the dataset in the target HDF5 file.
+     */
+    virtual void typeOpened(const H5::DataType & /*type*/) {} // NOOP
+
+    /*!
+     * \brief Throws if the dataset is not open or the record range is out of
+     *        bounds.
+     * \param start First record.
+     * \param count Number of records.
+     */
+    void checkRange(hsize_t start, hsize_t count) const {
+        if (mpDataSet == 0) {
+            throw std::runtime_error("Blob dataset " + mName + " is not open");
+        }
+        if (start + count > mNumRecords) {
+            throw std::runtime_error("Record range out of bounds for " + mName);
+        }
+    }
+
+    /*!
+     * \brief Extends the dataset by count records.
+     * \param count Number of records to add.
+     * \return Index of the first new record.
+     */
+    hsize_t grow(hsize_t count) {
+        if (mpDataSet == 0) {
+            throw std::runtime_error("Blob dataset " + mName + " is not open");
+        }
+        hsize_t start = mNumRecords;
+        hsize_t newDims[1] = {mNumRecords + count};
+        mpDataSet->extend(newDims);
+        mNumRecords += count;
+        return start;
+    }
+
+    /*!
+     * \brief Sets up the file and memory spaces for a contiguous range of
+     *        records.
+     * \param start First record.
+     * \param count Number of records.
+     * \param filespace File space to select into.
+     * \param memspace Memory space to create.
+     */
+    void selectRecords(hsize_t start,
+                       hsize_t count,
+                       H5::DataSpace &filespace,
+                       H5::DataSpace &memspace) const {
+        filespace = mpDataSet->getSpace();
+        filespace.selectHyperslab(H5S_SELECT_SET, &count, &start);
+        memspace = H5::DataSpace(1, &count);
+    }
+
+    CPH5Group *mpGroupParent;
+    H5::DataSet *mpDataSet;
+    H5::DataType mType;
+    H5::DSetCreatPropList mPropList;
+    hsize_t mNumRecords;
+    hsize_t mChunkSize;
+
+private:
+
+    // Disable copy & assignment
+    CPH5BlobDatasetBase(const CPH5BlobDatasetBase &other);
+    CPH5BlobDatasetBase &operator=(const CPH5BlobDatasetBase &other);
+};
+
+
+/*!
+ * \brief The CPH5OpaqueDataset class is an extendible list of fixed size
+ *        binary records stored with an H5T_OPAQUE type. Records are written
+ *        straight from, and read straight into, caller memory, so raw
+ *        instrument packets can be archived byte for byte without padding
+ *        them into a numeric array.
+ *
+ * Example: <pre>
+ * CPH5OpaqueDataset packets(this, "packets", 1024, "CCSDS frame");
+ * ...
+ * packets.appendRecords(frameBuffer, numFrames);
+ * </pre>
+ */
+class CPH5OpaqueDataset : public CPH5BlobDatasetBase
+{
+public:
+
+    /*!
+     * \brief Constructor.
+     * \param parent The group to which this dataset belongs.
+     * \param name The name of the dataset visible in the HDF5 file.
+     * \param recordSize Size of each record in bytes. When an existing file
+     *        is opened the size stored in the file is used instead.
+     * \param tag Optional description stored with the opaque type.
+     */
+    CPH5OpaqueDataset(CPH5Group *parent,
+                      std::string name,
+                      std::size_t recordSize,
+                      std::string tag = std::string())
+        : CPH5BlobDatasetBase(parent, name, makeType(recordSize, tag)),
+          mRecordSize(recordSize)
+    {} // NOOP
+
+    /*!
+     * \brief Returns the size of each record in bytes.
+     * \return Record size.
+     */
+    std::size_t getRecordSize() const {
+        return mRecordSize;
+    }
+
+    /*!
+     * \brief Writes count records starting at record start directly from
+     *        the given buffer. The records must already exist.
+     * \param start First record to write.
+     * \param count Number of records to write.
+     * \param src Buffer holding count * getRecordSize() bytes.
+     */
+    void writeRecords(hsize_t start, hsize_t count, const void *src) {
+        checkRange(start, count);
+        if (count == 0)
+            return;
+        H5::DataSpace filespace, memspace;
+        selectRecords(start, count, filespace, memspace);
+        mpDataSet->write(src, mType, memspace, filespace);
+    }
+
+    /*!
+     * \brief Appends a batch of count records to the end of the dataset
+     *        directly from the given buffer.
+     * \param src Buffer holding count * getRecordSize() bytes.
+     * \param count Number of records to append.
+     * \return Index of the first appended record.
+     */
+    hsize_t appendRecords(const void *src, hsize_t count) {
+        hsize_t start = grow(count);
+        writeRecords(start, count, src);
+        return start;
+    }
+
+    /*!
+     * \brief Reads count records starting at record start directly into the
+     *        given buffer.
+     * \param start First record to read.
+     * \param count Number of records to read.
+     * \param dst Buffer with room for count * getRecordSize() bytes.
+     */
+    void readRecords(hsize_t start, hsize_t count, void *dst) {
+        checkRange(start, count);
+        if (count == 0)
+            return;
+        H5::DataSpace filespace, memspace;
+        selectRecords(start, count, filespace, memspace);
+        mpDataSet->read(dst, mType, memspace, filespace);
+    }
+
+protected:
+
+    /*!
+     * \brief Picks up the record size of an existing dataset.
+     * \param type Type of the dataset in the target HDF5 file.
+     */
+    void typeOpened(const H5::DataType &type) override {
+        mType = type;
+        mRecordSize = type.getSize();
+    }
+
+private:
+
+    static H5::DataType makeType(std::size_t recordSize, const std::string &tag) {
+        H5::DataType type(H5T_OPAQUE, recordSize);
+        if (!tag.empty()) {
+            type.setTag(tag);
+        }
+        return type;
+    }
+
+    std::size_t mRecordSize;
+};
+
+
+/*!
+ * \brief The CPH5VarLenBytes class is an extendible list of variable length
+ *        byte strings (HDF5 variable length sequences of uint8), suitable
+ *        for packets of differing size. Unlike CPH5VarLenStr the bytes may
+ *        contain embedded NULs.
+ *
+ * Writes take CPH5ByteSpans pointing into caller memory; only the small
+ * sequence descriptors are built, the bytes themselves are not copied.
+ * Reads place the bytes either into a CPH5ByteArena or packed back to back
+ * into a caller buffer, in both cases with a single allocation strategy
+ * instead of one heap allocation per record.
+ */
+class CPH5VarLenBytes : public CPH5BlobDatasetBase
+{
+public:
+
+    /*!
+     * \brief Constructor.
+     * \param parent The group to which this dataset belongs.
+     * \param name The name of the dataset visible in the HDF5 file.
+     */
+    CPH5VarLenBytes(CPH5Group *parent, std::string name)
+        : CPH5BlobDatasetBase(parent, name, H5::VarLenType(&H5::PredType::NATIVE_UINT8))
+    {} // NOOP
+
+    /*!
+     * \brief Writes count records starting at record start. The records
+     *        must already exist.
+     * \param start First record to write.
+     * \param spans Array of count spans holding the bytes of each record.
+     * \param count Number of records to write.
+     */
+    void write(hsize_t start, const CPH5ByteSpan *spans, hsize_t count) {
+        checkRange(start, count);
+        if (count == 0)
+            return;
+        mDescriptors.resize(count);
+        for (hsize_t i = 0; i < count; ++i) {
+            mDescriptors[i].len = spans[i].size;
+            mDescriptors[i].p = const_cast<void*>(spans[i].data);
+        }
+        H5::DataSpace filespace, memspace;
+        selectRecords(start, count, filespace, memspace);
+        mpDataSet->write(mDescriptors.data(), mType, memspace, filespace);
+    }
+
+    /*!
+     * \brief Appends a batch of records to the end of the dataset.
+     * \param spans Array of count spans holding the bytes of each record.
+     * \param count Number of records to append.
+     * \return Index of the first appended record.
+     */
+    hsize_t append(const CPH5ByteSpan *spans, hsize_t count) {
+        hsize_t start = grow(count);
+        write(start, spans, count);
+        return start;
+    }
+
+    /*!
+     * \brief Appends a single record to the end of the dataset.
+     * \param data Bytes of the record.
+     * \param size Number of bytes.
+     * \return Index of the appended record.
+     */
+    hsize_t append(const void *data, std::size_t size) {
+        CPH5ByteSpan span = {data, size};
+        return append(&span, 1);
+    }
+
+    /*!
+     * \brief Returns the total number of bytes held by a range of records,
+     *        i.e. the buffer size needed by readInto.
+     * \param start First record.
+     * \param count Number of records.
+     * \return Number of bytes.
+     */
+    hsize_t getBytesNeeded(hsize_t start, hsize_t count) {
+        checkRange(start, count);
+        if (count == 0)
+            return 0;
+        H5::DataSpace filespace, memspace;
+        selectRecords(start, count, filespace, memspace);
+        return mpDataSet->getVlenBufSize(mType, filespace);
+    }
+
+    /*!
+     * \brief Reads count records starting at record start, placing the bytes
+     *        in the given arena. The returned spans point into the arena and
+     *        remain valid until it is reset or destroyed.
+     * \param start First record to read.
+     * \param count Number of records to read.
+     * \param arena Arena to allocate the record bytes from.
+     * \param spans Array of count spans to fill.
+     */
+    void read(hsize_t start,
+              hsize_t count,
+              CPH5ByteArena &arena,
+              CPH5ByteSpan *spans) {
+        checkRange(start, count);
+        if (count == 0)
+            return;
+        mDescriptors.resize(count);
+        H5::DSetMemXferPropList xfer;
+        H5Pset_vlen_mem_manager(xfer.getId(),
+                                &CPH5ByteArena::h5Allocate, &arena,
+                                &CPH5ByteArena::h5Free, &arena);
+        H5::DataSpace filespace, memspace;
+        selectRecords(start, count, filespace, memspace);
+        mpDataSet->read(mDescriptors.data(), mType, memspace, filespace, xfer);
+        for (hsize_t i = 0; i < count; ++i) {
+            spans[i].data = mDescriptors[i].p;
+            spans[i].size = mDescriptors[i].len;
+        }
+    }
+
+    /*!
+     * \brief Reads count records starting at record start, packing their
+     *        bytes back to back into the caller buffer.
+     * \param start First record to read.
+     * \param count Number of records to read.
+     * \param dst Buffer to store the bytes into.
+     * \param capacity Size of dst in bytes, see getBytesNeeded.
+     * \param spans Array of count spans to fill, pointing into dst.
+     */
+    void readInto(hsize_t start,
+                  hsize_t count,
+                  void *dst,
+                  std::size_t capacity,
+                  CPH5ByteSpan *spans) {
+        if (getBytesNeeded(start, count) > capacity) {
+            throw std::runtime_error("Buffer too small to read records of " + mName);
+        }
+        CPH5ByteArena arena(dst, capacity);
+        read(start, count, arena, spans);
+    }
+
+private:
+
+    std::vector<hvl_t> mDescriptors;
+};
+
+
+#endif // CPH5BLOB_H
@@ -0,0 +1,375 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5CHUNKBUFFER_H
+#define CPH5CHUNKBUFFER_H
+
+#include "cph5utilities.h"
+#include "cph5dataset.h"
+
+#include <list>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+
+/*!
+ * \brief The CPH5ChunkWriteBuffer class collects writes to a chunked
+ *        dataset in memory, a chunk at a time, and writes each chunk to the
+ *        file once.
+ *
+ * A write covering only part of a compressed chunk makes the HDF5 library
+ * read, decompress, modify, recompress and rewrite the whole chunk. Writing
+ * a 2-D dataset row by row therefore recompresses every chunk once per row.
+ * With this buffer the rows are assembled in memory and a chunk goes to the
+ * file as a single aligned write as soon as every one of its elements has
+ * been written, so it is compressed exactly once.
+ *
+ * Chunks still incomplete on flush() (or destruction) are merged with the
+ * contents of the file and written once. When the buffered chunks exceed
+ * the memory cap, the least recently written chunk is flushed early the
+ * same way.
+ *
+ * Example: <pre>
+ * CPH5ChunkWriteBuffer<uint16_t, 2> buffer(file.image);
+ * for (hsize_t row = 0; row < height; ++row)
+ *     buffer.writeRow(row, rowData);
+ * buffer.flush();
+ * </pre>
+ */
+template<class T, const int nDims>
+class CPH5ChunkWriteBuffer
+{
+public:
+
+    /*!
+     * \brief Constructor.
+     * \param ds Root-order chunked dataset, open.
+     * \param memoryCap Maximum number of bytes of chunk data to hold before
+     *        flushing chunks early. Defaults to 64MB.
+     */
+    explicit CPH5ChunkWriteBuffer(CPH5Dataset<T, nDims> &ds,
+                                  std::size_t memoryCap = 67108864)
+        : mDataset(ds),
+          mMemoryCap(memoryCap),
+          mBufferedBytes(0),
+          mNumChunkWrites(0)
+    {
+        if (!mDataset.getChunkDims(mChunk) || mDataset.getDataSet() == 0) {
+            throw std::runtime_error("CPH5ChunkWriteBuffer needs an open, chunked dataset");
+        }
+        mElemSize = mDataset.getDataType().getSize();
+        mChunkElements = 1;
+        for (int d = 0; d < nDims; ++d) {
+            mChunkElements *= mChunk[d];
+        }
+        // Chunk grid wide enough for the maximum dimensions, for the keys.
+        // Unlimited dimensions share the 64 bits of the key (capped at 63
+        // bits, which only matters for 1-D where the size is not used).
+        hsize_t dims[nDims];
+        hsize_t maxDims[nDims];
+        mDataset.getDataSet()->getSpace().getSimpleExtentDims(dims, maxDims);
+        const int unlimitedBits = nDims > 1 ? 64 / nDims : 63;
+        for (int d = 0; d < nDims; ++d) {
+            mGrid[d] = maxDims[d] == H5S_UNLIMITED
+                    ? (static_cast<uint64_t>(1) << unlimitedBits)
+                    : (maxDims[d] + mChunk[d] - 1) / mChunk[d];
+        }
+    }
+
+    /*!
+     * \brief Destructor. Flushes the remaining chunks; errors are swallowed,
+     *        call flush() explicitly to see them.
+     */
+    ~CPH5ChunkWriteBuffer() {
+        try {
+            flush();
+        } catch (...) {
+            // NOOP
+        }
+    }
+
+    /*!
+     * \brief Buffers a rectangular block of raw elements.
+     * \param start Array of nDims indices of the first element of the block.
+     * \param count Array of nDims sizes of the block.
+     * \param src Elements of the block, row major.
+     */
+    void write(const hsize_t *start, const hsize_t *count, const void *src) {
+        std::vector<int> dims = mDataset.getDims();
+        hsize_t first[nDims], last[nDims];
+        for (int d = 0; d < nDims; ++d) {
+            if (count[d] == 0)
+                return;
+            if (start[d] + count[d] > static_cast<hsize_t>(dims[d])) {
+                throw std::runtime_error("Block out of bounds for " + mDataset.getName());
+            }
+            first[d] = start[d] / mChunk[d];
+            last[d] = (start[d] + count[d] - 1) / mChunk[d];
+        }
+        hsize_t srcStride[nDims];
+        srcStride[nDims - 1] = 1;
+        for (int d = nDims - 2; d >= 0; --d) {
+            srcStride[d] = srcStride[d + 1] * count[d + 1];
+        }
+
+        // Visit every chunk overlapping the block
+        hsize_t chunkIdx[nDims];
+        memcpy(chunkIdx, first, sizeof(chunkIdx));
+        for (;;) {
+            Chunk &chunk = getChunk(chunkIdx);
+            hsize_t lo[nDims], n[nDims];
+            for (int d = 0; d < nDims; ++d) {
+                hsize_t c0 = chunkIdx[d] * mChunk[d];
+                lo[d] = start[d] > c0 ? start[d] : c0;
+                hsize_t hi = start[d] + count[d] < c0 + mChunk[d] ? start[d] + count[d] : c0 + mChunk[d];
+                n[d] = hi - lo[d];
+            }
+            copyIn(chunk, chunkIdx, lo, n, start, srcStride, static_cast<const char*>(src));
+            if (chunk.numWritten == expectedElements(chunkIdx, dims)) {
+                emit(chunk, false);
+            } else {
+                trim();
+            }
+
+            int d = nDims - 1;
+            for (; d >= 0; --d) {
+                if (++chunkIdx[d] <= last[d])
+                    break;
+                chunkIdx[d] = first[d];
+            }
+            if (d < 0)
+                break;
+        }
+    }
+
+    /*!
+     * \brief Buffers one row, i.e. index row of the first dimension and all
+     *        of the others.
+     * \param row Index in the first dimension.
+     * \param src Elements of the row.
+     */
+    void writeRow(hsize_t row, const void *src) {
+        std::vector<int> dims = mDataset.getDims();
+        hsize_t start[nDims] = {};
+        hsize_t count[nDims];
+        start[0] = row;
+        count[0] = 1;
+        for (int d = 1; d < nDims; ++d) {
+            count[d] = static_cast<hsize_t>(dims[d]);
+        }
+        write(start, count, src);
+    }
+
+    /*!
+     * \brief Writes every buffered chunk to the file, merging incomplete
+     *        ones with the contents of the file.
+     */
+    void flush() {
+        while (!mLru.empty()) {
+            emit(mChunks.at(mLru.back()), true);
+        }
+    }
+
+    /*!
+     * \brief Returns the number of bytes of chunk data currently buffered.
+     * \return Number of bytes.
+     */
+    std::size_t getBufferedBytes() const {
+        return mBufferedBytes;
+    }
+
+    /*!
+     * \brief Returns the number of chunk writes issued to the file so far.
+     * \return Number of writes.
+     */
+    std::size_t getNumChunkWrites() const {
+        return mNumChunkWrites;
+    }
+
+private:
+
+    // Disable copy & assignment
+    CPH5ChunkWriteBuffer(const CPH5ChunkWriteBuffer &other);
+    CPH5ChunkWriteBuffer &operator=(const CPH5ChunkWriteBuffer &other);
+
+    struct Chunk
+    {
+        uint64_t key;
+        hsize_t index[nDims];
+        std::vector<char> data;
+        std::vector<bool> written;
+        hsize_t numWritten;
+        std::list<uint64_t>::iterator lruPos;
+    };
+
+    uint64_t keyOf(const hsize_t *chunkIdx) const {
+        // Row major linear index of the chunk in mGrid. The size of the
+        // first dimension of the grid does not enter the index.
+        uint64_t key = chunkIdx[0];
+        for (int d = 1; d < nDims; ++d) {
+            key = key * mGrid[d] + chunkIdx[d];
+        }
+        return key;
+    }
+
+    Chunk &getChunk(const hsize_t *chunkIdx) {
+        uint64_t key = keyOf(chunkIdx);
+        typename ChunkMap::iterator it = mChunks.find(key);
+        if (it != mChunks.end()) {
+            mLru.splice(mLru.begin(), mLru, it->second.lruPos);
+            return it->second;
+        }
+        Chunk &chunk = mChunks[key];
+        chunk.key = key;
+        memcpy(chunk.index, chunkIdx, sizeof(chunk.index));
+        chunk.data.resize(mChunkElements * mElemSize);
+        chunk.written.assign(mChunkElements, false);
+        chunk.numWritten = 0;
+        mLru.push_front(key);
+        chunk.lruPos = mLru.begin();
+        mBufferedBytes += chunk.data.size();
+        return chunk;
+    }
+
+    /*!
+     * \brief Number of elements of a chunk inside the current extent.
+     */
+    hsize_t expectedElements(const hsize_t *chunkIdx, const std::vector<int> &dims) const {
+        hsize_t n = 1;
+        for (int d = 0; d < nDims; ++d) {
+            hsize_t c0 = chunkIdx[d] * mChunk[d];
+            hsize_t dim = static_cast<hsize_t>(dims[d]);
+            n *= c0 + mChunk[d] <= dim ? mChunk[d] : dim - c0;
+        }
+        return n;
+    }
+
+    /*!
+     * \brief Copies the part lo/n of a source block into a chunk buffer and
+     *        marks the elements as written.
+     */
+    void copyIn(Chunk &chunk, const hsize_t *chunkIdx,
+                const hsize_t *lo, const hsize_t *n,
+                const hsize_t *srcStart, const hsize_t *srcStride,
+                const char *src) {
+        hsize_t idx[nDims] = {};
+        for (;;) {
+            hsize_t srcOff = 0;
+            hsize_t dstOff = 0;
+            hsize_t dstStride = 1;
+            for (int d = nDims - 1; d >= 0; --d) {
+                hsize_t pos = lo[d] + idx[d];
+                srcOff += (pos - srcStart[d]) * srcStride[d];
+                dstOff += (pos - chunkIdx[d] * mChunk[d]) * dstStride;
+                dstStride *= mChunk[d];
+            }
+            hsize_t run = n[nDims - 1];
+            memcpy(chunk.data.data() + dstOff * mElemSize,
+                   src + srcOff * mElemSize,
+                   run * mElemSize);
+            for (hsize_t k = 0; k < run; ++k) {
+                if (!chunk.written[dstOff + k]) {
+                    chunk.written[dstOff + k] = true;
+                    ++chunk.numWritten;
+                }
+            }
+            int d = nDims - 2;
+            for (; d >= 0; --d) {
+                if (++idx[d] < n[d])
+                    break;
+                idx[d] = 0;
+            }
+            if (d < 0)
+                break;
+        }
+    }
+
+    /*!
+     * \brief Writes a chunk to the file and drops it from the buffer. If
+     *        merge is set and the chunk is incomplete, the elements not
+     *        written through the buffer are first read from the file.
+     */
+    void emit(Chunk &chunk, bool merge) {
+        std::vector<int> dims = mDataset.getDims();
+        hsize_t start[nDims], count[nDims];
+        hsize_t numElements = 1;
+        for (int d = 0; d < nDims; ++d) {
+            start[d] = chunk.index[d] * mChunk[d];
+            hsize_t dim = static_cast<hsize_t>(dims[d]);
+            count[d] = start[d] + mChunk[d] <= dim ? mChunk[d] : dim - start[d];
+            numElements *= count[d];
+        }
+        // Pack the part inside the extent, row major over count
+        std::vector<char> packed(numElements * mElemSize);
+        std::vector<bool> packedWritten(merge ? numElements : 0);
+        hsize_t idx[nDims] = {};
+        hsize_t out = 0;
+        for (;;) {
+            hsize_t off = 0;
+            for (int d = 0; d < nDims; ++d) {
+                off = off * mChunk[d] + idx[d];
+            }
+            hsize_t run = count[nDims - 1];
+            memcpy(packed.data() + out * mElemSize,
+                   chunk.data.data() + off * mElemSize,
+                   run * mElemSize);
+            if (merge) {
+                for (hsize_t k = 0; k < run; ++k) {
+                    packedWritten[out + k] = chunk.written[off + k];
+                }
+            }
+            out += run;
+            int d = nDims - 2;
+            for (; d >= 0; --d) {
+                if (++idx[d] < count[d])
+                    break;
+                idx[d] = 0;
+            }
+            if (d < 0)
+                break;
+        }
+        if (merge && chunk.numWritten < numElements) {
+            std::vector<char> existing(packed.size());
+            mDataset.readRawBlockUntracked(start, count, existing.data());
+            for (hsize_t k = 0; k < numElements; ++k) {
+                if (!packedWritten[k]) {
+                    memcpy(packed.data() + k * mElemSize,
+                           existing.data() + k * mElemSize,
+                           mElemSize);
+                }
+            }
+        }
+        mDataset.writeRawBlock(start, count, packed.data());
+        ++mNumChunkWrites;
+        mBufferedBytes -= chunk.data.size();
+        mLru.erase(chunk.lruPos);
+        mChunks.erase(chunk.key);
+    }
+
+    void trim() {
+        while (mBufferedBytes > mMemoryCap && mLru.size() > 1) {
+            emit(mChunks.at(mLru.back()), true);
+        }
+    }
+
+    typedef std::unordered_map<uint64_t, Chunk> ChunkMap;
+
+    CPH5Dataset<T, nDims> &mDataset;
+    hsize_t mChunk[nDims];
+    uint64_t mGrid[nDims];
+    hsize_t mChunkElements;
+    std::size_t mElemSize;
+    std::size_t mMemoryCap;
+    std::size_t mBufferedBytes;
+    std::size_t mNumChunkWrites;
+    ChunkMap mChunks;
+    std::list<uint64_t> mLru;
+};
+
+
+#endif // CPH5CHUNKBUFFER_H
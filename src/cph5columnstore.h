@@ -0,0 +1,482 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5COLUMNSTORE_H
+#define CPH5COLUMNSTORE_H
+
+#include "cph5utilities.h"
+#include "cph5group.h"
+#include "cph5comptype.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+/*!
+ * \brief The CPH5ColumnStore class stores a 1-D list of compound records
+ *        column by column: a group holding one chunked 1-D dataset per
+ *        member of the compound type, named after the member.
+ *
+ * It offers the record API of a 1-D CPH5Dataset of C (read, write, blocks,
+ * extend), reassembling records from the columns on reads and splitting
+ * them on writes, plus reads and writes of a single column that touch only
+ * that column's dataset. Since each column holds a single type, it can
+ * have its own filters and usually compresses much better than rows of
+ * mixed types.
+ *
+ * Records in memory have the packed layout of C::getCompType, as with
+ * CPH5Dataset::readRaw. Nested compound and array members are stored as
+ * single columns of their type.
+ *
+ * Example: <pre>
+ * struct TelemetryFile : public CPH5Group {
+ *     TelemetryFile() : CPH5Group(), telemetry(this, "telemetry") {
+ *         telemetry.setDeflateLevel(4);
+ *         telemetry.setColumnShuffle("temperature");
+ *     }
+ *     CPH5ColumnStore<Telemetry> telemetry;
+ * };
+ * ...
+ * file.telemetry.extendOnceAndWrite(&record);
+ * file.telemetry.readColumn("temperature", 0, n, temperatures.data());
+ * </pre>
+ */
+template<class C>
+class CPH5ColumnStore : public CPH5Group
+{
+public:
+
+    /*!
+     * \brief Constructor.
+     * \param parent The group to which this column store belongs.
+     * \param name The name of the group visible in the HDF5 file.
+     */
+    CPH5ColumnStore(CPH5Group *parent, std::string name)
+        : CPH5Group(parent, name),
+          mType(C().getCompType()),
+          mRecordSize(mType.getSize()),
+          mSize(0),
+          mMaxSize(H5S_UNLIMITED),
+          mChunkRows(16384),
+          mNumRecords(0)
+    {
+        int numMembers = mType.getNmembers();
+        for (int i = 0; i < numMembers; ++i) {
+            unsigned index = static_cast<unsigned>(i);
+            Column column;
+            column.name = mType.getMemberName(index);
+            column.type = mType.getMemberDataType(index);
+            column.offset = mType.getMemberOffset(index);
+            column.size = column.type.getSize();
+            column.deflateLevel = -1;
+            column.shuffle = false;
+            column.pDataSet = 0;
+            mColumns.push_back(column);
+        }
+    }
+
+    /*!
+     * \brief Destructor. Closes the column datasets.
+     */
+    ~CPH5ColumnStore() {
+        closeColumns();
+    }
+
+    /*!
+     * \brief Sets the initial and maximum number of records. Must be called
+     *        before the file is created. By default the store starts empty
+     *        and is extendible.
+     * \param dims Array of 1 initial size.
+     * \param maxDims Array of 1 maximum size, may be H5S_UNLIMITED.
+     */
+    void setDimensions(hsize_t dims[1], hsize_t maxDims[1]) {
+        mSize = dims[0];
+        mMaxSize = maxDims[0];
+    }
+
+    /*!
+     * \brief Sets the number of records in each chunk of every column. Must
+     *        be called before the file is created.
+     * \param chunkDims Array of 1 chunk size, 16384 by default.
+     */
+    void setChunkSize(hsize_t chunkDims[1]) {
+        mChunkRows = chunkDims[0];
+    }
+
+    /*!
+     * \brief Sets the compression of every column that has none of its own.
+     *        Must be called before the file is created.
+     * \param level Integer with the level of compression (1-9) to use.
+     */
+    void setDeflateLevel(int level) {
+        for (std::size_t i = 0; i < mColumns.size(); ++i) {
+            if (mColumns[i].deflateLevel < 0)
+                mColumns[i].deflateLevel = level;
+        }
+    }
+
+    /*!
+     * \brief Sets the compression of one column. Must be called before the
+     *        file is created.
+     * \param member Name of the member.
+     * \param level Integer with the level of compression (1-9) to use, 0
+     *        for none.
+     */
+    void setColumnDeflateLevel(const std::string &member, int level) {
+        column(member).deflateLevel = level;
+    }
+
+    /*!
+     * \brief Enables the shuffle filter of one column, which groups the
+     *        bytes of its elements by significance before compression. Must
+     *        be called before the file is created.
+     * \param member Name of the member.
+     * \param shuffle True to enable the filter.
+     */
+    void setColumnShuffle(const std::string &member, bool shuffle = true) {
+        column(member).shuffle = shuffle;
+    }
+
+    /*!
+     * \brief Returns the names of the columns, in member order.
+     * \return Member names.
+     */
+    std::vector<std::string> getColumnNames() const {
+        std::vector<std::string> names;
+        for (std::size_t i = 0; i < mColumns.size(); ++i)
+            names.push_back(mColumns[i].name);
+        return names;
+    }
+
+    /*!
+     * \brief Returns the compound type of the records in memory.
+     * \return The packed compound type of C.
+     */
+    H5::CompType getDataType() const {
+        return mType;
+    }
+
+    /*!
+     * \brief Returns the number of records.
+     * \return Number of records.
+     */
+    int getDimSize() const {
+        return static_cast<int>(mNumRecords);
+    }
+
+    /*!
+     * \brief Extends every column.
+     * \param numTimes How many records to extend the store by.
+     */
+    void extend(hsize_t numTimes) {
+        checkOpen();
+        hsize_t size = mNumRecords + numTimes;
+        for (std::size_t i = 0; i < mColumns.size(); ++i)
+            mColumns[i].pDataSet->extend(&size);
+        mNumRecords = size;
+    }
+
+    /*!
+     * \brief Extends the store by one record and writes it.
+     * \param src Record to write.
+     */
+    void extendOnceAndWrite(C *src) {
+        extend(1);
+        hsize_t start = mNumRecords - 1;
+        hsize_t count = 1;
+        writeBlock(&start, &count, src);
+    }
+
+    /*!
+     * \brief Extends the store by one record and writes it from the packed
+     *        layout.
+     * \param src Pointer to the packed record.
+     */
+    void extendOnceAndWriteRaw(const void *src) {
+        extend(1);
+        hsize_t start = mNumRecords - 1;
+        hsize_t count = 1;
+        writeRawBlock(&start, &count, src);
+    }
+
+    /*!
+     * \brief Reads every record.
+     * \param dst Array of getDimSize() records.
+     */
+    void read(C *dst) {
+        hsize_t start = 0;
+        hsize_t count = mNumRecords;
+        readBlock(&start, &count, dst);
+    }
+
+    /*!
+     * \brief Reads every record in the packed layout.
+     * \param dst Buffer of getDimSize() packed records.
+     */
+    void readRaw(void *dst) {
+        hsize_t start = 0;
+        hsize_t count = mNumRecords;
+        readRawBlock(&start, &count, dst);
+    }
+
+    /*!
+     * \brief Writes every record.
+     * \param src Array of getDimSize() records.
+     */
+    void write(C *src) {
+        hsize_t start = 0;
+        hsize_t count = mNumRecords;
+        writeBlock(&start, &count, src);
+    }
+
+    /*!
+     * \brief Writes every record from the packed layout.
+     * \param src Buffer of getDimSize() packed records.
+     */
+    void writeRaw(const void *src) {
+        hsize_t start = 0;
+        hsize_t count = mNumRecords;
+        writeRawBlock(&start, &count, src);
+    }
+
+    /*!
+     * \brief Reads a range of records.
+     * \param start Array of 1 index of the first record.
+     * \param count Array of 1 number of records.
+     * \param dst Array of count[0] records.
+     */
+    void readBlock(const hsize_t *start, const hsize_t *count, C *dst) {
+        std::vector<char> buf(static_cast<std::size_t>(count[0]) * mRecordSize);
+        readRawBlock(start, count, buf.data());
+        char *ptr = buf.data();
+        for (hsize_t i = 0; i < count[0]; ++i)
+            dst[i].latchAllAndMove(ptr);
+    }
+
+    /*!
+     * \brief Writes a range of records.
+     * \param start Array of 1 index of the first record.
+     * \param count Array of 1 number of records.
+     * \param src Array of count[0] records.
+     */
+    void writeBlock(const hsize_t *start, const hsize_t *count, C *src) {
+        std::vector<char> buf(static_cast<std::size_t>(count[0]) * mRecordSize);
+        char *ptr = buf.data();
+        for (hsize_t i = 0; i < count[0]; ++i)
+            src[i].copyAllAndMove(ptr);
+        writeRawBlock(start, count, buf.data());
+    }
+
+    /*!
+     * \brief Reads a range of records in the packed layout, one read of
+     *        each column.
+     * \param start Array of 1 index of the first record.
+     * \param count Array of 1 number of records.
+     * \param dst Buffer of count[0] packed records.
+     */
+    void readRawBlock(const hsize_t *start, const hsize_t *count, void *dst) {
+        checkRange(start[0], count[0]);
+        std::size_t n = static_cast<std::size_t>(count[0]);
+        if (n == 0)
+            return;
+        std::vector<char> buf;
+        char *records = static_cast<char*>(dst);
+        for (std::size_t c = 0; c < mColumns.size(); ++c) {
+            const Column &col = mColumns[c];
+            buf.resize(n * col.size);
+            readColumnBlock(col, start[0], count[0], buf.data(), col.type);
+            const char *src = buf.data();
+            char *out = records + col.offset;
+            for (std::size_t i = 0; i < n; ++i)
+                memcpy(out + i * mRecordSize, src + i * col.size, col.size);
+        }
+    }
+
+    /*!
+     * \brief Writes a range of records from the packed layout, one write of
+     *        each column.
+     * \param start Array of 1 index of the first record.
+     * \param count Array of 1 number of records.
+     * \param src Buffer of count[0] packed records.
+     */
+    void writeRawBlock(const hsize_t *start, const hsize_t *count, const void *src) {
+        checkRange(start[0], count[0]);
+        std::size_t n = static_cast<std::size_t>(count[0]);
+        if (n == 0)
+            return;
+        std::vector<char> buf;
+        const char *records = static_cast<const char*>(src);
+        for (std::size_t c = 0; c < mColumns.size(); ++c) {
+            const Column &col = mColumns[c];
+            buf.resize(n * col.size);
+            const char *in = records + col.offset;
+            char *out = buf.data();
+            for (std::size_t i = 0; i < n; ++i)
+                memcpy(out + i * col.size, in + i * mRecordSize, col.size);
+            writeColumnBlock(col, start[0], count[0], buf.data(), col.type);
+        }
+    }
+
+    /*!
+     * \brief Reads a range of one column, touching only that column.
+     * \param member Name of the member.
+     * \param start Index of the first record.
+     * \param count Number of records.
+     * \param dst Array of count elements of the member type.
+     */
+    void readColumn(const std::string &member, hsize_t start, hsize_t count, void *dst) {
+        const Column &col = column(member);
+        readColumn(member, start, count, dst, col.type);
+    }
+
+    /*!
+     * \brief Reads a range of one column into a different memory type, for
+     *        example a float member as doubles.
+     * \param member Name of the member.
+     * \param start Index of the first record.
+     * \param count Number of records.
+     * \param dst Array of count elements of memType.
+     * \param memType Datatype of the elements in memory.
+     */
+    void readColumn(const std::string &member, hsize_t start, hsize_t count,
+                    void *dst, const H5::DataType &memType) {
+        checkRange(start, count);
+        if (count > 0)
+            readColumnBlock(column(member), start, count, dst, memType);
+    }
+
+    /*!
+     * \brief Writes a range of one column, touching only that column.
+     * \param member Name of the member.
+     * \param start Index of the first record.
+     * \param count Number of records.
+     * \param src Array of count elements of the member type.
+     */
+    void writeColumn(const std::string &member, hsize_t start, hsize_t count, const void *src) {
+        const Column &col = column(member);
+        checkRange(start, count);
+        if (count > 0)
+            writeColumnBlock(col, start, count, src, col.type);
+    }
+
+protected:
+
+    /*!
+     * \brief Opens the group, then creates or opens a dataset per column and
+     *        picks up the number of records.
+     * \param create Flag for whether to create or open the group.
+     */
+    void openR(bool create) {
+        CPH5Group::openR(create);
+        if (getH5Group() == 0)
+            return;
+        for (std::size_t c = 0; c < mColumns.size(); ++c) {
+            Column &col = mColumns[c];
+            if (create) {
+                H5::DataSpace space(1, &mSize, &mMaxSize);
+                H5::DSetCreatPropList props;
+                hsize_t chunk = mChunkRows;
+                if (mMaxSize != H5S_UNLIMITED && chunk > mMaxSize)
+                    chunk = mMaxSize > 0 ? mMaxSize : 1;
+                props.setChunk(1, &chunk);
+                if (col.shuffle)
+                    props.setShuffle();
+                if (col.deflateLevel > 0)
+                    props.setDeflate(col.deflateLevel);
+                col.pDataSet = createDataSet(col.name, col.type, space, props);
+            } else {
+                col.pDataSet = openDataSet(col.name);
+            }
+        }
+        mNumRecords = 0;
+        if (!mColumns.empty() && mColumns[0].pDataSet != 0)
+            mColumns[0].pDataSet->getSpace().getSimpleExtentDims(&mNumRecords);
+    }
+
+    /*!
+     * \brief Closes the column datasets and then the group.
+     */
+    void closeR() {
+        closeColumns();
+        CPH5Group::closeR();
+    }
+
+private:
+
+    struct Column
+    {
+        std::string name;
+        H5::DataType type;
+        std::size_t offset;
+        std::size_t size;
+        int deflateLevel;
+        bool shuffle;
+        H5::DataSet *pDataSet;
+    };
+
+    Column &column(const std::string &member) {
+        for (std::size_t c = 0; c < mColumns.size(); ++c) {
+            if (mColumns[c].name == member)
+                return mColumns[c];
+        }
+        throw std::runtime_error("Column store " + getName() + " has no member " + member);
+    }
+
+    void closeColumns() {
+        for (std::size_t c = 0; c < mColumns.size(); ++c) {
+            if (mColumns[c].pDataSet != 0) {
+                mColumns[c].pDataSet->close();
+                delete mColumns[c].pDataSet;
+                mColumns[c].pDataSet = 0;
+            }
+        }
+    }
+
+    void checkOpen() const {
+        for (std::size_t c = 0; c < mColumns.size(); ++c) {
+            if (mColumns[c].pDataSet == 0) {
+                throw std::runtime_error("Column store " + getName() + " is not open");
+            }
+        }
+    }
+
+    void checkRange(hsize_t start, hsize_t count) const {
+        checkOpen();
+        if (start + count > mNumRecords) {
+            throw std::runtime_error("Record range out of bounds for " + getName());
+        }
+    }
+
+    void readColumnBlock(const Column &col, hsize_t start, hsize_t count,
+                         void *dst, const H5::DataType &memType) {
+        H5::DataSpace filespace(col.pDataSet->getSpace());
+        filespace.selectHyperslab(H5S_SELECT_SET, &count, &start);
+        H5::DataSpace memspace(1, &count);
+        col.pDataSet->read(dst, memType, memspace, filespace);
+    }
+
+    void writeColumnBlock(const Column &col, hsize_t start, hsize_t count,
+                          const void *src, const H5::DataType &memType) {
+        H5::DataSpace filespace(col.pDataSet->getSpace());
+        filespace.selectHyperslab(H5S_SELECT_SET, &count, &start);
+        H5::DataSpace memspace(1, &count);
+        col.pDataSet->write(src, memType, memspace, filespace);
+    }
+
+    H5::CompType mType;
+    std::size_t mRecordSize;
+    std::vector<Column> mColumns;
+    hsize_t mSize;
+    hsize_t mMaxSize;
+    hsize_t mChunkRows;
+    hsize_t mNumRecords;
+};
+
+
+#endif // CPH5COLUMNSTORE_H
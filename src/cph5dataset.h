@@ -11,7 +11,10 @@
 #include "cph5utilities.h"
 #include "cph5group.h"
 #include "cph5comptype.h"
+#include "cph5transpose.h"
 
+#include <functional>
+#include <type_traits>
 
 
 
@@ -661,6 +664,21 @@ private:
 
 
 
+/*!
+ * \brief The CPH5ChunkInfo struct describes one allocated chunk of a
+ *        chunked dataset, see CPH5Dataset::getChunkInfoList.
+ */
+struct CPH5ChunkInfo
+{
+    std::vector<hsize_t> offset; //!< Coordinates of the first element
+    unsigned filterMask;         //!< Filters skipped when the chunk was written
+    haddr_t address;             //!< Address of the chunk in the file
+    hsize_t size;                //!< Stored (possibly compressed) size in bytes
+};
+
+
+
+
 /*!
  * \brief The CPH5DatasetIdBase class is used simply for dynamic_cast testing
  *        of whether a group member is a dataset.
@@ -732,13 +750,15 @@ public:
           mpDataSet(0),
           mDimsSet(false),
           mChunksSet(false),
-          mDeflateSet(false)
+          mDeflateSet(false),
+          mpAccessStats(0),
+          mAccessTracking(false)
     {
         memset(mDims, 0, nDims*4);
         memset(mMaxDims, 0, nDims*4);
         parent->registerChild(this);
         
-        mPropList = H5::DSetCreatPropList::DEFAULT;
+        mPropList = H5::DSetCreatPropList();
     }
     
     /*!
@@ -763,13 +783,15 @@ public:
           mpDataSet(0),
           mDimsSet(false),
           mChunksSet(false),
-          mDeflateSet(false)
+          mDeflateSet(false),
+          mpAccessStats(0),
+          mAccessTracking(false)
     {
         memset(mDims, 0, nDims*4);
         memset(mMaxDims, 0, nDims*4);
         parent->registerChild(this);
         
-        mPropList = H5::DSetCreatPropList::DEFAULT;
+        mPropList = H5::DSetCreatPropList();
     }
     
     /*!
@@ -793,13 +815,15 @@ public:
           mpDataSet(0),
           mDimsSet(false),
           mChunksSet(false),
-          mDeflateSet(false)
+          mDeflateSet(false),
+          mpAccessStats(0),
+          mAccessTracking(false)
     {
         memset(mDims, 0, nDims*4);
         memset(mMaxDims, 0, nDims*4);
         parent->registerChild(this);
         
-        mPropList = H5::DSetCreatPropList::DEFAULT;
+        mPropList = H5::DSetCreatPropList();
     }
     
     /*!
@@ -812,6 +836,10 @@ public:
             delete mpIOFacility;
             mpIOFacility = 0;
         }
+        if (mpGroupParent != 0 && mpAccessStats != 0) {
+            delete mpAccessStats;
+            mpAccessStats = 0;
+        }
     }
     
     /*!
@@ -832,19 +860,19 @@ public:
             return;
         if (create) {
             H5::DataSpace space(nDims, mDims, mMaxDims);
-            if (mChunksSet) {
-                mpDataSet = mpGroupParent->createDataSet(mName,
-                                                         CPH5DatasetBaseSpec::mType,
-                                                         space,
-                                                         mPropList);
-            } else {
-                mpDataSet = mpGroupParent->createDataSet(mName, CPH5DatasetBaseSpec::mType, space);
-            }
+            mpDataSet = mpGroupParent->createDataSet(mName,
+                                                     CPH5DatasetBaseSpec::mType,
+                                                     space,
+                                                     mPropList);
         } else {
             mpDataSet = mpGroupParent->openDataSet(mName);
             H5::DataSpace filespace(mpDataSet->getSpace());
             if (filespace.getSimpleExtentNdims() != nDims) {
-                // Future: proper error. For now just return
+                // Future: proper error. For now just return, without the
+                // dimensions of a previously opened file.
+                memset(mDims, 0, sizeof(mDims));
+                memset(mMaxDims, 0, sizeof(mMaxDims));
+                mDimsSet = false;
                 return;
             }
             filespace.getSimpleExtentDims(mDims, mMaxDims);
@@ -948,7 +976,34 @@ public:
        }
        return ret;
     }
-    
+
+
+    /*!
+     * \brief Retrieves the chunk size of this dataset, as read from the
+     *        target HDF5 file if it is open, or as set with setChunkSize
+     *        otherwise. This should not be called on a non root-order object.
+     * \param chunkDims Array of nDims hsize_t to store the chunk size into.
+     * \return True if the dataset is chunked, false otherwise (chunkDims is
+     *         left untouched).
+     */
+    bool getChunkDims(hsize_t *chunkDims) const {
+        if (mpGroupParent == 0) {
+            // Future: proper error. For now just return
+            return false;
+        }
+        if (mpDataSet != 0) {
+            H5::DSetCreatPropList props(mpDataSet->getCreatePlist());
+            if (props.getLayout() != H5D_CHUNKED)
+                return false;
+            props.getChunk(nDims, chunkDims);
+            return true;
+        }
+        if (!mChunksSet)
+            return false;
+        mPropList.getChunk(nDims, chunkDims);
+        return true;
+    }
+
     
     /*!
      * \brief Sets the dimensions of a dataset if it is to be created as part
@@ -1003,6 +1058,18 @@ public:
         mDeflateSet = true;
     }
 
+    /*!
+     * \brief Enables the N-Bit filter for this dataset in the target HDF5
+     *        file. This should not be called on a non root-order object.
+     *        The filter packs each element down to the precision of the
+     *        dataset type, so it is meant to be used with a type from
+     *        CPH5NBitTypeProxy (or CPH5Half). Like compression, the N-Bit
+     *        filter requires the chunk size to be set.
+     */
+    void setNBitFilter() {
+        mPropList.setNbit();
+    }
+
     /*!
      * \brief Set the fill value for the dataset. The value needs to be convertible
      *        into the dataset type for this dataset. Reference the HDF5 online documentation for
@@ -1014,6 +1081,88 @@ public:
     void setFillValue(T fillVal) {
         mPropList.setFillValue(this->mType, &fillVal);
     }
+
+    /*!
+     * \brief Sets up the dataset for deterministic, real-time writing:
+     *        the storage for the whole extent is allocated when the dataset
+     *        is created (H5D_ALLOC_TIME_EARLY) and never filled
+     *        (H5D_FILL_TIME_NEVER), so later writes do not allocate file
+     *        space or write fill values. Call before the file is opened, on
+     *        a dataset with fixed dimensions; pair with CPH5RealTimeWriter.
+     */
+    void setRealTimeMode() {
+        setAllocTime(H5D_ALLOC_TIME_EARLY);
+        setFillTime(H5D_FILL_TIME_NEVER);
+    }
+
+    /*!
+     * \brief Sets the storage layout of the dataset in the target HDF5
+     *        file. This should not be called on a non root-order object.
+     *        H5D_COMPACT stores the raw data in the object header, which
+     *        saves an I/O per access for tiny datasets (up to 64KB, fixed
+     *        size). H5D_CONTIGUOUS stores it in one block and is the default
+     *        when no chunk size is set. H5D_CHUNKED is set by setChunkSize,
+     *        which also supplies the chunk dimensions; switching to another
+     *        layout drops the chunking.
+     * \param layout H5D_COMPACT, H5D_CONTIGUOUS or H5D_CHUNKED.
+     */
+    void setLayout(H5D_layout_t layout) {
+        if (layout == H5D_CHUNKED && !mChunksSet) {
+            // Future: proper error. For now just return
+            return;
+        }
+        mPropList.setLayout(layout);
+        mChunksSet = (layout == H5D_CHUNKED);
+    }
+
+    /*!
+     * \brief Sets when the file space for the raw data is allocated. This
+     *        should not be called on a non root-order object.
+     * \param allocTime H5D_ALLOC_TIME_EARLY (at creation),
+     *        H5D_ALLOC_TIME_LATE (at the first write), H5D_ALLOC_TIME_INCR
+     *        (chunk by chunk as written) or H5D_ALLOC_TIME_DEFAULT (the
+     *        default of the layout).
+     */
+    void setAllocTime(H5D_alloc_time_t allocTime) {
+        mPropList.setAllocTime(allocTime);
+    }
+
+    /*!
+     * \brief Sets when the fill value is written to allocated storage. This
+     *        should not be called on a non root-order object. With
+     *        H5D_FILL_TIME_NEVER, storage that was never written holds
+     *        whatever the file held before.
+     * \param fillTime H5D_FILL_TIME_ALLOC, H5D_FILL_TIME_IFSET or
+     *        H5D_FILL_TIME_NEVER.
+     */
+    void setFillTime(H5D_fill_time_t fillTime) {
+        mPropList.setFillTime(fillTime);
+    }
+
+    /*!
+     * \brief Sets the number of attributes up to which they are kept in the
+     *        object header (compact storage), and below which dense storage
+     *        reverts to compact. This should not be called on a non
+     *        root-order object. Reference the HDF5 documentation of
+     *        H5Pset_attr_phase_change.
+     * \param maxCompact Most attributes held in compact storage.
+     * \param minDense Fewest attributes held in dense storage.
+     */
+    void setAttrPhaseChange(unsigned maxCompact, unsigned minDense) {
+        mPropList.setAttrPhaseChange(maxCompact, minDense);
+    }
+
+    /*!
+     * \brief Sets whether the access, modification, change and birth times
+     *        of the dataset are recorded in its object header. Turning them
+     *        off makes the header smaller and keeps it from being rewritten
+     *        when the data changes. This should not be called on a non
+     *        root-order object.
+     * \param track False to leave the times out. True by default.
+     */
+    void setTrackTimes(bool track) {
+        H5Pset_obj_track_times(mPropList.getId(), track ? 1 : 0);
+    }
     
     /*!
      * \brief Writes data from a pointer to an array of type T to
@@ -1134,6 +1283,403 @@ public:
     }
     
     
+    /*!
+     * \brief Reads data from the HDF5 file into an array of floats. The array
+     *        must be large enough to fit all the data below this point in the
+     *        dataset tree. Half precision (CPH5Half) datasets are read as is
+     *        and converted with the SIMD converters in CPH5HalfConverters,
+     *        any other non-compound type is converted by the HDF5 library.
+     * \param dst Pointer to array of floats to read data into.
+     */
+    void readAsFloat(float *dst) {
+        if (mpGroupParent != 0) {
+            // Root level
+            mpIOFacility->init(mpDataSet,
+                               CPH5DatasetBaseSpec::mType,
+                               nDims,
+                               mDims);
+        }
+        if (std::is_same<T, CPH5Half>::value) {
+            std::vector<uint16_t> buf(mpIOFacility->getNumLowerElements());
+            mpIOFacility->read(buf.data());
+            CPH5HalfConverters::toFloat(buf.data(), dst, buf.size());
+        } else {
+            mpIOFacility->read(dst, H5::PredType::NATIVE_FLOAT);
+        }
+    }
+    
+    
+    /*!
+     * \brief Writes data from an array of floats to the target HDF5 file. The
+     *        counterpart of readAsFloat: half precision (CPH5Half) datasets
+     *        are converted with the SIMD converters in CPH5HalfConverters
+     *        before writing, any other non-compound type is converted by the
+     *        HDF5 library.
+     * \param src Pointer to array of floats to write data from.
+     */
+    void writeFromFloat(const float *src) {
+        if (mpGroupParent != 0) {
+            // Root level
+            mpIOFacility->init(mpDataSet,
+                               CPH5DatasetBaseSpec::mType,
+                               nDims,
+                               mDims);
+        }
+        if (std::is_same<T, CPH5Half>::value) {
+            std::vector<uint16_t> buf(mpIOFacility->getNumLowerElements());
+            CPH5HalfConverters::fromFloat(src, buf.data(), buf.size());
+            mpIOFacility->write(buf.data());
+        } else {
+            mpIOFacility->write(src, H5::PredType::NATIVE_FLOAT);
+        }
+    }
+
+
+    /*!
+     * \brief Reads a rectangular block of the dataset into a contiguous
+     *        buffer with a single hyperslab selection. This should not be
+     *        called on a non root-order object.
+     * \param start Array of nDims indices of the first element of the block.
+     * \param count Array of nDims sizes of the block.
+     * \param dst Pointer to block of memory large enough for all the
+     *        elements of the block.
+     */
+    void readRawBlock(const hsize_t *start,
+                      const hsize_t *count,
+                      void *dst) {
+        readRawBlock(start, count, dst, CPH5DatasetBaseSpec::mType);
+    }
+
+
+    /*!
+     * \brief Overload of readRawBlock that reads the block with a memory type
+     *        different from the dataset type, for example a subset of
+     *        compound fields or a different numeric type.
+     * \param start Array of nDims indices of the first element of the block.
+     * \param count Array of nDims sizes of the block.
+     * \param dst Pointer to block of memory to read data into.
+     * \param memType Datatype of the elements in memory.
+     */
+    void readRawBlock(const hsize_t *start,
+                      const hsize_t *count,
+                      void *dst,
+                      const H5::DataType &memType) {
+        if (mpGroupParent == 0 || mpDataSet == 0) {
+            // Future: proper error. For now just return
+            return;
+        }
+        readRawBlockUntracked(start, count, dst, memType);
+        recordRead(count);
+    }
+
+
+    /*!
+     * \brief Same as readRawBlock, but never recorded by access tracking.
+     *        For the reads the library makes on its own behalf (staging,
+     *        merging, scanning, caching), so that the recorded shapes stay
+     *        those of the reads of the application.
+     * \param start Array of nDims indices of the first element of the block.
+     * \param count Array of nDims sizes of the block.
+     * \param dst Pointer to block of memory large enough for all the
+     *        elements of the block.
+     */
+    void readRawBlockUntracked(const hsize_t *start,
+                               const hsize_t *count,
+                               void *dst) {
+        readRawBlockUntracked(start, count, dst, CPH5DatasetBaseSpec::mType);
+    }
+
+
+    /*!
+     * \brief Overload of readRawBlockUntracked with a memory type different
+     *        from the dataset type.
+     * \param start Array of nDims indices of the first element of the block.
+     * \param count Array of nDims sizes of the block.
+     * \param dst Pointer to block of memory to read data into.
+     * \param memType Datatype of the elements in memory.
+     */
+    void readRawBlockUntracked(const hsize_t *start,
+                               const hsize_t *count,
+                               void *dst,
+                               const H5::DataType &memType) {
+        if (mpGroupParent == 0 || mpDataSet == 0) {
+            // Future: proper error. For now just return
+            return;
+        }
+        H5::DataSpace filespace(mpDataSet->getSpace());
+        filespace.selectHyperslab(H5S_SELECT_SET, count, start);
+        H5::DataSpace memspace(nDims, count);
+        mpDataSet->read(dst, memType, memspace, filespace);
+    }
+
+
+    /*!
+     * \brief Writes a rectangular block of the dataset from a contiguous
+     *        buffer with a single hyperslab selection. This should not be
+     *        called on a non root-order object.
+     * \param start Array of nDims indices of the first element of the block.
+     * \param count Array of nDims sizes of the block.
+     * \param src Pointer to block of memory holding all the elements of the
+     *        block.
+     */
+    void writeRawBlock(const hsize_t *start,
+                       const hsize_t *count,
+                       const void *src) {
+        writeRawBlock(start, count, src, CPH5DatasetBaseSpec::mType);
+    }
+
+
+    /*!
+     * \brief Overload of writeRawBlock that writes the block from a memory
+     *        type different from the dataset type.
+     * \param start Array of nDims indices of the first element of the block.
+     * \param count Array of nDims sizes of the block.
+     * \param src Pointer to block of memory to write data from.
+     * \param memType Datatype of the elements in memory.
+     */
+    void writeRawBlock(const hsize_t *start,
+                       const hsize_t *count,
+                       const void *src,
+                       const H5::DataType &memType) {
+        if (mpGroupParent == 0 || mpDataSet == 0) {
+            // Future: proper error. For now just return
+            return;
+        }
+        H5::DataSpace filespace(mpDataSet->getSpace());
+        filespace.selectHyperslab(H5S_SELECT_SET, count, start);
+        H5::DataSpace memspace(nDims, count);
+        mpDataSet->write(src, memType, memspace, filespace);
+    }
+
+
+    /*!
+     * \brief Reads the whole dataset with its axes reordered, e.g. column
+     *        major for Fortran/BLAS consumers when axes is reversed. This
+     *        should not be called on a non root-order object.
+     * \param axes Array of nDims axis numbers, a permutation of 0..nDims-1.
+     *        Axis k of the destination is axis axes[k] of the dataset, so
+     *        the destination dimensions are dims[axes[0]], dims[axes[1]]...
+     * \param dst Pointer to block of memory large enough for all the
+     *        elements of the dataset (raw elements, as for readRaw).
+     *
+     * The dataset is read one chunk (or, if it is contiguous, one slab of
+     * about 16MB) at a time, and each block is scattered into place with
+     * the cache blocked kernels of CPH5Transpose, so only one block is ever
+     * staged besides the destination.
+     */
+    void readPermuted(const int *axes, void *dst) {
+        if (mpGroupParent == 0 || mpDataSet == 0) {
+            // Future: proper error. For now just return
+            return;
+        }
+        bool seen[nDims] = {};
+        for (int k = 0; k < nDims; ++k) {
+            if (axes[k] < 0 || axes[k] >= nDims || seen[axes[k]]) {
+                // Future: proper error. For now just return
+                return;
+            }
+            seen[axes[k]] = true;
+        }
+        std::size_t elemSize = CPH5DatasetBaseSpec::mType.getSize();
+        for (int d = 0; d < nDims; ++d) {
+            if (mDims[d] == 0)
+                return;
+        }
+        // Tracked as the one read of the whole dataset it is, not as the
+        // blocks it is staged in.
+        recordRead(mDims);
+
+        // Destination stride of each dataset axis, in elements
+        hsize_t outStride[nDims];
+        hsize_t stride = 1;
+        for (int k = nDims - 1; k >= 0; --k) {
+            outStride[axes[k]] = stride;
+            stride *= mDims[axes[k]];
+        }
+        // The dataset axis that is contiguous in the destination
+        int inner = axes[nDims - 1];
+
+        hsize_t block[nDims];
+        if (!getChunkDims(block)) {
+            hsize_t sliceSize = elemSize;
+            for (int d = 1; d < nDims; ++d) {
+                block[d] = mDims[d];
+                sliceSize *= mDims[d];
+            }
+            block[0] = 16777216 / sliceSize;
+            if (block[0] == 0)
+                block[0] = 1;
+        }
+
+        std::vector<char> staged;
+        char *out = static_cast<char*>(dst);
+        hsize_t start[nDims] = {};
+        for (;;) {
+            hsize_t count[nDims];
+            hsize_t numElements = 1;
+            for (int d = 0; d < nDims; ++d) {
+                count[d] = start[d] + block[d] <= mDims[d] ? block[d] : mDims[d] - start[d];
+                numElements *= count[d];
+            }
+            staged.resize(numElements * elemSize);
+            readRawBlockUntracked(start, count, staged.data());
+
+            // Strides of the staged block, in elements
+            hsize_t inStride[nDims];
+            inStride[nDims - 1] = 1;
+            for (int d = nDims - 2; d >= 0; --d) {
+                inStride[d] = inStride[d + 1] * count[d + 1];
+            }
+            // Walk every combination of the axes other than the innermost
+            // one of each layout, moving a 2-D slice per combination.
+            hsize_t idx[nDims] = {};
+            for (;;) {
+                hsize_t inOffset = 0;
+                hsize_t outOffset = 0;
+                for (int d = 0; d < nDims; ++d) {
+                    inOffset += idx[d] * inStride[d];
+                    outOffset += (start[d] + idx[d]) * outStride[d];
+                }
+                const char *s = staged.data() + inOffset * elemSize;
+                char *o = out + outOffset * elemSize;
+                if (nDims == 1 || inner == nDims - 1) {
+                    memcpy(o, s, count[nDims - 1] * elemSize);
+                } else {
+                    CPH5Transpose::transpose(s, o,
+                                             count[inner], count[nDims - 1],
+                                             inStride[inner], outStride[nDims - 1],
+                                             elemSize);
+                }
+                int d = nDims - 2;
+                for (; d >= 0; --d) {
+                    if (d == inner)
+                        continue;
+                    if (++idx[d] < count[d])
+                        break;
+                    idx[d] = 0;
+                }
+                if (d < 0)
+                    break;
+            }
+
+            // Next block
+            int d = nDims - 1;
+            for (; d >= 0; --d) {
+                start[d] += block[d];
+                if (start[d] < mDims[d])
+                    break;
+                start[d] = 0;
+            }
+            if (d < 0)
+                break;
+        }
+    }
+
+
+#if H5_VERSION_GE(1, 10, 5)
+    /*!
+     * \brief Returns the number of chunks of this dataset that have been
+     *        allocated in the target HDF5 file, i.e. written at least
+     *        partially. This should not be called on a non root-order object.
+     *        Requires HDF5 1.10.5 or later.
+     * \return Number of allocated chunks, 0 if the dataset is not chunked
+     *         or not open.
+     */
+    hsize_t getNumAllocatedChunks() const {
+        hsize_t chunk[nDims];
+        if (mpGroupParent == 0 || mpDataSet == 0 || !getChunkDims(chunk)) {
+            return 0;
+        }
+        H5::DataSpace filespace(mpDataSet->getSpace());
+        hsize_t num = 0;
+        if (H5Dget_num_chunks(mpDataSet->getId(), filespace.getId(), &num) < 0) {
+            throw H5::DataSetIException("CPH5Dataset::getNumAllocatedChunks",
+                                        "H5Dget_num_chunks failed");
+        }
+        return num;
+    }
+
+
+    /*!
+     * \brief Lists the allocated chunks of this dataset, in the order of
+     *        the chunk index of the dataset (which is not necessarily the
+     *        order of the chunks in the file: sort by address for that).
+     *        Processing that walks this list instead of the nominal extent
+     *        scales with the data actually written, which matters for huge,
+     *        mostly empty datasets. This should not be called on a non
+     *        root-order object. Requires HDF5 1.10.5 or later.
+     * \return One CPH5ChunkInfo per allocated chunk.
+     */
+    std::vector<CPH5ChunkInfo> getChunkInfoList() const {
+        std::vector<CPH5ChunkInfo> ret;
+        hsize_t num = getNumAllocatedChunks();
+        if (num == 0)
+            return ret;
+        ret.reserve(num);
+        H5::DataSpace filespace(mpDataSet->getSpace());
+        for (hsize_t i = 0; i < num; ++i) {
+            CPH5ChunkInfo info;
+            info.offset.resize(nDims);
+            if (H5Dget_chunk_info(mpDataSet->getId(), filespace.getId(), i,
+                                  info.offset.data(), &info.filterMask,
+                                  &info.address, &info.size) < 0) {
+                throw H5::DataSetIException("CPH5Dataset::getChunkInfoList",
+                                            "H5Dget_chunk_info failed");
+            }
+            ret.push_back(info);
+        }
+        return ret;
+    }
+
+
+    /*!
+     * \brief Reads only the allocated chunks of this dataset, one at a time,
+     *        and hands each one to a callback with its coordinates. Regions
+     *        of the dataset that were never written are skipped instead of
+     *        being materialized as fill values. This should not be called on
+     *        a non root-order object. Requires HDF5 1.10.5 or later.
+     * \param fn Called as fn(start, count, data) for every allocated chunk,
+     *        with arrays of nDims coordinates of the first element and sizes
+     *        of the chunk (clipped to the current extent), and the raw
+     *        elements of the chunk, row major. The data pointer is only valid
+     *        during the call.
+     * \return Number of chunks visited.
+     */
+    hsize_t readSparse(const std::function<void(const hsize_t*, const hsize_t*, const void*)> &fn) {
+        std::vector<CPH5ChunkInfo> chunks = getChunkInfoList();
+        hsize_t chunk[nDims];
+        if (chunks.empty() || !getChunkDims(chunk))
+            return 0;
+        // Tracked as one read of the whole dataset, not chunk by chunk
+        recordRead(mDims);
+        std::vector<char> buf;
+        hsize_t visited = 0;
+        for (std::size_t i = 0; i < chunks.size(); ++i) {
+            const hsize_t *start = chunks[i].offset.data();
+            hsize_t count[nDims];
+            hsize_t numElements = 1;
+            bool inside = true;
+            for (int d = 0; d < nDims; ++d) {
+                if (start[d] >= mDims[d]) {
+                    // Chunk left behind by a shrink of the dataset
+                    inside = false;
+                    break;
+                }
+                count[d] = start[d] + chunk[d] <= mDims[d] ? chunk[d] : mDims[d] - start[d];
+                numElements *= count[d];
+            }
+            if (!inside)
+                continue;
+            buf.resize(numElements * CPH5DatasetBaseSpec::mType.getSize());
+            readRawBlockUntracked(start, count, buf.data());
+            fn(start, count, buf.data());
+            ++visited;
+        }
+        return visited;
+    }
+#endif
+
+
     
     /*!
      * \brief Returns the total number of elements currently allocated in the
@@ -1169,6 +1715,70 @@ public:
             return 0;
         }
     }
+
+    
+    /*!
+     * \brief Returns the HDF5 datatype used for the elements of this dataset,
+     *        i.e. the type it was created with (and the default memory type
+     *        of its reads and writes).
+     * \return The H5::DataType of the elements.
+     */
+    H5::DataType getDataType() const {
+        return CPH5DatasetBaseSpec::mType;
+    }
+    
+    
+    /*!
+     * \brief Turns recording of the shapes of the reads of this dataset on
+     *        or off. While on, every read of the dataset, through any order
+     *        of it or through readRawBlock, adds the extent of its selection
+     *        to the histogram returned by getAccessStats. readPermuted and
+     *        readSparse count as one read of the whole dataset, and
+     *        CPH5ReadInterleaved as one read of its window; CPH5DirectReader
+     *        records each of its reads, direct or not. Reads the library
+     *        makes on its own behalf (readRawBlockUntracked: tile caches,
+     *        merges, query and sort scans) are not recorded.
+     *        Turning it off keeps the histogram. This should not be called
+     *        on a non root-order object.
+     * \param track True to record the reads. False by default.
+     */
+    void setAccessTracking(bool track) {
+        if (mpGroupParent == 0) {
+            return;
+        }
+        if (track && mpAccessStats == 0) {
+            mpAccessStats = new CPH5AccessStats;
+        }
+        mAccessTracking = track;
+        mpIOFacility->setAccessStats(track ? mpAccessStats : 0);
+    }
+    
+    
+    /*!
+     * \brief Returns the histogram of the shapes of the reads recorded since
+     *        access tracking was first turned on. Use its save and load to
+     *        keep it across runs, e.g. for CPH5Rechunker. This should not be
+     *        called on a non root-order object.
+     * \return Pointer to the histogram, or 0 if tracking was never on.
+     */
+    CPH5AccessStats *getAccessStats() const {
+        return mpGroupParent != 0 ? mpAccessStats : 0;
+    }
+    
+    
+    /*!
+     * \brief Records one read of the given shape if access tracking is on.
+     *        For code that serves one request with several untracked reads
+     *        (readRawBlockUntracked) or without HDF5, so that the request
+     *        is recorded once, with its own shape. This should not be
+     *        called on a non root-order object.
+     * \param count Array of nDims sizes of the read.
+     */
+    void recordRead(const hsize_t *count) {
+        if (mAccessTracking) {
+            mpAccessStats->record(nDims, count, 1);
+        }
+    }
     
     
     /*!
@@ -1265,7 +1875,7 @@ public:
      *        setDimensions function.
      * \param numTimes How many elements to extend the dataset by.
      */
-    void extend(int numTimes) {
+    void extend(hsize_t numTimes) {
         extendIR(0, numTimes);
     }
     
@@ -1496,7 +2106,9 @@ private:
           mDimsSet(false),
           mpIOFacility(parent->getIOFacility()),
           mChunksSet(false),
-          mDeflateSet(false)
+          mDeflateSet(false),
+          mpAccessStats(0),
+          mAccessTracking(false)
     {
         memset(mDims, 0, nDims*4);
         memset(mMaxDims, 0, nDims*4);
@@ -1505,7 +2117,7 @@ private:
         // INITIALIZER LIST. Property lists maintain static ID's
         // under the hood that force us to use the assignment
         // operator instead of the copy constructor.
-        mPropList = H5::DSetCreatPropList::DEFAULT;
+        mPropList = H5::DSetCreatPropList();
     }
     
     
@@ -1528,7 +2140,9 @@ private:
           mDimsSet(false),
           mpIOFacility(parent->getIOFacility()),
           mChunksSet(false),
-          mDeflateSet(false)
+          mDeflateSet(false),
+          mpAccessStats(0),
+          mAccessTracking(false)
     {
         // Should only be used if a dataset of non-compound types
         memset(mDims, 0, nDims*4);
@@ -1538,7 +2152,7 @@ private:
         // INITIALIZER LIST. Property lists maintain static ID's
         // under the hood that force us to use the assignment
         // operator instead of the copy constructor.
-        mPropList = H5::DSetCreatPropList::DEFAULT;
+        mPropList = H5::DSetCreatPropList();
     }
     
     
@@ -1560,7 +2174,9 @@ private:
           mDimsSet(false),
           mpIOFacility(parent->getIOFacility()),
           mChunksSet(false),
-          mDeflateSet(false)
+          mDeflateSet(false),
+          mpAccessStats(0),
+          mAccessTracking(false)
     {
         // Should only be used if a dataset of non-compound types
         memset(mDims, 0, nDims*4);
@@ -1570,7 +2186,7 @@ private:
         // INITIALIZER LIST. Property lists maintain static ID's
         // under the hood that force us to use the assignment
         // operator instead of the copy constructor.
-        mPropList = H5::DSetCreatPropList::DEFAULT;
+        mPropList = H5::DSetCreatPropList();
     }
     
     
@@ -1601,7 +2217,7 @@ private:
      * the local dimension array and extends the dataset in the target HDF5
      * file via the local H5::DataSet object.
      */
-    void extendIR(int dimsBelow, int numTimes) {
+    void extendIR(int dimsBelow, hsize_t numTimes) {
         if (mpGroupParent != 0) {
             if (!mDimsSet) {
                 // Future: proper error. For now just return
@@ -1692,6 +2308,8 @@ private:
     CPH5IOFacility *mpIOFacility;
     bool mChunksSet;
     bool mDeflateSet;
+    CPH5AccessStats *mpAccessStats;
+    bool mAccessTracking;
     hsize_t mDims[nDims+1];
     hsize_t mMaxDims[nDims+1];
     H5::DSetCreatPropList mPropList;
@@ -1893,6 +2511,14 @@ public:
         }
     }
     
+    /*!
+     * \brief Returns the HDF5 datatype used for the element of this dataset.
+     * \return The H5::DataType of the element.
+     */
+    H5::DataType getDataType() const {
+        return CPH5DatasetBaseSpec::mType;
+    }
+    
     
     /*!
      * \brief Creates an H5::Attribute attached to this dataset in the target
@@ -2176,7 +2802,7 @@ public:
     }
     void registerAttribute(CPH5AttributeInterface *) {} // NOOP
     void unregisterAttribute(const CPH5AttributeInterface *) {} // NOOP
-    void extendIR(int, int) {} // NOOP
+    void extendIR(int, hsize_t) {} // NOOP
     int getDimSizeIR(int) {return 0;} // NOOP
     int getMaxDimSizeIR(int) {return 0;} // NOOP
     
@@ -0,0 +1,437 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5DIRECTREAD_H
+#define CPH5DIRECTREAD_H
+
+#include "cph5utilities.h"
+#include "cph5dataset.h"
+#include "cph5parallel.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+
+/*!
+ * \brief The CPH5DirectReader class reads blocks of an unfiltered dataset
+ *        straight from the file descriptor with pread, so any number of
+ *        threads can read at once without going through the HDF5 library.
+ *
+ * The constructor (and refresh) ask HDF5, once, where the data lives: the
+ * address of every allocated chunk, or the address of the data of a
+ * contiguous dataset, and the descriptor of the file. Reads then only
+ * pread the chunks under the block and copy the requested part of each
+ * into the destination; chunks that were never written read as the fill
+ * value. read is const and makes no HDF5 calls, so it is safe to call from
+ * many threads at the same time.
+ *
+ * The direct path is only taken when it gives the same bytes HDF5 would:
+ * the dataset has no filters, its type in the file is the memory type of
+ * the dataset object (no conversion), and the file is opened with the
+ * default sec2 driver. Otherwise, or before HDF5 1.10.5, read falls back to
+ * a normal HDF5 read under the CPH5LibraryLock; isDirect tells which.
+ *
+ * The index is a snapshot: call refresh after the dataset is written or
+ * extended through HDF5, and keep the file open while the reader is used.
+ *
+ * With access tracking on for the dataset, every read is recorded once
+ * with its block shape, on both the direct and the fallback path.
+ *
+ * Example: <pre>
+ * CPH5DirectReader<float, 3> reader(file.cube);
+ * CPH5ThreadPool::global().parallelFor(numTiles, [&](std::size_t i) {
+ *     reader.read(tileStart[i], tileCount, tiles[i]);
+ * });
+ * </pre>
+ */
+template<typename T, const int nDims>
+class CPH5DirectReader
+{
+public:
+
+    /*!
+     * \brief Constructor. Builds the chunk index.
+     * \param ds Root-order dataset, open.
+     */
+    explicit CPH5DirectReader(CPH5Dataset<T, nDims> &ds)
+        : mDataset(ds),
+          mDirect(false),
+          mContiguous(false),
+          mFd(-1),
+          mBase(0),
+          mElemSize(0),
+          mNumIndexed(0)
+    {
+        refresh();
+    }
+
+    /*!
+     * \brief Rebuilds the chunk index from the file. Flushes the file
+     *        first so that everything written through HDF5 is on disk.
+     */
+    void refresh() {
+        CPH5LibraryLock lock;
+        mDirect = false;
+        mContiguous = false;
+        mNumIndexed = 0;
+        mAddresses.clear();
+        H5::DataSet *pDataSet = mDataset.getDataSet();
+        if (pDataSet == 0) {
+            throw std::runtime_error("CPH5DirectReader: dataset " + mDataset.getName() + " is not open");
+        }
+        hid_t dsId = pDataSet->getId();
+        pDataSet->getSpace().getSimpleExtentDims(mDims);
+        mElemSize = mDataset.getDataType().getSize();
+#if !defined(_WIN32) && H5_VERSION_GE(1, 10, 5)
+        H5::DSetCreatPropList props(pDataSet->getCreatePlist());
+        if (props.getNfilters() != 0)
+            return;
+        H5::DataType fileType(pDataSet->getDataType());
+        if (!(fileType == mDataset.getDataType()))
+            return;
+        if (!openDescriptor(dsId))
+            return;
+
+        mFill.assign(mElemSize, 0);
+        H5D_fill_value_t fillStatus;
+        if (H5Pfill_value_defined(props.getId(), &fillStatus) >= 0
+                && fillStatus != H5D_FILL_VALUE_UNDEFINED) {
+            H5Pget_fill_value(props.getId(), mDataset.getDataType().getId(), mFill.data());
+        }
+
+        H5D_layout_t layout = props.getLayout();
+        if (layout == H5D_CHUNKED) {
+            props.getChunk(nDims, mChunk);
+            hsize_t numChunks = 1;
+            for (int d = 0; d < nDims; ++d) {
+                mGrid[d] = (mDims[d] + mChunk[d] - 1) / mChunk[d];
+                numChunks *= mGrid[d];
+            }
+            mAddresses.assign(numChunks, HADDR_UNDEF);
+            std::vector<CPH5ChunkInfo> chunks = mDataset.getChunkInfoList();
+            for (std::size_t i = 0; i < chunks.size(); ++i) {
+                hsize_t linear = 0;
+                bool inside = true;
+                for (int d = 0; d < nDims; ++d) {
+                    hsize_t c = chunks[i].offset[d] / mChunk[d];
+                    if (c >= mGrid[d])
+                        inside = false;
+                    linear = linear * mGrid[d] + c;
+                }
+                if (!inside)
+                    continue;
+                mAddresses[linear] = chunks[i].address + mBase;
+                ++mNumIndexed;
+            }
+        } else if (layout == H5D_CONTIGUOUS) {
+            // One "chunk" covering the whole extent.
+            for (int d = 0; d < nDims; ++d) {
+                mChunk[d] = mDims[d] > 0 ? mDims[d] : 1;
+                mGrid[d] = 1;
+            }
+            // Unlike the chunk addresses, this one is absolute: it
+            // already counts the user block.
+            haddr_t address = H5Dget_offset(dsId);
+            mAddresses.assign(1, address);
+            mNumIndexed = address == HADDR_UNDEF ? 0 : 1;
+            mContiguous = true;
+        } else {
+            return;
+        }
+        mDirect = true;
+#endif
+    }
+
+    /*!
+     * \brief Returns whether reads go straight to the file descriptor.
+     * \return True for the direct path, false for the HDF5 fallback.
+     */
+    bool isDirect() const {
+        return mDirect;
+    }
+
+    /*!
+     * \brief Returns the number of allocated chunks found by the last
+     *        refresh (1 for an allocated contiguous dataset).
+     * \return Number of chunks in the index.
+     */
+    hsize_t getNumIndexedChunks() const {
+        return mNumIndexed;
+    }
+
+    /*!
+     * \brief Reads a block of the dataset. Thread safe.
+     * \param start Array of nDims coordinates of the first element.
+     * \param count Array of nDims sizes of the block.
+     * \param dst Buffer of the elements of the block, row major, in the
+     *        dataset type.
+     */
+    void read(const hsize_t *start, const hsize_t *count, T *dst) const {
+        hsize_t total = 1;
+        for (int d = 0; d < nDims; ++d) {
+            if (start[d] + count[d] > mDims[d]) {
+                throw std::runtime_error("CPH5DirectReader: block out of bounds for " + mDataset.getName());
+            }
+            total *= count[d];
+        }
+        if (total == 0)
+            return;
+        if (!mDirect) {
+            CPH5LibraryLock lock;
+            mDataset.readRawBlock(start, count, dst);
+            return;
+        }
+#ifndef _WIN32
+        mDataset.recordRead(count);
+        char *out = reinterpret_cast<char*>(dst);
+        if (mContiguous) {
+            // Read every row of the block straight into place.
+            hsize_t zero[nDims] = {};
+            if (mAddresses[0] == HADDR_UNDEF) {
+                fillRegion(out, count, zero, count);
+                return;
+            }
+            // Rows close together in the file are read with one pread and
+            // copied out, like the sieve buffer of HDF5; a row on its own
+            // goes straight into place.
+            std::size_t rowBytes = static_cast<std::size_t>(count[nDims - 1]) * mElemSize;
+            std::vector<char> &buf = scratch();
+            std::vector<std::pair<hsize_t, hsize_t> > rows;
+            hsize_t runStart = 0, runEnd = 0;
+            auto flush = [&]() {
+                if (rows.empty())
+                    return;
+                if (rows.size() == 1) {
+                    readFully(out + rows[0].second, rowBytes,
+                              static_cast<off_t>(mAddresses[0] + rows[0].first));
+                } else {
+                    buf.resize(static_cast<std::size_t>(runEnd - runStart));
+                    readFully(buf.data(), buf.size(),
+                              static_cast<off_t>(mAddresses[0] + runStart));
+                    for (std::size_t i = 0; i < rows.size(); ++i)
+                        memcpy(out + rows[i].second, buf.data() + (rows[i].first - runStart), rowBytes);
+                }
+                rows.clear();
+            };
+            forEachRow(mDims, start, count, zero, count, [&](hsize_t src, hsize_t dstOffset) {
+                hsize_t srcByte = src * mElemSize;
+                if (!rows.empty()
+                        && (srcByte - runEnd > SIEVE_GAP || srcByte + rowBytes - runStart > SIEVE_SIZE)) {
+                    flush();
+                }
+                if (rows.empty())
+                    runStart = srcByte;
+                runEnd = srcByte + rowBytes;
+                rows.push_back(std::make_pair(srcByte, dstOffset * mElemSize));
+            });
+            flush();
+            return;
+        }
+
+        // Walk the chunks under the block.
+        hsize_t first[nDims], last[nDims], c[nDims];
+        for (int d = 0; d < nDims; ++d) {
+            first[d] = start[d] / mChunk[d];
+            last[d] = (start[d] + count[d] - 1) / mChunk[d];
+            c[d] = first[d];
+        }
+        std::vector<char> &buf = scratch();
+        while (true) {
+            hsize_t linear = 0;
+            for (int d = 0; d < nDims; ++d)
+                linear = linear * mGrid[d] + c[d];
+            haddr_t address = mAddresses[linear];
+
+            // Part of the block in this chunk, relative to the chunk (lo)
+            // and to the block (dstLo).
+            hsize_t lo[nDims], n[nDims], dstLo[nDims];
+            for (int d = 0; d < nDims; ++d) {
+                hsize_t chunkStart = c[d] * mChunk[d];
+                hsize_t a = start[d] > chunkStart ? start[d] : chunkStart;
+                hsize_t b = start[d] + count[d];
+                if (b > chunkStart + mChunk[d])
+                    b = chunkStart + mChunk[d];
+                lo[d] = a - chunkStart;
+                n[d] = b - a;
+                dstLo[d] = a - start[d];
+            }
+            if (address == HADDR_UNDEF) {
+                fillRegion(out, count, dstLo, n);
+            } else {
+                // Only the span of the chunk between the first and last
+                // element of the region is read.
+                hsize_t firstElem = 0, lastElem = 0;
+                for (int d = 0; d < nDims; ++d) {
+                    firstElem = firstElem * mChunk[d] + lo[d];
+                    lastElem = lastElem * mChunk[d] + lo[d] + n[d] - 1;
+                }
+                std::size_t spanBytes = static_cast<std::size_t>(lastElem - firstElem + 1) * mElemSize;
+                off_t offset = static_cast<off_t>(address + firstElem * mElemSize);
+                bool dense = true;
+                for (int k = 1; k < nDims; ++k) {
+                    if (n[k] != mChunk[k] || n[k] != count[k])
+                        dense = false;
+                }
+                if (dense) {
+                    // The region is one run in both the chunk and the
+                    // block, read it straight into place.
+                    hsize_t dstElem = 0;
+                    for (int k = 0; k < nDims; ++k)
+                        dstElem = dstElem * count[k] + dstLo[k];
+                    readFully(out + dstElem * mElemSize, spanBytes, offset);
+                } else {
+                    buf.resize(spanBytes);
+                    readFully(buf.data(), spanBytes, offset);
+                    copyRegion(buf.data(), firstElem, lo, out, count, dstLo, n);
+                }
+            }
+
+            int d = nDims - 1;
+            while (d >= 0 && c[d] == last[d]) {
+                c[d] = first[d];
+                --d;
+            }
+            if (d < 0)
+                break;
+            ++c[d];
+        }
+#endif
+    }
+
+private:
+
+    // Disable copy & assignment
+    CPH5DirectReader(const CPH5DirectReader &other);
+    CPH5DirectReader &operator=(const CPH5DirectReader &other);
+
+#ifndef _WIN32
+    bool openDescriptor(hid_t dsId) {
+        hid_t fileId = H5Iget_file_id(dsId);
+        if (fileId < 0)
+            return false;
+        bool ok = false;
+        H5Fflush(fileId, H5F_SCOPE_LOCAL);
+        hid_t fapl = H5Fget_access_plist(fileId);
+        hid_t fcpl = H5Fget_create_plist(fileId);
+        void *handle = 0;
+        hsize_t userBlock = 0;
+        if (fapl >= 0 && fcpl >= 0
+                && H5Pget_driver(fapl) == H5FD_SEC2
+                && H5Fget_vfd_handle(fileId, fapl, &handle) >= 0
+                && handle != 0
+                && H5Pget_userblock(fcpl, &userBlock) >= 0) {
+            mFd = *static_cast<int*>(handle);
+            mBase = static_cast<haddr_t>(userBlock);
+            ok = true;
+        }
+        if (fcpl >= 0)
+            H5Pclose(fcpl);
+        if (fapl >= 0)
+            H5Pclose(fapl);
+        H5Fclose(fileId);
+        return ok;
+    }
+
+    void readFully(char *p, std::size_t size, off_t offset) const {
+        while (size > 0) {
+            ssize_t got = pread(mFd, p, size, offset);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0) {
+                throw std::runtime_error("CPH5DirectReader: read failed for " + mDataset.getName());
+            }
+            p += got;
+            offset += got;
+            size -= static_cast<std::size_t>(got);
+        }
+    }
+#endif
+
+    // Calls fn(srcRow, dstRow) for every innermost row of an n-sized
+    // region, with the offsets in elements of the row in a source array
+    // shaped srcShape starting at srcLo, and in a destination array shaped
+    // dstShape starting at dstLo.
+    template<class Fn>
+    static void forEachRow(const hsize_t *srcShape, const hsize_t *srcLo,
+                           const hsize_t *dstShape, const hsize_t *dstLo,
+                           const hsize_t *n, Fn fn) {
+        hsize_t i[nDims] = {};
+        while (true) {
+            hsize_t src = 0, dst = 0;
+            for (int d = 0; d < nDims; ++d) {
+                src = src * srcShape[d] + srcLo[d] + (d < nDims - 1 ? i[d] : 0);
+                dst = dst * dstShape[d] + dstLo[d] + (d < nDims - 1 ? i[d] : 0);
+            }
+            fn(src, dst);
+            int d = nDims - 2;
+            while (d >= 0 && i[d] + 1 == n[d]) {
+                i[d] = 0;
+                --d;
+            }
+            if (d < 0)
+                break;
+            ++i[d];
+        }
+    }
+
+    // Copies a region out of the span of a chunk that starts at element
+    // spanStart of the chunk.
+    void copyRegion(const char *span, hsize_t spanStart, const hsize_t *lo,
+                    char *out, const hsize_t *outShape, const hsize_t *outLo,
+                    const hsize_t *n) const {
+        std::size_t rowBytes = static_cast<std::size_t>(n[nDims - 1]) * mElemSize;
+        std::size_t elemSize = mElemSize;
+        forEachRow(mChunk, lo, outShape, outLo, n, [&](hsize_t src, hsize_t dst) {
+            memcpy(out + dst * elemSize, span + (src - spanStart) * elemSize, rowBytes);
+        });
+    }
+
+    // Staging buffer of the calling thread, kept between reads.
+    static std::vector<char> &scratch() {
+        static thread_local std::vector<char> buf;
+        return buf;
+    }
+
+    static const hsize_t SIEVE_GAP = 65536;
+    static const hsize_t SIEVE_SIZE = 4194304;
+
+    void fillRegion(char *out, const hsize_t *outShape, const hsize_t *outLo,
+                    const hsize_t *n) const {
+        std::size_t elemSize = mElemSize;
+        std::size_t rowBytes = static_cast<std::size_t>(n[nDims - 1]) * elemSize;
+        std::vector<char> &row = scratch();
+        row.resize(rowBytes);
+        for (std::size_t k = 0; k < rowBytes; k += elemSize)
+            memcpy(row.data() + k, mFill.data(), elemSize);
+        forEachRow(mChunk, outLo, outShape, outLo, n, [&](hsize_t, hsize_t dst) {
+            memcpy(out + dst * elemSize, row.data(), rowBytes);
+        });
+    }
+
+    CPH5Dataset<T, nDims> &mDataset;
+    bool mDirect;
+    bool mContiguous;
+    int mFd;
+    haddr_t mBase;
+    std::size_t mElemSize;
+    hsize_t mNumIndexed;
+    hsize_t mDims[nDims];
+    hsize_t mChunk[nDims];
+    hsize_t mGrid[nDims];
+    std::vector<haddr_t> mAddresses;
+    std::vector<char> mFill;
+};
+
+
+#endif // CPH5DIRECTREAD_H
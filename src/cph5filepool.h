@@ -0,0 +1,300 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5FILEPOOL_H
+#define CPH5FILEPOOL_H
+
+#include "cph5utilities.h"
+#include "cph5group.h"
+#include "cph5parallel.h"
+
+#include <list>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+
+/*!
+ * \brief The CPH5FilePool class keeps recently used files open, each with
+ *        its object tree, so that repeated access to the same files skips
+ *        the cost of opening the file and recursing openR through the tree.
+ *
+ * G is the root group class describing the files (a default constructible
+ * subclass of CPH5Group). acquire hands out a shared pointer to the open
+ * tree of a file; every caller asking for the same file gets the same
+ * tree. The handles carry a deleter that hands the file back to the pool
+ * when the last of them is dropped; the pool then closes idle files, least
+ * recently used first, until it is within its budget. Files with live
+ * handles are never closed, so the pool may go over budget while many
+ * handles are held. Handles may outlive the pool; such a file is closed
+ * when its last handle is dropped.
+ *
+ * The budget is a maximum number of open files and, optionally, a maximum
+ * total size of the metadata caches of the open files.
+ *
+ * The pool takes the CPH5LibraryLock in all of its functions, and so can be
+ * shared between threads. Using the trees it hands out is subject to the
+ * usual rules: hold a CPH5LibraryLock around HDF5 calls. Dropping a handle
+ * takes the lock itself.
+ *
+ * Example: <pre>
+ * CPH5FilePool<ArchiveFile> pool(256);
+ * ...
+ * CPH5FilePool<ArchiveFile>::Handle file = pool.acquire(path);
+ * file->header.read(&header);
+ * </pre>
+ */
+template<class G>
+class CPH5FilePool
+{
+public:
+
+    typedef std::shared_ptr<G> Handle;
+
+    /*!
+     * \brief Constructor.
+     * \param maxOpenFiles Most files kept open when they are not in use.
+     * \param readOnly True to open the files read only.
+     */
+    explicit CPH5FilePool(std::size_t maxOpenFiles = 64, bool readOnly = true)
+        : mMaxOpenFiles(maxOpenFiles),
+          mMemoryBudget(0),
+          mReadOnly(readOnly),
+          mNumHits(0),
+          mNumMisses(0),
+          mSelf(new CPH5FilePool*(this))
+    {} // NOOP
+
+    /*!
+     * \brief Destructor. Closes the files that are not in use; the trees
+     *        still held by callers close when their last handle goes.
+     */
+    ~CPH5FilePool() {
+        CPH5LibraryLock lock;
+        mSelf.reset();
+        mEntries.clear();
+        mLru.clear();
+    }
+
+    /*!
+     * \brief Returns the open tree of a file, opening the file if it is not
+     *        in the pool yet. Marks the file as most recently used.
+     * \param filename Name of the HDF5 file.
+     * \return Shared handle to the root group of the file.
+     */
+    Handle acquire(const std::string &filename) {
+        CPH5LibraryLock lock;
+        typename EntryMap::iterator found = mEntries.find(filename);
+        if (found != mEntries.end()) {
+            mLru.splice(mLru.begin(), mLru, found->second);
+            ++mNumHits;
+            return makeHandle(*found->second);
+        }
+        ++mNumMisses;
+        SlotPtr slot(new Slot);
+        slot->filename = filename;
+        slot->tree.reset(new G());
+        slot->numHandles = 0;
+        slot->tree->openFile(filename, mReadOnly);
+        if (slot->tree->getFilename().empty()) {
+            throw std::runtime_error("CPH5FilePool: could not open " + filename);
+        }
+        mLru.push_front(slot);
+        mEntries[filename] = mLru.begin();
+        Handle handle = makeHandle(slot);
+        trim();
+        return handle;
+    }
+
+    /*!
+     * \brief Closes a file now, if no handle to it is held outside of the
+     *        pool.
+     * \param filename Name of the HDF5 file.
+     * \return True if the file was closed or was not in the pool.
+     */
+    bool evict(const std::string &filename) {
+        CPH5LibraryLock lock;
+        typename EntryMap::iterator found = mEntries.find(filename);
+        if (found == mEntries.end())
+            return true;
+        if ((*found->second)->numHandles > 0)
+            return false;
+        mLru.erase(found->second);
+        mEntries.erase(found);
+        return true;
+    }
+
+    /*!
+     * \brief Closes every file that is not in use.
+     */
+    void clear() {
+        CPH5LibraryLock lock;
+        typename EntryList::iterator it = mLru.begin();
+        while (it != mLru.end()) {
+            if ((*it)->numHandles > 0) {
+                ++it;
+                continue;
+            }
+            mEntries.erase((*it)->filename);
+            it = mLru.erase(it);
+        }
+    }
+
+    /*!
+     * \brief Sets the most files kept open, closing idle ones if needed.
+     * \param maxOpenFiles Number of files.
+     */
+    void setMaxOpenFiles(std::size_t maxOpenFiles) {
+        CPH5LibraryLock lock;
+        mMaxOpenFiles = maxOpenFiles;
+        trim();
+    }
+
+    /*!
+     * \brief Sets a budget on the total metadata cache size of the open
+     *        files, closing idle ones if needed.
+     * \param bytes Budget in bytes, 0 for no memory budget (default).
+     */
+    void setMemoryBudget(std::size_t bytes) {
+        CPH5LibraryLock lock;
+        mMemoryBudget = bytes;
+        trim();
+    }
+
+    /*!
+     * \brief Returns the number of files currently open in the pool.
+     * \return Number of files.
+     */
+    std::size_t getNumOpen() const {
+        CPH5LibraryLock lock;
+        return mLru.size();
+    }
+
+    /*!
+     * \brief Returns the number of acquire calls served by an already open
+     *        file.
+     * \return Number of hits.
+     */
+    std::size_t getNumHits() const {
+        CPH5LibraryLock lock;
+        return mNumHits;
+    }
+
+    /*!
+     * \brief Returns the number of acquire calls that had to open the file.
+     * \return Number of misses.
+     */
+    std::size_t getNumMisses() const {
+        CPH5LibraryLock lock;
+        return mNumMisses;
+    }
+
+    /*!
+     * \brief Returns the total size of the metadata caches of the open
+     *        files.
+     * \return Size in bytes.
+     */
+    std::size_t getMemoryUsage() const {
+        CPH5LibraryLock lock;
+        std::size_t total = 0;
+        for (typename EntryList::const_iterator it = mLru.begin(); it != mLru.end(); ++it) {
+            total += cacheSize(*it);
+        }
+        return total;
+    }
+
+private:
+
+    // Disable copy & assignment
+    CPH5FilePool(const CPH5FilePool &other);
+    CPH5FilePool &operator=(const CPH5FilePool &other);
+
+    // One open file. Shared between the pool and the deleters of the
+    // handles to it, so that a file still in use when the pool goes away
+    // is closed by its last handle.
+    struct Slot
+    {
+        std::string filename;
+        std::unique_ptr<G> tree;
+        std::size_t numHandles;
+    };
+
+    typedef std::shared_ptr<Slot> SlotPtr;
+    typedef std::list<SlotPtr> EntryList;
+    typedef std::map<std::string, typename EntryList::iterator> EntryMap;
+
+    // Deleter of the handles given out by acquire: returns the file to the
+    // pool, which closes it if it is over budget, or closes it directly if
+    // the pool is gone.
+    struct Release
+    {
+        SlotPtr slot;
+        std::weak_ptr<CPH5FilePool*> pool;
+
+        void operator()(G *) {
+            CPH5LibraryLock lock;
+            --slot->numHandles;
+            std::shared_ptr<CPH5FilePool*> pPool = pool.lock();
+            if (pPool) {
+                (*pPool)->trim();
+            }
+            slot.reset();
+        }
+    };
+
+    Handle makeHandle(const SlotPtr &slot) {
+        Release release;
+        release.slot = slot;
+        release.pool = mSelf;
+        ++slot->numHandles;
+        return Handle(slot->tree.get(), release);
+    }
+
+    static std::size_t cacheSize(const SlotPtr &slot) {
+        H5::H5File *pFile = slot->tree->getH5File();
+        if (pFile == 0)
+            return 0;
+        size_t maxSize = 0, minClean = 0, curSize = 0;
+        int numEntries = 0;
+        if (H5Fget_mdc_size(pFile->getId(), &maxSize, &minClean, &curSize, &numEntries) < 0)
+            return 0;
+        return curSize;
+    }
+
+    // Closes idle files, least recently used first, until the pool is
+    // within budget or only files in use are left.
+    void trim() {
+        std::size_t memory = mMemoryBudget > 0 ? getMemoryUsage() : 0;
+        typename EntryList::iterator it = mLru.end();
+        while (it != mLru.begin()
+               && (mLru.size() > mMaxOpenFiles
+                   || (mMemoryBudget > 0 && memory > mMemoryBudget))) {
+            --it;
+            if ((*it)->numHandles > 0)
+                continue;
+            if (mMemoryBudget > 0) {
+                std::size_t size = cacheSize(*it);
+                memory = memory > size ? memory - size : 0;
+            }
+            mEntries.erase((*it)->filename);
+            it = mLru.erase(it);
+        }
+    }
+
+    EntryList mLru;
+    EntryMap mEntries;
+    std::size_t mMaxOpenFiles;
+    std::size_t mMemoryBudget;
+    bool mReadOnly;
+    std::size_t mNumHits;
+    std::size_t mNumMisses;
+    std::shared_ptr<CPH5FilePool*> mSelf;
+};
+
+
+#endif // CPH5FILEPOOL_H
@@ -48,7 +48,14 @@ public:
         : CPH5GroupMember(name),
           mpParent(parent),
           mpGroup(0),
-          mpFile(0)
+          mpFile(0),
+          mLinkPhaseSet(false),
+          mLinkMaxCompact(8),
+          mLinkMinDense(6),
+          mLinkInfoSet(false),
+          mEstNumEntries(4),
+          mEstNameLen(8),
+          mCrtOrderFlags(0)
     {
         if (mpParent != 0)
             mpParent->registerChild(this);
@@ -64,7 +71,14 @@ public:
         : CPH5GroupMember("/"),
           mpParent(0),
           mpGroup(0),
-          mpFile(0)
+          mpFile(0),
+          mLinkPhaseSet(false),
+          mLinkMaxCompact(8),
+          mLinkMinDense(6),
+          mLinkInfoSet(false),
+          mEstNumEntries(4),
+          mEstNameLen(8),
+          mCrtOrderFlags(0)
     {
         //NOOP
     }
@@ -116,7 +130,9 @@ public:
         }
         // CANNOT DO THIS FOR NON-ROOT GROUP
         if (mpParent == 0) {
-            mpFile = new H5::H5File(filename.c_str(), H5F_ACC_TRUNC);
+            H5::FileCreatPropList fileProps;
+            applyGroupCreateOptions(fileProps.getId());
+            mpFile = new H5::H5File(filename.c_str(), H5F_ACC_TRUNC, fileProps);
             mpGroup = new H5::Group(mpFile->openGroup(mName));
             for (ChildList::iterator it = mChildren.begin();
                  it != mChildren.end();
@@ -159,6 +175,34 @@ public:
     }
     
     
+    /*!
+     * \brief Closes the target HDF5 file if one is open and opens another
+     *        one with the same object tree. The member objects, their
+     *        dimension chains and their data types are kept, so processing
+     *        many files of the same layout with one tree costs only the
+     *        HDF5 opens per file instead of a full construction. Dimensions
+     *        are read again from each file. Will not run if this group
+     *        object has a parent. If the file or one of the members cannot
+     *        be opened, the partly opened tree is closed again, so the
+     *        tree is left either fully bound to the new file or closed.
+     * \param filename Name of target HDF5 file.
+     * \param readOnly True to open the file read only.
+     * \return True if the new file is open, false otherwise.
+     */
+    bool rebindFile(std::string filename, bool readOnly = false) {
+        if (mpParent != 0)
+            return false;
+        close();
+        try {
+            openFile(filename, readOnly);
+        } catch (...) {
+            close();
+            return false;
+        }
+        return !mFileName.empty();
+    }
+    
+    
     /*!
      * \brief This function 'opens' an HDF5 file in memory - nothing is
      *        written to or read from disk.
@@ -179,9 +223,11 @@ public:
         }
         H5::FileAccPropList propList;
         H5Pset_fapl_core(propList.getId(), memoryIncrement, false);
+        H5::FileCreatPropList fileProps;
+        applyGroupCreateOptions(fileProps.getId());
         mpFile = new H5::H5File(uniqueName,
                                 H5F_ACC_TRUNC,
-                                H5::FileCreatPropList::DEFAULT,
+                                fileProps,
                                 propList);
         mpGroup = new H5::Group(mpFile->openGroup(mName));
         for (ChildList::iterator it = mChildren.begin();
@@ -269,6 +315,89 @@ public:
     }
     
     
+    /*!
+     * \brief Sets the number of links up to which the group keeps them in
+     *        compact storage in its object header, and below which dense
+     *        storage (a fractal heap with a name index) reverts to compact.
+     *        Must be called before the group is created. Groups meant to
+     *        hold thousands of children can go straight to dense storage
+     *        with setLinkPhaseChange(0, 0). For the root group the options
+     *        are applied through the file creation property list.
+     * \param maxCompact Most links held in compact storage. HDF5 default 8.
+     * \param minDense Fewest links held in dense storage. HDF5 default 6.
+     */
+    void setLinkPhaseChange(unsigned maxCompact, unsigned minDense) {
+        mLinkMaxCompact = maxCompact;
+        mLinkMinDense = minDense;
+        mLinkPhaseSet = true;
+    }
+
+
+    /*!
+     * \brief Sets the expected number of links in the group and the expected
+     *        length of their names, which size the object header (and the
+     *        compact storage) up front. Must be called before the group is
+     *        created.
+     * \param estNumEntries Expected number of links, at most 65535. HDF5
+     *        default 4.
+     * \param estNameLen Expected length of a link name, at most 65535.
+     *        HDF5 default 8.
+     */
+    void setEstimatedLinkInfo(unsigned estNumEntries, unsigned estNameLen) {
+        mEstNumEntries = estNumEntries;
+        mEstNameLen = estNameLen;
+        mLinkInfoSet = true;
+    }
+
+
+    /*!
+     * \brief Sets whether the group records the creation order of its
+     *        links, and whether it keeps an index on it, which allows
+     *        getLinkNames to list the links in creation order without a
+     *        sort. Must be called before the group is created.
+     * \param track True to record the creation order.
+     * \param index True to also index it (implies track).
+     */
+    void setLinkCreationOrder(bool track, bool index = true) {
+        mCrtOrderFlags = 0;
+        if (track || index)
+            mCrtOrderFlags |= H5P_CRT_ORDER_TRACKED;
+        if (index)
+            mCrtOrderFlags |= H5P_CRT_ORDER_INDEXED;
+    }
+
+
+    /*!
+     * \brief Lists the names of the links in this group in the target HDF5
+     *        file, including those not described by a child object.
+     * \param creationOrder If true, in the order the links were created
+     *        (see setLinkCreationOrder), otherwise in name order. Groups
+     *        that do not track creation order are listed in name order.
+     * \return Names of the links, empty if the group is not open.
+     */
+    std::vector<std::string> getLinkNames(bool creationOrder = false) const {
+        std::vector<std::string> names;
+        if (mpGroup == 0)
+            return names;
+        hid_t id = mpGroup->getId();
+        H5G_info_t info;
+        if (H5Gget_info(id, &info) >= 0)
+            names.reserve(static_cast<std::size_t>(info.nlinks));
+        if (creationOrder) {
+            hid_t props = H5Gget_create_plist(id);
+            unsigned flags = 0;
+            H5Pget_link_creation_order(props, &flags);
+            H5Pclose(props);
+            if (flags & H5P_CRT_ORDER_TRACKED) {
+                H5Literate(id, H5_INDEX_CRT_ORDER, H5_ITER_INC, 0, appendLinkName, &names);
+                return names;
+            }
+        }
+        H5Literate(id, H5_INDEX_NAME, H5_ITER_INC, 0, appendLinkName, &names);
+        return names;
+    }
+
+
     /*!
      * \brief Opens an H5::Group in the target H5 file if it has been opened.
      * \param name Name of group to open visible in the target HDF5 file.
@@ -585,9 +714,18 @@ protected:
         if (mpParent == 0)
             return;
         
-        if (create)
-            mpGroup = new H5::Group(mpParent->mpGroup->createGroup(mName));
-        else
+        if (create) {
+            hid_t props = H5Pcreate(H5P_GROUP_CREATE);
+            applyGroupCreateOptions(props);
+            hid_t id = H5Gcreate2(mpParent->mpGroup->getId(), mName.c_str(),
+                                  H5P_DEFAULT, props, H5P_DEFAULT);
+            H5Pclose(props);
+            if (id < 0) {
+                throw H5::GroupIException("CPH5Group::openR", "H5Gcreate2 failed");
+            }
+            mpGroup = new H5::Group(id);
+            H5Gclose(id);
+        } else
             mpGroup = new H5::Group(mpParent->mpGroup->openGroup(mName));
         
         for (ChildList::iterator it = mChildren.begin();
@@ -638,6 +776,35 @@ protected:
     
 private:
     
+    // Applies the link storage options to a group (or file) creation
+    // property list.
+    void applyGroupCreateOptions(hid_t props) const {
+        if (mLinkPhaseSet)
+            H5Pset_link_phase_change(props, mLinkMaxCompact, mLinkMinDense);
+        if (mLinkInfoSet) {
+            // The estimates are stored as 16-bit values.
+            H5Pset_est_link_info(props,
+                                 mEstNumEntries < 65535 ? mEstNumEntries : 65535,
+                                 mEstNameLen < 65535 ? mEstNameLen : 65535);
+        }
+        if (mCrtOrderFlags != 0)
+            H5Pset_link_creation_order(props, mCrtOrderFlags);
+    }
+    
+    static herr_t appendLinkName(hid_t, const char *name, const H5L_info_t *, void *data) {
+        static_cast<std::vector<std::string>*>(data)->push_back(name);
+        return 0;
+    }
+    
+    bool mLinkPhaseSet;
+    unsigned mLinkMaxCompact;
+    unsigned mLinkMinDense;
+    bool mLinkInfoSet;
+    unsigned mEstNumEntries;
+    unsigned mEstNameLen;
+    unsigned mCrtOrderFlags;
+    
+    
     
     /*!
      * \brief This function is called at the beginning of createOrOverwriteFile
@@ -0,0 +1,495 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5IMAGE_H
+#define CPH5IMAGE_H
+
+#include "cph5utilities.h"
+#include "cph5group.h"
+#include "cph5dataset.h"
+#include "cph5parallel.h"
+
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+/*!
+ * \brief The CPH5Image class is a two dimensional dataset (rows, columns)
+ *        stored in square tiles, for large scenes that are viewed or
+ *        processed a region at a time.
+ *
+ * Unless setTileSize is called, the chunking is chosen automatically when
+ * the file is created: square power of two tiles of at most 128KiB. On top
+ * of the usual CPH5Dataset interface it provides:
+ * <ul>
+ *    <li>readROI / writeROI - a rectangular region as one hyperslab.</li>
+ *    <li>getTile / readROICached - whole tiles, decoded once and kept in
+ *        a least recently used cache, for panning viewers.</li>
+ *    <li>prefetch - loads the tiles around a region in the background on
+ *        the global CPH5ThreadPool.</li>
+ * </ul>
+ *
+ * Prefetching runs HDF5 calls on other threads. They hold the
+ * CPH5LibraryLock, as do all the functions of this class, so while a
+ * prefetch is in flight any other HDF5 call made by the application must
+ * hold it too, or come after waitForPrefetch().
+ *
+ * The element type T must be a non-compound type.
+ */
+template<typename T>
+class CPH5Image : public CPH5Dataset<T, 2>
+{
+public:
+
+    /*!
+     * \brief Shared, read only pixels of one decoded tile, stored row major
+     *        with the width of the tile (edge tiles are smaller).
+     */
+    typedef std::shared_ptr<const std::vector<T> > TilePtr;
+
+    /*!
+     * \brief Constructor, with the element type taken from CPH5TypeProxy.
+     * \param parent The group to which this image belongs.
+     * \param name The name of the dataset visible in the HDF5 file.
+     */
+    CPH5Image(CPH5Group *parent, std::string name)
+        : CPH5Dataset<T, 2>(parent, name),
+          mTileSet(false),
+          mMaxCachedTiles(64),
+          mInFlight(0),
+          mNextRequest(0),
+          mGeneration(0)
+    {
+        mTile[0] = mTile[1] = 0;
+    }
+
+    /*!
+     * \brief Constructor with an explicit element type.
+     * \param parent The group to which this image belongs.
+     * \param name The name of the dataset visible in the HDF5 file.
+     * \param type The HDF5 DataType to store the pixels with.
+     */
+    CPH5Image(CPH5Group *parent, std::string name, H5::DataType type)
+        : CPH5Dataset<T, 2>(parent, name, type),
+          mTileSet(false),
+          mMaxCachedTiles(64),
+          mInFlight(0),
+          mNextRequest(0),
+          mGeneration(0)
+    {
+        mTile[0] = mTile[1] = 0;
+    }
+
+    /*!
+     * \brief Destructor. Waits for pending prefetches.
+     */
+    virtual ~CPH5Image() {
+        waitForPrefetch();
+    }
+
+    /*!
+     * \brief Sets the size of the image to create. Equivalent to
+     *        setDimensions with rows = height and columns = width.
+     * \param width Number of columns.
+     * \param height Number of rows.
+     * \param maxWidth Maximum number of columns, H5S_UNLIMITED for an
+     *        extendible image. Defaults to width.
+     * \param maxHeight Maximum number of rows, H5S_UNLIMITED for an
+     *        extendible image. Defaults to height.
+     */
+    void setImageSize(hsize_t width,
+                      hsize_t height,
+                      hsize_t maxWidth = 0,
+                      hsize_t maxHeight = 0) {
+        hsize_t dims[2] = {height, width};
+        hsize_t maxDims[2] = {maxHeight == 0 ? height : maxHeight,
+                              maxWidth == 0 ? width : maxWidth};
+        this->setDimensions(dims, maxDims);
+    }
+
+    /*!
+     * \brief Sets the tile (chunk) size explicitly. Must be called before
+     *        the file is created.
+     * \param tileWidth Number of columns in each tile.
+     * \param tileHeight Number of rows in each tile.
+     */
+    void setTileSize(hsize_t tileWidth, hsize_t tileHeight) {
+        hsize_t chunk[2] = {tileHeight, tileWidth};
+        setChunkSize(chunk);
+    }
+
+    /*!
+     * \brief Sets the chunk size, see CPH5Dataset::setChunkSize. Disables
+     *        the automatic choice of tiles.
+     * \param chunkDims Rows and columns of each tile.
+     */
+    void setChunkSize(hsize_t chunkDims[2]) {
+        CPH5Dataset<T, 2>::setChunkSize(chunkDims);
+        mTileSet = true;
+    }
+
+    /*!
+     * \brief Returns the width (number of columns) of the image.
+     * \return Width of the image.
+     */
+    hsize_t getWidth() const {
+        return static_cast<hsize_t>(this->getDims()[1]);
+    }
+
+    /*!
+     * \brief Returns the height (number of rows) of the image.
+     * \return Height of the image.
+     */
+    hsize_t getHeight() const {
+        return static_cast<hsize_t>(this->getDims()[0]);
+    }
+
+    /*!
+     * \brief Returns the number of columns in a tile.
+     * \return Tile width.
+     */
+    hsize_t getTileWidth() const {
+        return mTile[1];
+    }
+
+    /*!
+     * \brief Returns the number of rows in a tile.
+     * \return Tile height.
+     */
+    hsize_t getTileHeight() const {
+        return mTile[0];
+    }
+
+    /*!
+     * \brief Reads a rectangular region of the image with a single hyperslab
+     *        selection.
+     * \param x First column of the region.
+     * \param y First row of the region.
+     * \param w Number of columns in the region.
+     * \param h Number of rows in the region.
+     * \param dst Buffer of w * h elements, filled row major.
+     */
+    void readROI(hsize_t x, hsize_t y, hsize_t w, hsize_t h, T *dst) {
+        checkROI(x, y, w, h);
+        if (w == 0 || h == 0)
+            return;
+        hsize_t start[2] = {y, x};
+        hsize_t count[2] = {h, w};
+        CPH5LibraryLock lock;
+        this->readRawBlock(start, count, dst);
+    }
+
+    /*!
+     * \brief Writes a rectangular region of the image with a single
+     *        hyperslab selection. Cached tiles overlapping the region are
+     *        dropped.
+     * \param x First column of the region.
+     * \param y First row of the region.
+     * \param w Number of columns in the region.
+     * \param h Number of rows in the region.
+     * \param src Buffer of w * h elements, row major.
+     */
+    void writeROI(hsize_t x, hsize_t y, hsize_t w, hsize_t h, const T *src) {
+        checkROI(x, y, w, h);
+        if (w == 0 || h == 0)
+            return;
+        hsize_t start[2] = {y, x};
+        hsize_t count[2] = {h, w};
+        {
+            CPH5LibraryLock lock;
+            this->writeRawBlock(start, count, src);
+        }
+        invalidate(x, y, w, h);
+    }
+
+    /*!
+     * \brief Sets the maximum number of decoded tiles kept in the cache.
+     * \param numTiles Number of tiles. 0 disables the cache.
+     */
+    void setTileCacheSize(std::size_t numTiles) {
+        std::lock_guard<std::mutex> lock(mCacheMutex);
+        mMaxCachedTiles = numTiles;
+        trimCache();
+    }
+
+    /*!
+     * \brief Returns a decoded tile, from the cache if present, otherwise
+     *        reading it (exactly one chunk) and caching it.
+     * \param tx Column of the tile.
+     * \param ty Row of the tile.
+     * \return Pointer to the pixels of the tile.
+     */
+    TilePtr getTile(hsize_t tx, hsize_t ty) {
+        uint64_t key = tileKey(tx, ty);
+        uint64_t generation;
+        {
+            std::lock_guard<std::mutex> lock(mCacheMutex);
+            TilePtr tile = findCached(key);
+            if (tile)
+                return tile;
+            generation = mGeneration;
+        }
+        TilePtr tile = loadTile(tx, ty);
+        std::lock_guard<std::mutex> lock(mCacheMutex);
+        // Not cached if a write may have changed the pixels meanwhile
+        if (generation == mGeneration)
+            insertCached(key, tile);
+        return tile;
+    }
+
+    /*!
+     * \brief Same as readROI, but assembles the region from cached tiles,
+     *        loading the missing ones.
+     * \param x First column of the region.
+     * \param y First row of the region.
+     * \param w Number of columns in the region.
+     * \param h Number of rows in the region.
+     * \param dst Buffer of w * h elements, filled row major.
+     */
+    void readROICached(hsize_t x, hsize_t y, hsize_t w, hsize_t h, T *dst) {
+        checkROI(x, y, w, h);
+        if (w == 0 || h == 0)
+            return;
+        for (hsize_t ty = y / mTile[0]; ty <= (y + h - 1) / mTile[0]; ++ty) {
+            for (hsize_t tx = x / mTile[1]; tx <= (x + w - 1) / mTile[1]; ++tx) {
+                TilePtr tile = getTile(tx, ty);
+                hsize_t tileX = tx * mTile[1];
+                hsize_t tileY = ty * mTile[0];
+                hsize_t tileW = tileExtent(tx, 1);
+                hsize_t x0 = x > tileX ? x : tileX;
+                hsize_t x1 = x + w < tileX + tileW ? x + w : tileX + tileW;
+                hsize_t y0 = y > tileY ? y : tileY;
+                hsize_t y1 = y + h < tileY + tileExtent(ty, 0) ? y + h : tileY + tileExtent(ty, 0);
+                for (hsize_t row = y0; row < y1; ++row) {
+                    memcpy(dst + (row - y) * w + (x0 - x),
+                           tile->data() + (row - tileY) * tileW + (x0 - tileX),
+                           (x1 - x0) * sizeof(T));
+                }
+            }
+        }
+    }
+
+    /*!
+     * \brief Loads the tiles covering a region, plus a margin of tiles
+     *        around it, into the cache in the background. Tiles already
+     *        cached or being loaded are skipped. Returns immediately.
+     * \param x First column of the region.
+     * \param y First row of the region.
+     * \param w Number of columns in the region.
+     * \param h Number of rows in the region.
+     * \param margin Number of tiles to add on every side of the region.
+     */
+    void prefetch(hsize_t x, hsize_t y, hsize_t w, hsize_t h, hsize_t margin = 1) {
+        if (this->getDataSet() == 0 || w == 0 || h == 0)
+            return;
+        hsize_t numTiles[2] = {(getHeight() + mTile[0] - 1) / mTile[0],
+                               (getWidth() + mTile[1] - 1) / mTile[1]};
+        if (numTiles[0] == 0 || numTiles[1] == 0)
+            return;
+        hsize_t tx0 = x / mTile[1] > margin ? x / mTile[1] - margin : 0;
+        hsize_t ty0 = y / mTile[0] > margin ? y / mTile[0] - margin : 0;
+        hsize_t tx1 = (x + w - 1) / mTile[1] + margin;
+        hsize_t ty1 = (y + h - 1) / mTile[0] + margin;
+        if (tx1 >= numTiles[1])
+            tx1 = numTiles[1] - 1;
+        if (ty1 >= numTiles[0])
+            ty1 = numTiles[0] - 1;
+        for (hsize_t ty = ty0; ty <= ty1; ++ty) {
+            for (hsize_t tx = tx0; tx <= tx1; ++tx) {
+                uint64_t key = tileKey(tx, ty);
+                uint64_t request;
+                {
+                    std::lock_guard<std::mutex> lock(mCacheMutex);
+                    if (mCache.count(key) != 0 || mPending.count(key) != 0)
+                        continue;
+                    request = ++mNextRequest;
+                    mPending[key] = request;
+                    ++mInFlight;
+                }
+                CPH5ThreadPool::global().submit([this, tx, ty, key, request]() {
+                    TilePtr tile;
+                    try {
+                        tile = loadTile(tx, ty);
+                    } catch (...) {
+                        // NOOP - the tile is simply not cached
+                    }
+                    std::lock_guard<std::mutex> lock(mCacheMutex);
+                    // The request is gone, or replaced by a newer one, if
+                    // the tile was invalidated while it was being read
+                    typename PendingMap::iterator it = mPending.find(key);
+                    if (it != mPending.end() && it->second == request) {
+                        if (tile)
+                            insertCached(key, tile);
+                        mPending.erase(it);
+                    }
+                    if (--mInFlight == 0)
+                        mIdle.notify_all();
+                });
+            }
+        }
+    }
+
+    /*!
+     * \brief Blocks until every prefetch started so far has finished.
+     */
+    void waitForPrefetch() {
+        std::unique_lock<std::mutex> lock(mCacheMutex);
+        mIdle.wait(lock, [this]() { return mInFlight == 0; });
+    }
+
+    /*!
+     * \brief Drops every cached tile.
+     */
+    void clearTileCache() {
+        std::lock_guard<std::mutex> lock(mCacheMutex);
+        mCache.clear();
+        mLru.clear();
+        mPending.clear();
+        ++mGeneration;
+    }
+
+protected:
+
+    /*!
+     * \brief Chooses the tile size if it has not been set, then creates or
+     *        opens the dataset and reads back the tile size in use.
+     * \param create Flag for whether to create the dataset or open it.
+     */
+    void openR(bool create) {
+        if (create && !mTileSet) {
+            hsize_t side = 16;
+            while ((side * 2) * (side * 2) * sizeof(T) <= 131072) {
+                side *= 2;
+            }
+            std::vector<int> dims = this->getDims();
+            std::vector<int> maxDims = this->getMaxDims();
+            hsize_t chunk[2] = {side, side};
+            for (int i = 0; i < 2; ++i) {
+                hsize_t maxDim = static_cast<hsize_t>(maxDims[i]);
+                if (maxDims[i] > 0 && maxDim != H5S_UNLIMITED && maxDim < side) {
+                    chunk[i] = maxDim;
+                }
+            }
+            CPH5Dataset<T, 2>::setChunkSize(chunk);
+        }
+        CPH5Dataset<T, 2>::openR(create);
+        if (!this->getChunkDims(mTile)) {
+            // Contiguous image - treat rows of at most 64 tiles as tiles
+            mTile[1] = getWidth() > 0 ? getWidth() : 1;
+            mTile[0] = 64;
+        }
+    }
+
+    /*!
+     * \brief Waits for pending prefetches, drops the cache and closes the
+     *        dataset.
+     */
+    void closeR() {
+        waitForPrefetch();
+        clearTileCache();
+        CPH5Dataset<T, 2>::closeR();
+    }
+
+private:
+
+    uint64_t tileKey(hsize_t tx, hsize_t ty) const {
+        return (static_cast<uint64_t>(ty) << 32) | static_cast<uint64_t>(tx);
+    }
+
+    hsize_t tileExtent(hsize_t t, int dim) const {
+        hsize_t size = dim == 0 ? getHeight() : getWidth();
+        hsize_t start = t * mTile[dim];
+        return start + mTile[dim] <= size ? mTile[dim] : size - start;
+    }
+
+    void checkROI(hsize_t x, hsize_t y, hsize_t w, hsize_t h) const {
+        if (this->getDataSet() == 0) {
+            throw std::runtime_error("Image " + this->getName() + " is not open");
+        }
+        if (x + w > getWidth() || y + h > getHeight()) {
+            throw std::runtime_error("Region out of bounds for " + this->getName());
+        }
+    }
+
+    TilePtr loadTile(hsize_t tx, hsize_t ty) {
+        hsize_t start[2] = {ty * mTile[0], tx * mTile[1]};
+        hsize_t count[2] = {tileExtent(ty, 0), tileExtent(tx, 1)};
+        std::shared_ptr<std::vector<T> > tile(new std::vector<T>(count[0] * count[1]));
+        CPH5LibraryLock lock;
+        this->readRawBlockUntracked(start, count, tile->data());
+        return tile;
+    }
+
+    // The functions below must be called with mCacheMutex held.
+
+    TilePtr findCached(uint64_t key) {
+        typename CacheMap::iterator it = mCache.find(key);
+        if (it == mCache.end())
+            return TilePtr();
+        mLru.splice(mLru.begin(), mLru, it->second.second);
+        return it->second.first;
+    }
+
+    void insertCached(uint64_t key, const TilePtr &tile) {
+        if (mMaxCachedTiles == 0 || mCache.count(key) != 0)
+            return;
+        mLru.push_front(key);
+        mCache[key] = std::make_pair(tile, mLru.begin());
+        trimCache();
+    }
+
+    void trimCache() {
+        while (mCache.size() > mMaxCachedTiles) {
+            mCache.erase(mLru.back());
+            mLru.pop_back();
+        }
+    }
+
+    void invalidate(hsize_t x, hsize_t y, hsize_t w, hsize_t h) {
+        std::lock_guard<std::mutex> lock(mCacheMutex);
+        for (hsize_t ty = y / mTile[0]; ty <= (y + h - 1) / mTile[0]; ++ty) {
+            for (hsize_t tx = x / mTile[1]; tx <= (x + w - 1) / mTile[1]; ++tx) {
+                uint64_t key = tileKey(tx, ty);
+                typename CacheMap::iterator it = mCache.find(key);
+                if (it != mCache.end()) {
+                    mLru.erase(it->second.second);
+                    mCache.erase(it);
+                }
+                // A prefetch in flight may have read the old pixels
+                mPending.erase(key);
+            }
+        }
+        ++mGeneration;
+    }
+
+    typedef std::list<uint64_t> LruList;
+    typedef std::unordered_map<uint64_t,
+                               std::pair<TilePtr, typename LruList::iterator> > CacheMap;
+    typedef std::map<uint64_t, uint64_t> PendingMap;
+
+    bool mTileSet;
+    hsize_t mTile[2];
+    std::size_t mMaxCachedTiles;
+    CacheMap mCache;
+    LruList mLru;
+    PendingMap mPending;
+    std::size_t mInFlight;
+    uint64_t mNextRequest;
+    uint64_t mGeneration;
+    std::mutex mCacheMutex;
+    std::condition_variable mIdle;
+};
+
+
+#endif // CPH5IMAGE_H
@@ -0,0 +1,127 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5INTERLEAVE_H
+#define CPH5INTERLEAVE_H
+
+#include "cph5utilities.h"
+#include "cph5dataset.h"
+#include "cph5transpose.h"
+
+#include <stdexcept>
+#include <vector>
+
+
+/*!
+ * \brief Sample orders of a hyperspectral cube held in memory.
+ */
+enum CPH5Interleave
+{
+    CPH5_INTERLEAVE_BSQ = 0, //!< Band sequential: [band][row][column]
+    CPH5_INTERLEAVE_BIL,     //!< Band interleaved by line: [row][band][column]
+    CPH5_INTERLEAVE_BIP      //!< Band interleaved by pixel: [row][column][band]
+};
+
+
+/*!
+ * \brief Reads a spatial window of a band sequential cube, stored as a
+ *        CPH5Dataset<T,3> with dimensions [band][row][column], into memory
+ *        in the requested interleave.
+ *
+ * The bands are read in blocks aligned to the chunking of the band
+ * dimension, so every chunk under the window is read and decompressed once,
+ * and only one block is staged at a time. BSQ is read directly into the
+ * destination. BIL moves whole lines out of the staged block, and BIP
+ * transposes it with the cache blocked SIMD kernels of CPH5Transpose.
+ *
+ * The element type T must be a non-compound type.
+ *
+ * \param cube Root-order 3-D dataset, open.
+ * \param x First column of the window.
+ * \param y First row of the window.
+ * \param w Number of columns in the window.
+ * \param h Number of rows in the window.
+ * \param order Interleave of the destination.
+ * \param dst Buffer of numBands * w * h elements.
+ * \param firstBand First band to read.
+ * \param numBands Number of bands to read, 0 for all the bands from
+ *        firstBand on.
+ */
+template<typename T>
+void CPH5ReadInterleaved(CPH5Dataset<T, 3> &cube,
+                         hsize_t x, hsize_t y, hsize_t w, hsize_t h,
+                         CPH5Interleave order,
+                         T *dst,
+                         hsize_t firstBand = 0,
+                         hsize_t numBands = 0)
+{
+    std::vector<int> dims = cube.getDims();
+    hsize_t totalBands = static_cast<hsize_t>(dims[0]);
+    if (numBands == 0 && firstBand < totalBands)
+        numBands = totalBands - firstBand;
+    if (firstBand + numBands > totalBands
+            || y + h > static_cast<hsize_t>(dims[1])
+            || x + w > static_cast<hsize_t>(dims[2])) {
+        throw std::runtime_error("Window out of bounds for " + cube.getName());
+    }
+    if (numBands == 0 || w == 0 || h == 0)
+        return;
+
+    if (order == CPH5_INTERLEAVE_BSQ) {
+        hsize_t start[3] = {firstBand, y, x};
+        hsize_t count[3] = {numBands, h, w};
+        cube.readRawBlock(start, count, dst);
+        return;
+    }
+
+    // Stage blocks of bands lined up with the chunks, or of about 16MB
+    // for a contiguous cube.
+    hsize_t chunk[3];
+    hsize_t bandsPerBlock;
+    if (cube.getChunkDims(chunk)) {
+        bandsPerBlock = chunk[0];
+    } else {
+        bandsPerBlock = (16777216 / sizeof(T)) / (w * h);
+        if (bandsPerBlock == 0)
+            bandsPerBlock = 1;
+    }
+    // Tracked as the one window read it is, like the BSQ path, not as the
+    // staged blocks.
+    hsize_t window[3] = {numBands, h, w};
+    cube.recordRead(window);
+
+    hsize_t pixels = w * h;
+    std::vector<T> staged;
+    hsize_t band = firstBand;
+    while (band < firstBand + numBands) {
+        hsize_t blockEnd = (band / bandsPerBlock + 1) * bandsPerBlock;
+        if (blockEnd > firstBand + numBands)
+            blockEnd = firstBand + numBands;
+        hsize_t nb = blockEnd - band;
+        staged.resize(nb * pixels);
+        hsize_t start[3] = {band, y, x};
+        hsize_t count[3] = {nb, h, w};
+        cube.readRawBlockUntracked(start, count, staged.data());
+        hsize_t offset = band - firstBand;
+        if (order == CPH5_INTERLEAVE_BIL) {
+            for (hsize_t r = 0; r < h; ++r) {
+                for (hsize_t b = 0; b < nb; ++b) {
+                    memcpy(dst + (r * numBands + offset + b) * w,
+                           staged.data() + (b * h + r) * w,
+                           w * sizeof(T));
+                }
+            }
+        } else {
+            CPH5Transpose::transpose(staged.data(), dst + offset,
+                                     nb, pixels, pixels, numBands);
+        }
+        band = blockEnd;
+    }
+}
+
+
+#endif // CPH5INTERLEAVE_H
@@ -0,0 +1,456 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5JOIN_H
+#define CPH5JOIN_H
+
+#include "cph5utilities.h"
+#include "cph5comptype.h"
+#include "cph5dataset.h"
+
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+
+/*!
+ * \brief The CPH5JoinRow struct is one row produced by CPH5Join, passed to
+ *        the callback of CPH5Join::run.
+ */
+struct CPH5JoinRow
+{
+    /*!
+     * \brief Timestamp of the row.
+     */
+    double time;
+
+    /*!
+     * \brief Index of the input whose row produced this one; always the
+     *        first input in as-of mode.
+     */
+    std::size_t input;
+
+    /*!
+     * \brief For each input, the index of its latest row at or before time,
+     *        or CPH5Join::NO_ROW if there is none (or it is older than the
+     *        tolerance).
+     */
+    std::vector<hsize_t> rows;
+
+    /*!
+     * \brief For each input, the record of that row in the native layout of
+     *        the dataset type (see CPH5Join::getRecordType), or 0 with
+     *        NO_ROW. Only valid during the callback.
+     */
+    std::vector<const void*> records;
+
+    /*!
+     * \brief Returns whether every input has a row.
+     * \return True if no input is NO_ROW.
+     */
+    bool isComplete() const {
+        for (std::size_t i = 0; i < records.size(); ++i) {
+            if (records[i] == 0)
+                return false;
+        }
+        return true;
+    }
+
+    /*!
+     * \brief Returns the record of an input as a given type.
+     * \param i Index of the input.
+     * \return Pointer to the record, 0 with NO_ROW.
+     */
+    template<typename R>
+    const R *record(std::size_t i) const {
+        return static_cast<const R*>(records[i]);
+    }
+};
+
+
+/*!
+ * \brief The CPH5Join class joins several timestamped datasets by time,
+ *        streaming through them in blocks so that recordings of any length
+ *        can be aligned with bounded memory.
+ *
+ * Each input is a dataset whose first dimension is time ordered, either of
+ * a compound type with a numeric timestamp member, or of a primitive type
+ * whose first element along the other dimensions is the timestamp (the
+ * value itself for a 1-D dataset). Timestamps must not decrease; run throws
+ * std::runtime_error if they do.
+ *
+ * The inputs are walked together in timestamp order, as a k-way merge, one
+ * block of rows at a time per input, so memory use is one block and one
+ * record per input. Two modes are offered:
+ *  - JOIN_ASOF (default): one row for each row of the first input, paired
+ *    with the latest row at or before its timestamp of every other input.
+ *  - JOIN_MERGE: one row for each row of any input, in timestamp order,
+ *    paired with the latest row of every other input.
+ * setTolerance limits how old a paired row may be.
+ *
+ * Rows go to a callback (run) or are appended to an extendible 1-D output
+ * dataset (runInto).
+ *
+ * Example: <pre>
+ * CPH5Join join;
+ * join.addInput(file.imu, "time");
+ * join.addInput(file.gps, "time");
+ * join.setTolerance(0.5);
+ * join.runInto(out.aligned, [](const CPH5JoinRow &row, Aligned &a) {
+ *     if (!row.isComplete())
+ *         return false;
+ *     ...
+ *     return true;
+ * });
+ * </pre>
+ */
+class CPH5Join
+{
+public:
+
+    enum Mode { JOIN_ASOF, JOIN_MERGE };
+
+    static constexpr hsize_t NO_ROW = ~static_cast<hsize_t>(0);
+
+    /*!
+     * \brief Constructor.
+     * \param mode JOIN_ASOF or JOIN_MERGE.
+     */
+    explicit CPH5Join(Mode mode = JOIN_ASOF)
+        : mMode(mode),
+          mTolerance(-1.0),
+          mBlockRows(0)
+    {} // NOOP
+
+    /*!
+     * \brief Adds a timestamped dataset. The dataset must stay open and
+     *        unchanged until run returns.
+     * \param ds Root-order dataset, open.
+     * \param timeMember Name of the timestamp member for a compound type,
+     *        ignored (may be empty) for a primitive type.
+     * \return Index of the input.
+     */
+    template<typename T, int nDims>
+    std::size_t addInput(CPH5Dataset<T, nDims> &ds, const std::string &timeMember = std::string()) {
+        H5::DataSet *pDataSet = ds.getDataSet();
+        if (pDataSet == 0) {
+            throw std::runtime_error("CPH5Join: dataset " + ds.getName() + " is not open");
+        }
+        std::shared_ptr<Input> in(new Input());
+        in->name = ds.getName();
+
+        hsize_t dims[nDims];
+        pDataSet->getSpace().getSimpleExtentDims(dims);
+        hsize_t rowElems = 1;
+        for (int d = 1; d < nDims; ++d)
+            rowElems *= dims[d];
+        in->numRows = rowElems > 0 ? dims[0] : 0;
+
+        H5::DataType fileType = pDataSet->getDataType();
+        hid_t nativeId = H5Tget_native_type(fileType.getId(), H5T_DIR_ASCEND);
+        if (nativeId < 0) {
+            throw std::runtime_error("CPH5Join: no native type for " + in->name);
+        }
+        in->type = H5::DataType(nativeId);
+        H5Tclose(nativeId);
+        in->recordSize = in->type.getSize() * static_cast<std::size_t>(rowElems);
+
+        bool ok;
+        if (in->type.getClass() == H5T_COMPOUND) {
+            H5::CompType compType(in->type.getId());
+            int member = H5Tget_member_index(compType.getId(), timeMember.c_str());
+            if (member < 0) {
+                throw std::runtime_error("CPH5Join: no member " + timeMember + " in " + in->name);
+            }
+            unsigned index = static_cast<unsigned>(member);
+            ok = in->time.init(compType.getMemberDataType(index), compType.getMemberOffset(index));
+        } else {
+            ok = in->time.init(in->type, 0);
+        }
+        if (!ok) {
+            throw std::runtime_error("CPH5Join: timestamp of " + in->name + " is not numeric");
+        }
+
+        hsize_t chunk[nDims];
+        in->chunkRows = ds.getChunkDims(chunk) ? chunk[0] : 0;
+
+        CPH5Dataset<T, nDims> *pDs = &ds;
+        H5::DataType memType = in->type;
+        in->read = [pDs, memType, dims](hsize_t first, hsize_t count, void *dst) {
+            hsize_t start[nDims] = {};
+            hsize_t counts[nDims];
+            start[0] = first;
+            counts[0] = count;
+            for (int d = 1; d < nDims; ++d)
+                counts[d] = dims[d];
+            pDs->readRawBlockUntracked(start, counts, dst, memType);
+        };
+        mInputs.push_back(in);
+        return mInputs.size() - 1;
+    }
+
+    /*!
+     * \brief Sets how much older than a row a paired row may be.
+     * \param seconds Largest difference of timestamps (in the units of the
+     *        timestamps), negative for no limit (default).
+     */
+    void setTolerance(double seconds) {
+        mTolerance = seconds;
+    }
+
+    /*!
+     * \brief Sets the number of rows read from an input at a time.
+     * \param rows Rows per block, 0 (default) for the chunk height of a
+     *        chunked dataset, or 65536 rows.
+     */
+    void setBlockRows(hsize_t rows) {
+        mBlockRows = rows;
+    }
+
+    /*!
+     * \brief Returns the number of inputs.
+     * \return Number of inputs.
+     */
+    std::size_t getNumInputs() const {
+        return mInputs.size();
+    }
+
+    /*!
+     * \brief Returns the memory type of the records of an input, the
+     *        native form of its dataset type.
+     * \param i Index of the input.
+     * \return Type of one element; a record of a multidimensional dataset
+     *         is a row of these.
+     */
+    H5::DataType getRecordType(std::size_t i) const {
+        return mInputs[i]->type;
+    }
+
+    /*!
+     * \brief Returns the size of the records of an input.
+     * \param i Index of the input.
+     * \return Size in bytes.
+     */
+    std::size_t getRecordSize(std::size_t i) const {
+        return mInputs[i]->recordSize;
+    }
+
+    /*!
+     * \brief Walks the inputs and passes every joined row to a callback.
+     * \param callback Called as callback(const CPH5JoinRow &row).
+     * \return Number of rows produced.
+     */
+    template<typename Callback>
+    hsize_t run(Callback callback) {
+        std::size_t numInputs = mInputs.size();
+        if (numInputs == 0)
+            return 0;
+        for (std::size_t i = 0; i < numInputs; ++i)
+            reset(*mInputs[i]);
+
+        CPH5JoinRow row;
+        row.rows.resize(numInputs);
+        row.records.resize(numInputs);
+        hsize_t produced = 0;
+        for (;;) {
+            // Input with the earliest next timestamp. On ties the other
+            // inputs go before the first one, so that an as-of row sees
+            // rows with the same timestamp.
+            std::size_t next = numInputs;
+            double nextTime = 0.0;
+            for (std::size_t j = numInputs; j-- > 0;) {
+                Input &in = *mInputs[j];
+                if (!peek(in))
+                    continue;
+                double t = in.times[static_cast<std::size_t>(in.pos - in.blockStart)];
+                bool earlier = (j == 0 || mMode == JOIN_MERGE) ? t < nextTime : t <= nextTime;
+                if (next == numInputs || earlier) {
+                    next = j;
+                    nextTime = t;
+                }
+            }
+            if (next == numInputs)
+                break;
+            if (mMode == JOIN_ASOF && mInputs[0]->pos >= mInputs[0]->numRows)
+                break;
+
+            advance(*mInputs[next]);
+            if (mMode == JOIN_ASOF && next != 0)
+                continue;
+
+            row.time = nextTime;
+            row.input = next;
+            for (std::size_t j = 0; j < numInputs; ++j) {
+                const Input &in = *mInputs[j];
+                if (in.latest == 0 || (mTolerance >= 0.0 && nextTime - in.latestTime > mTolerance)) {
+                    row.rows[j] = NO_ROW;
+                    row.records[j] = 0;
+                } else {
+                    row.rows[j] = in.latestRow;
+                    row.records[j] = in.latest;
+                }
+            }
+            callback(static_cast<const CPH5JoinRow&>(row));
+            ++produced;
+        }
+        return produced;
+    }
+
+    /*!
+     * \brief Walks the inputs and appends the joined rows to an extendible
+     *        1-D dataset, in blocks.
+     * \param out Root-order 1-D dataset with an unlimited maximum size,
+     *        open for writing.
+     * \param fn Called as bool fn(const CPH5JoinRow &row, O &record) for
+     *        every joined row; fills record and returns true to append it,
+     *        or returns false to skip the row.
+     * \return Number of rows appended.
+     */
+    template<typename O, typename Fill>
+    hsize_t runInto(CPH5Dataset<O, 1> &out, Fill fn) {
+        std::size_t outSize = recordSize<O>();
+        hsize_t blockRows = mBlockRows > 0 ? mBlockRows : 65536;
+        std::vector<char> buffer(static_cast<std::size_t>(blockRows) * outSize);
+        hsize_t pending = 0;
+        hsize_t appended = 0;
+        O record;
+        auto flush = [&]() {
+            if (pending == 0)
+                return;
+            hsize_t start;
+            out.getDataSet()->getSpace().getSimpleExtentDims(&start);
+            out.extend(pending);
+            out.writeRawBlock(&start, &pending, buffer.data());
+            appended += pending;
+            pending = 0;
+        };
+        run([&](const CPH5JoinRow &row) {
+            if (!fn(row, record))
+                return;
+            char *ptr = buffer.data() + static_cast<std::size_t>(pending) * outSize;
+            pack(record, ptr);
+            if (++pending == blockRows)
+                flush();
+        });
+        flush();
+        return appended;
+    }
+
+private:
+
+    // Disable copy & assignment
+    CPH5Join(const CPH5Join &other);
+    CPH5Join &operator=(const CPH5Join &other);
+
+    struct Input
+    {
+        std::string name;
+        H5::DataType type;
+        std::size_t recordSize;
+        CPH5NumericField time;
+        hsize_t numRows;
+        hsize_t chunkRows;
+        std::function<void(hsize_t, hsize_t, void*)> read;
+
+        // Current block and position of the next row.
+        std::vector<char> block;
+        std::vector<double> times;
+        hsize_t blockStart;
+        hsize_t blockCount;
+        hsize_t pos;
+
+        // Latest row taken, pointing into block or held.
+        std::vector<char> held;
+        const char *latest;
+        hsize_t latestRow;
+        double latestTime;
+    };
+
+    void reset(Input &in) {
+        in.blockStart = 0;
+        in.blockCount = 0;
+        in.pos = 0;
+        in.latest = 0;
+        in.latestRow = NO_ROW;
+        in.latestTime = 0.0;
+        in.block.clear();
+        in.times.clear();
+    }
+
+    // Makes sure the next row of the input is in its block. Returns false
+    // when the input is exhausted.
+    bool peek(Input &in) {
+        if (in.pos >= in.numRows)
+            return false;
+        if (in.pos < in.blockStart + in.blockCount)
+            return true;
+        // The latest row is about to be overwritten, keep a copy.
+        if (in.latest != 0 && in.latest != in.held.data()) {
+            in.held.assign(in.latest, in.latest + in.recordSize);
+            in.latest = in.held.data();
+        }
+        hsize_t rows = mBlockRows > 0 ? mBlockRows : (in.chunkRows > 0 ? in.chunkRows : 65536);
+        if (in.pos + rows > in.numRows)
+            rows = in.numRows - in.pos;
+        std::size_t n = static_cast<std::size_t>(rows);
+        in.block.resize(n * in.recordSize);
+        in.times.resize(n);
+        in.read(in.pos, rows, in.block.data());
+        in.time.extract(in.block.data(), in.recordSize, n, in.times.data());
+        double prev = in.latest != 0 ? in.latestTime : -std::numeric_limits<double>::infinity();
+        for (std::size_t i = 0; i < n; ++i) {
+            if (in.times[i] < prev) {
+                throw std::runtime_error("CPH5Join: timestamps of " + in.name
+                                         + " decrease at row " + std::to_string(in.pos + i));
+            }
+            prev = in.times[i];
+        }
+        in.blockStart = in.pos;
+        in.blockCount = rows;
+        return true;
+    }
+
+    // Takes the next row of the input as its latest one.
+    void advance(Input &in) {
+        std::size_t i = static_cast<std::size_t>(in.pos - in.blockStart);
+        in.latest = in.block.data() + i * in.recordSize;
+        in.latestRow = in.pos;
+        in.latestTime = in.times[i];
+        ++in.pos;
+    }
+
+    template<typename O>
+    static std::size_t recordSize() {
+        if constexpr (std::is_base_of<CPH5CompType, O>::value) {
+            return static_cast<std::size_t>(O().getTotalMemorySize());
+        } else {
+            return sizeof(O);
+        }
+    }
+
+    template<typename O>
+    static void pack(const O &record, char *ptr) {
+        if constexpr (std::is_base_of<CPH5CompType, O>::value) {
+            record.copyAllAndMove(ptr);
+        } else {
+            memcpy(ptr, &record, sizeof(O));
+        }
+    }
+
+    Mode mMode;
+    double mTolerance;
+    hsize_t mBlockRows;
+    std::vector<std::shared_ptr<Input> > mInputs;
+};
+
+
+#endif // CPH5JOIN_H
@@ -0,0 +1,132 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5MEMBERVIEW_H
+#define CPH5MEMBERVIEW_H
+
+#include "cph5utilities.h"
+#include "cph5comptype.h"
+#include "cph5dataset.h"
+
+#include <stdexcept>
+#include <string>
+
+
+/*!
+ * \brief The CPH5ArrayMemberView class exposes an array member of a 1-D
+ *        compound dataset as a 2-D [records x N] array.
+ *
+ * Reads and writes go through a partial compound type holding only that
+ * member, as an H5::ArrayType of N elements, so the HDF5 library gathers
+ * (or scatters) the member straight between the records in the file and a
+ * contiguous T[records][N] user buffer; the rest of each record is neither
+ * read nor copied.
+ *
+ * Example: <pre>
+ * struct Record : public CPH5CompType {
+ *     Record() : time(this, "time", H5::PredType::NATIVE_DOUBLE),
+ *                samples(this, "samples", H5::PredType::NATIVE_FLOAT) {}
+ *     CPH5CompMember<double> time;
+ *     CPH5CompMemberArray<float, 16> samples;
+ * };
+ * ...
+ * CPH5ArrayMemberView<Record, float, 16> view(file.records, &Record::samples);
+ * std::vector<float> matrix(view.getNumRecords() * 16);
+ * view.read(matrix.data());
+ * </pre>
+ */
+template<class C, class T, const int N>
+class CPH5ArrayMemberView
+{
+public:
+
+    /*!
+     * \brief Constructor.
+     * \param ds Root-order 1-D dataset of compound type C.
+     * \param member Pointer to the array member of C to view.
+     */
+    CPH5ArrayMemberView(CPH5Dataset<C, 1> &ds,
+                        CPH5CompMemberArray<T, N> C::*member)
+        : mDataset(ds),
+          mType(static_cast<std::size_t>(sizeof(T) * N))
+    {
+        C prototype;
+        const CPH5CompMemberArray<T, N> &m = prototype.*member;
+        hsize_t dims[1] = {static_cast<hsize_t>(N)};
+        H5::ArrayType arrayType(m.getBaseType(), 1, dims);
+        mType.insertMember(m.getName(), 0, arrayType);
+    }
+
+    /*!
+     * \brief Returns the number of records, i.e. the number of rows of the
+     *        view.
+     * \return Number of records.
+     */
+    hsize_t getNumRecords() const {
+        return static_cast<hsize_t>(mDataset.getDimSize());
+    }
+
+    /*!
+     * \brief Returns the partial compound type used for the transfers.
+     * \return The one member H5::CompType.
+     */
+    H5::CompType getMemType() const {
+        return mType;
+    }
+
+    /*!
+     * \brief Reads the member of every record.
+     * \param dst Buffer of getNumRecords() * N elements, [records][N].
+     */
+    void read(T *dst) {
+        read(0, getNumRecords(), dst);
+    }
+
+    /*!
+     * \brief Reads the member of a range of records.
+     * \param start First record.
+     * \param count Number of records.
+     * \param dst Buffer of count * N elements, [count][N].
+     */
+    void read(hsize_t start, hsize_t count, T *dst) {
+        checkRange(start, count);
+        if (count == 0)
+            return;
+        mDataset.readRawBlock(&start, &count, dst, mType);
+    }
+
+    /*!
+     * \brief Writes the member of a range of records, leaving the other
+     *        members untouched.
+     * \param start First record.
+     * \param count Number of records.
+     * \param src Buffer of count * N elements, [count][N].
+     */
+    void write(hsize_t start, hsize_t count, const T *src) {
+        checkRange(start, count);
+        if (count == 0)
+            return;
+        mDataset.writeRawBlock(&start, &count, src, mType);
+    }
+
+private:
+
+    void checkRange(hsize_t start, hsize_t count) const {
+        if (mDataset.getDataSet() == 0) {
+            throw std::runtime_error("Dataset " + mDataset.getName() + " is not open");
+        }
+        if (start + count > getNumRecords()) {
+            throw std::runtime_error("Record range out of bounds for " + mDataset.getName());
+        }
+    }
+
+    CPH5Dataset<C, 1> &mDataset;
+    H5::CompType mType;
+};
+
+
+#endif // CPH5MEMBERVIEW_H
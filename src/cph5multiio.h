@@ -0,0 +1,304 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5MULTIIO_H
+#define CPH5MULTIIO_H
+
+#include "cph5utilities.h"
+#include "cph5dataset.h"
+
+#include <stdexcept>
+#include <vector>
+
+
+/*!
+ * \brief The CPH5MultiIO class reads or writes a selection of several
+ *        datasets in one call, such as the same row of many parallel 1-D
+ *        datasets.
+ *
+ * The datasets, their selections, memory spaces and buffers are registered
+ * once with add. The selections are kept (set up once) and moved around
+ * with setStartAll / setRowAll, which only shift the selection offset with
+ * H5Soffset_simple instead of building new selections. read and write then
+ * issue a single H5Dread_multi / H5Dwrite_multi when the HDF5 library
+ * supports them (1.14 and later), and otherwise a tight loop of H5Dread /
+ * H5Dwrite over the cached handles.
+ *
+ * The datasets must stay open while they are part of the set. The file
+ * spaces are copied when the entries are added, so after a dataset is
+ * extended (or resized) call refreshExtents before selecting past its old
+ * extent.
+ *
+ * Example: <pre>
+ * CPH5MultiIO io;
+ * for (int i = 0; i < 40; ++i)
+ *     io.addRow(file.channel[i], &snapshot[i]);
+ * for (hsize_t row = 0; row < numRows; ++row) {
+ *     io.setRowAll(row);
+ *     io.read();
+ * }
+ * </pre>
+ */
+class CPH5MultiIO
+{
+public:
+
+    CPH5MultiIO() {} // NOOP
+
+    /*!
+     * \brief Adds a block selection of a root-order dataset.
+     * \param ds Dataset, open.
+     * \param start Array (of the rank of the dataset) with the first element
+     *        of the block.
+     * \param count Array (of the rank of the dataset) with the size of the
+     *        block.
+     * \param buf Buffer to read into or write from, holding the elements of
+     *        the block in the dataset type.
+     * \return Index of the entry.
+     */
+    template<class DS>
+    std::size_t add(DS &ds, const hsize_t *start, const hsize_t *count, void *buf) {
+        return add(ds, start, count, buf, ds.getDataType());
+    }
+
+    /*!
+     * \brief Overload of add with a memory type different from the dataset
+     *        type.
+     * \param ds Dataset, open.
+     * \param start Array with the first element of the block.
+     * \param count Array with the size of the block.
+     * \param buf Buffer to read into or write from.
+     * \param memType Datatype of the elements in the buffer.
+     * \return Index of the entry.
+     */
+    template<class DS>
+    std::size_t add(DS &ds,
+                    const hsize_t *start,
+                    const hsize_t *count,
+                    void *buf,
+                    const H5::DataType &memType) {
+        H5::DataSet *pDataSet = ds.getDataSet();
+        if (pDataSet == 0) {
+            throw std::runtime_error("CPH5MultiIO: dataset " + ds.getName() + " is not open");
+        }
+        Entry entry;
+        entry.dataSet = *pDataSet;
+        entry.fileSpace = pDataSet->getSpace();
+        int rank = entry.fileSpace.getSimpleExtentNdims();
+        if (rank > 0) {
+            entry.fileSpace.selectHyperslab(H5S_SELECT_SET, count, start);
+            entry.memSpace = H5::DataSpace(rank, count);
+            entry.start.assign(start, start + rank);
+            entry.count.assign(count, count + rank);
+            entry.current = entry.start;
+        } else {
+            entry.memSpace = H5::DataSpace(H5S_SCALAR);
+        }
+        entry.memType = memType;
+        mEntries.push_back(entry);
+        mBuffers.push_back(buf);
+        rebuildIds();
+        return mEntries.size() - 1;
+    }
+
+    /*!
+     * \brief Adds a single row (index 0 of the first dimension, all of the
+     *        others) of a root-order dataset. For a 1-D dataset this is one
+     *        element. Move the rows with setRowAll.
+     * \param ds Dataset, open.
+     * \param buf Buffer holding one row.
+     * \return Index of the entry.
+     */
+    template<class DS>
+    std::size_t addRow(DS &ds, void *buf) {
+        std::vector<int> dims = ds.getDims();
+        std::vector<hsize_t> start(dims.size(), 0);
+        std::vector<hsize_t> count(dims.begin(), dims.end());
+        if (!count.empty())
+            count[0] = 1;
+        return add(ds, start.data(), count.data(), buf);
+    }
+
+    /*!
+     * \brief Changes the buffer of an entry.
+     * \param i Index of the entry.
+     * \param buf New buffer.
+     */
+    void setBuffer(std::size_t i, void *buf) {
+        mBuffers.at(i) = buf;
+    }
+
+    /*!
+     * \brief Moves the selection of one entry so that its block starts at a
+     *        new position. The size of the block is unchanged.
+     * \param i Index of the entry.
+     * \param start Array (of the rank of the dataset) with the new first
+     *        element of the block.
+     */
+    void setStart(std::size_t i, const hsize_t *start) {
+        Entry &entry = mEntries.at(i);
+        std::size_t rank = entry.start.size();
+        if (rank == 0)
+            return;
+        entry.current.assign(start, start + rank);
+        applyOffset(entry);
+    }
+
+    /*!
+     * \brief Moves the selection of every entry to a new start. All the
+     *        datasets must have the same rank.
+     * \param start Array with the new first element of the blocks.
+     */
+    void setStartAll(const hsize_t *start) {
+        for (std::size_t i = 0; i < mEntries.size(); ++i) {
+            setStart(i, start);
+        }
+    }
+
+    /*!
+     * \brief Moves the selection of every entry along the first dimension
+     *        only, e.g. to select row <i>row</i> of entries added with
+     *        addRow.
+     * \param row New index in the first dimension.
+     */
+    void setRowAll(hsize_t row) {
+        for (std::size_t i = 0; i < mEntries.size(); ++i) {
+            Entry &entry = mEntries[i];
+            if (entry.start.empty())
+                continue;
+            entry.current[0] = row;
+            applyOffset(entry);
+        }
+    }
+
+    /*!
+     * \brief Takes the current extent of every dataset, keeping the
+     *        selections where they are. Call after extending or resizing
+     *        any of the datasets.
+     */
+    void refreshExtents() {
+        for (std::size_t i = 0; i < mEntries.size(); ++i) {
+            Entry &entry = mEntries[i];
+            entry.fileSpace = entry.dataSet.getSpace();
+            if (entry.start.empty())
+                continue;
+            entry.fileSpace.selectHyperslab(H5S_SELECT_SET, entry.count.data(), entry.start.data());
+            applyOffset(entry);
+        }
+        rebuildIds();
+    }
+
+    /*!
+     * \brief Returns the number of entries.
+     * \return Number of entries.
+     */
+    std::size_t size() const {
+        return mEntries.size();
+    }
+
+    /*!
+     * \brief Removes every entry.
+     */
+    void clear() {
+        mEntries.clear();
+        mBuffers.clear();
+        rebuildIds();
+    }
+
+    /*!
+     * \brief Reads the current selection of every entry into its buffer.
+     */
+    void read() {
+        if (mEntries.empty())
+            return;
+#if H5_VERSION_GE(1, 14, 0)
+        if (H5Dread_multi(mEntries.size(), mDataSetIds.data(), mMemTypeIds.data(),
+                          mMemSpaceIds.data(), mFileSpaceIds.data(),
+                          H5P_DEFAULT, mBuffers.data()) < 0) {
+            throw H5::DataSetIException("CPH5MultiIO::read", "H5Dread_multi failed");
+        }
+#else
+        for (std::size_t i = 0; i < mEntries.size(); ++i) {
+            if (H5Dread(mDataSetIds[i], mMemTypeIds[i], mMemSpaceIds[i],
+                        mFileSpaceIds[i], H5P_DEFAULT, mBuffers[i]) < 0) {
+                throw H5::DataSetIException("CPH5MultiIO::read", "H5Dread failed");
+            }
+        }
+#endif
+    }
+
+    /*!
+     * \brief Writes the buffer of every entry to its current selection.
+     */
+    void write() {
+        if (mEntries.empty())
+            return;
+#if H5_VERSION_GE(1, 14, 0)
+        std::vector<const void*> buffers(mBuffers.begin(), mBuffers.end());
+        if (H5Dwrite_multi(mEntries.size(), mDataSetIds.data(), mMemTypeIds.data(),
+                           mMemSpaceIds.data(), mFileSpaceIds.data(),
+                           H5P_DEFAULT, buffers.data()) < 0) {
+            throw H5::DataSetIException("CPH5MultiIO::write", "H5Dwrite_multi failed");
+        }
+#else
+        for (std::size_t i = 0; i < mEntries.size(); ++i) {
+            if (H5Dwrite(mDataSetIds[i], mMemTypeIds[i], mMemSpaceIds[i],
+                         mFileSpaceIds[i], H5P_DEFAULT, mBuffers[i]) < 0) {
+                throw H5::DataSetIException("CPH5MultiIO::write", "H5Dwrite failed");
+            }
+        }
+#endif
+    }
+
+private:
+
+    // Disable copy & assignment
+    CPH5MultiIO(const CPH5MultiIO &other);
+    CPH5MultiIO &operator=(const CPH5MultiIO &other);
+
+    struct Entry
+    {
+        H5::DataSet dataSet;
+        H5::DataSpace fileSpace;
+        H5::DataSpace memSpace;
+        H5::DataType memType;
+        std::vector<hsize_t> start;    // Start of the hyperslab selected
+        std::vector<hsize_t> count;
+        std::vector<hsize_t> current;  // Start it is offset to
+    };
+
+    static void applyOffset(Entry &entry) {
+        hssize_t offset[CPH_5_MAX_DIMS];
+        for (std::size_t d = 0; d < entry.start.size(); ++d) {
+            offset[d] = static_cast<hssize_t>(entry.current[d]) - static_cast<hssize_t>(entry.start[d]);
+        }
+        entry.fileSpace.offsetSimple(offset);
+    }
+
+    void rebuildIds() {
+        mDataSetIds.clear();
+        mMemTypeIds.clear();
+        mMemSpaceIds.clear();
+        mFileSpaceIds.clear();
+        for (std::size_t i = 0; i < mEntries.size(); ++i) {
+            mDataSetIds.push_back(mEntries[i].dataSet.getId());
+            mMemTypeIds.push_back(mEntries[i].memType.getId());
+            mMemSpaceIds.push_back(mEntries[i].memSpace.getId());
+            mFileSpaceIds.push_back(mEntries[i].fileSpace.getId());
+        }
+    }
+
+    std::vector<Entry> mEntries;
+    std::vector<void*> mBuffers;
+    std::vector<hid_t> mDataSetIds;
+    std::vector<hid_t> mMemTypeIds;
+    std::vector<hid_t> mMemSpaceIds;
+    std::vector<hid_t> mFileSpaceIds;
+};
+
+
+#endif // CPH5MULTIIO_H
@@ -0,0 +1,259 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5PARALLEL_H
+#define CPH5PARALLEL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+
+/*!
+ * \brief The CPH5LibraryLock class serializes calls into the HDF5 library.
+ *
+ * Unless HDF5 was built with --enable-threadsafe, the library may only be
+ * entered by one thread at a time. Code that runs on a CPH5ThreadPool holds
+ * a CPH5LibraryLock for the duration of every HDF5 call (reads, writes,
+ * selections) and does its own processing - decoding, resampling, user
+ * callbacks - outside of it. The mutex is recursive so helpers that lock
+ * can call other helpers that lock.
+ */
+class CPH5LibraryLock
+{
+public:
+
+    /*!
+     * \brief Constructor, locks the library mutex.
+     */
+    CPH5LibraryLock()
+        : mLock(mutex())
+    {} // NOOP
+
+    /*!
+     * \brief Returns the process wide mutex guarding the HDF5 library.
+     * \return Reference to the mutex.
+     */
+    static std::recursive_mutex &mutex() {
+        static std::recursive_mutex m;
+        return m;
+    }
+
+    /*!
+     * \brief Gives a forked child process a fresh, unlocked library mutex.
+     *        A child forked while the parent held the lock inherits it
+     *        locked by a thread that does not exist in the child, so any
+     *        later lock would deadlock. Call only in the child, right after
+     *        fork(), before anything else takes the lock.
+     */
+    static void resetAfterFork() {
+        new (&mutex()) std::recursive_mutex();
+    }
+
+private:
+
+    // Disable copy & assignment
+    CPH5LibraryLock(const CPH5LibraryLock &other);
+    CPH5LibraryLock &operator=(const CPH5LibraryLock &other);
+
+    std::lock_guard<std::recursive_mutex> mLock;
+};
+
+
+/*!
+ * \brief The CPH5ThreadPool class is a fixed size pool of worker threads
+ *        used by the parallel algorithms of the library.
+ *
+ * Work is either submitted as individual tasks, or spread over an index
+ * range with parallelFor, in which the calling thread takes part. Since the
+ * calling thread does work too, parallelFor can safely be nested inside
+ * tasks running on the same pool.
+ */
+class CPH5ThreadPool
+{
+public:
+
+    /*!
+     * \brief Constructor, starts the worker threads.
+     * \param nThreads Number of worker threads. 0 uses the number of
+     *        hardware threads.
+     */
+    explicit CPH5ThreadPool(unsigned nThreads = 0)
+        : mStop(false)
+    {
+        if (nThreads == 0) {
+            nThreads = std::thread::hardware_concurrency();
+            if (nThreads == 0)
+                nThreads = 1;
+        }
+        for (unsigned i = 0; i < nThreads; ++i) {
+            mWorkers.push_back(std::thread(&CPH5ThreadPool::workerLoop, this));
+        }
+    }
+
+    /*!
+     * \brief Destructor. Finishes the queued tasks and joins the workers.
+     */
+    ~CPH5ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mCondition.notify_all();
+        for (std::size_t i = 0; i < mWorkers.size(); ++i) {
+            mWorkers[i].join();
+        }
+    }
+
+    /*!
+     * \brief Returns the number of worker threads.
+     * \return Number of worker threads.
+     */
+    unsigned getNumThreads() const {
+        return static_cast<unsigned>(mWorkers.size());
+    }
+
+    /*!
+     * \brief Queues a task to be run by one of the workers. Exceptions
+     *        escaping the task are swallowed, tasks that need to report
+     *        errors should catch them.
+     * \param task Task to run.
+     */
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mTasks.push_back(std::move(task));
+        }
+        mCondition.notify_one();
+    }
+
+    /*!
+     * \brief Calls fn(i) for every i in [0, n), spread dynamically over the
+     *        workers and the calling thread. Blocks until every call has
+     *        returned. If any call throws, the remaining indices are
+     *        skipped and the first exception is rethrown here.
+     * \param n Number of indices.
+     * \param fn Function to call with each index.
+     * \param maxThreads Maximum number of threads to use, including the
+     *        calling one. 0 means no limit.
+     */
+    void parallelFor(std::size_t n,
+                     const std::function<void(std::size_t)> &fn,
+                     unsigned maxThreads = 0) {
+        if (n == 0)
+            return;
+        std::shared_ptr<ForState> state(new ForState(n, fn));
+        std::size_t helpers = mWorkers.size();
+        if (maxThreads != 0 && helpers > maxThreads - 1)
+            helpers = maxThreads - 1;
+        if (helpers > n - 1)
+            helpers = n - 1;
+        for (std::size_t i = 0; i < helpers; ++i) {
+            submit([state]() { state->run(); });
+        }
+        state->run();
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->finished.wait(lock, [&state]() { return state->done == state->n; });
+        if (state->error) {
+            std::rethrow_exception(state->error);
+        }
+    }
+
+    /*!
+     * \brief Returns a pool shared by the whole process, sized to the
+     *        number of hardware threads and created on first use.
+     * \return Reference to the shared pool.
+     */
+    static CPH5ThreadPool &global() {
+        static CPH5ThreadPool pool;
+        return pool;
+    }
+
+private:
+
+    // Disable copy & assignment
+    CPH5ThreadPool(const CPH5ThreadPool &other);
+    CPH5ThreadPool &operator=(const CPH5ThreadPool &other);
+
+    /*!
+     * \brief Shared state of one parallelFor call. Helpers that only start
+     *        after all the indices are taken find nothing to do, so the
+     *        caller never waits on them.
+     */
+    struct ForState
+    {
+        ForState(std::size_t count, const std::function<void(std::size_t)> &func)
+            : n(count), next(0), done(0), fn(func)
+        {} // NOOP
+
+        void run() {
+            std::size_t i;
+            while ((i = next.fetch_add(1)) < n) {
+                bool failed;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    failed = static_cast<bool>(error);
+                }
+                if (!failed) {
+                    try {
+                        fn(i);
+                    } catch (...) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if (!error)
+                            error = std::current_exception();
+                    }
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                if (++done == n)
+                    finished.notify_all();
+            }
+        }
+
+        std::size_t n;
+        std::atomic<std::size_t> next;
+        std::size_t done;
+        std::function<void(std::size_t)> fn;
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+
+    void workerLoop() {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCondition.wait(lock, [this]() { return mStop || !mTasks.empty(); });
+                if (mTasks.empty())
+                    return;
+                task = std::move(mTasks.front());
+                mTasks.pop_front();
+            }
+            try {
+                task();
+            } catch (...) {
+                // NOOP
+            }
+        }
+    }
+
+    std::vector<std::thread> mWorkers;
+    std::deque<std::function<void()> > mTasks;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    bool mStop;
+};
+
+
+#endif // CPH5PARALLEL_H
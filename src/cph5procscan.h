@@ -0,0 +1,275 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5PROCSCAN_H
+#define CPH5PROCSCAN_H
+
+#include "cph5utilities.h"
+#include "cph5dataset.h"
+#include "cph5parallel.h"
+
+#ifndef _WIN32
+
+#include <atomic>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+/*!
+ * \brief Scans a dataset with several worker processes, to use all the
+ *        cores on work that the HDF5 library, which serializes its calls,
+ *        would otherwise limit to one thread.
+ *
+ * The dataset is split along its first dimension into blocks lined up with
+ * the chunks (or of about 16MB for a contiguous dataset). Each of the
+ * nProcs forked workers takes blocks from a counter in shared memory until
+ * none are left, reads each one with all of the other dimensions, and
+ * hands it to the kernel, which folds it into the partial result of that
+ * worker. The partial results come back to the parent through pipes and
+ * are combined with reduce, in worker order.
+ *
+ * The file is flushed before the fork so the workers see everything the
+ * parent wrote. Each worker then opens the file again by name, read only,
+ * reads the dataset only through that handle, and leaves with _exit, so it
+ * never uses, flushes or closes the file objects it inherited from the
+ * parent. The CPH5LibraryLock is held while the workers are forked, so no
+ * other thread of the parent that follows the locking rules is inside the
+ * HDF5 library at the time of a fork. The parent blocks until every worker
+ * is done.
+ *
+ * R must be trivially copyable, since it travels through a pipe as bytes.
+ * T must not be a CPH5CompType: the kernel gets the block as an array of T,
+ * which only works for plain element types.
+ *
+ * Example, a sum of squares: <pre>
+ * double sum = CPH5ProcessScan(file.samples, 0, 0.0,
+ *     [](const float *block, const hsize_t *start, const hsize_t *count, double &acc) {
+ *         for (hsize_t i = 0; i < count[0]; ++i)
+ *             acc += block[i] * block[i];
+ *     },
+ *     [](double &total, const double &part) { total += part; });
+ * </pre>
+ *
+ * \param ds Root-order dataset, open.
+ * \param nProcs Number of worker processes, 0 for one per online core.
+ *        With 1 the scan runs in the calling process.
+ * \param init Initial value of the result and of every partial result.
+ * \param kernel Called as kernel(const T *block, const hsize_t *start,
+ *        const hsize_t *count, R &partial) for every block, with the block
+ *        laid out [count[0]][count[1]]... in the dataset type.
+ * \param reduce Called as reduce(R &result, const R &partial) for every
+ *        worker.
+ * \return The reduced result.
+ */
+template<typename T, const int nDims, typename R, typename Kernel, typename Reduce>
+R CPH5ProcessScan(CPH5Dataset<T, nDims> &ds,
+                  int nProcs,
+                  R init,
+                  Kernel kernel,
+                  Reduce reduce)
+{
+    static_assert(std::is_trivially_copyable<R>::value,
+                  "CPH5ProcessScan: the result type must be trivially copyable");
+    static_assert(!IsDerivedFrom<T, CPH5CompType>::Is,
+                  "CPH5ProcessScan: compound element types are not supported");
+    H5::DataSet *pDataSet = ds.getDataSet();
+    if (pDataSet == 0) {
+        throw std::runtime_error("CPH5ProcessScan: dataset " + ds.getName() + " is not open");
+    }
+    hsize_t dims[nDims];
+    pDataSet->getSpace().getSimpleExtentDims(dims);
+    hsize_t rowElems = 1;
+    for (int d = 1; d < nDims; ++d)
+        rowElems *= dims[d];
+    if (dims[0] == 0 || rowElems == 0)
+        return init;
+
+    hsize_t chunk[nDims];
+    hsize_t rowsPerBlock;
+    if (ds.getChunkDims(chunk)) {
+        rowsPerBlock = chunk[0];
+    } else {
+        rowsPerBlock = (16777216 / sizeof(T)) / rowElems;
+        if (rowsPerBlock == 0)
+            rowsPerBlock = 1;
+    }
+    hsize_t numBlocks = (dims[0] + rowsPerBlock - 1) / rowsPerBlock;
+
+    if (nProcs <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        nProcs = n > 0 ? static_cast<int>(n) : 1;
+    }
+    if (static_cast<hsize_t>(nProcs) > numBlocks)
+        nProcs = static_cast<int>(numBlocks);
+
+    // Runs the blocks handed out by next() through the kernel, reading
+    // them from the given dataset id.
+    H5::DataType memType = ds.getDataType();
+    hid_t memTypeId = memType.getId();
+    std::vector<T> block;
+    auto scan = [&](hid_t dataSetId, R &partial, auto next) {
+        hsize_t start[nDims] = {};
+        hsize_t count[nDims];
+        for (int d = 1; d < nDims; ++d)
+            count[d] = dims[d];
+        hid_t fileSpace = H5Dget_space(dataSetId);
+        if (fileSpace < 0)
+            throw std::runtime_error("CPH5ProcessScan: could not get the dataspace of " + ds.getName());
+        hsize_t b;
+        while ((b = next()) < numBlocks) {
+            start[0] = b * rowsPerBlock;
+            count[0] = start[0] + rowsPerBlock > dims[0] ? dims[0] - start[0] : rowsPerBlock;
+            block.resize(count[0] * rowElems);
+            hid_t memSpace = H5Screate_simple(nDims, count, 0);
+            herr_t err = H5Sselect_hyperslab(fileSpace, H5S_SELECT_SET, start, 0, count, 0);
+            if (err >= 0)
+                err = H5Dread(dataSetId, memTypeId, memSpace, fileSpace, H5P_DEFAULT, block.data());
+            H5Sclose(memSpace);
+            if (err < 0) {
+                H5Sclose(fileSpace);
+                throw std::runtime_error("CPH5ProcessScan: could not read " + ds.getName());
+            }
+            try {
+                kernel(static_cast<const T*>(block.data()),
+                       static_cast<const hsize_t*>(start),
+                       static_cast<const hsize_t*>(count),
+                       partial);
+            } catch (...) {
+                H5Sclose(fileSpace);
+                throw;
+            }
+        }
+        H5Sclose(fileSpace);
+    };
+
+    if (nProcs == 1) {
+        R partial = init;
+        hsize_t b = 0;
+        scan(pDataSet->getId(), partial, [&]() { return b++; });
+        R result = init;
+        reduce(result, static_cast<const R&>(partial));
+        return result;
+    }
+
+    void *shared = mmap(0, sizeof(std::atomic<hsize_t>), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        throw std::runtime_error("CPH5ProcessScan: could not map shared memory");
+    }
+    std::atomic<hsize_t> *pNext = new (shared) std::atomic<hsize_t>(0);
+
+    std::vector<pid_t> pids;
+    std::vector<int> fds;
+    {
+        CPH5LibraryLock lock;
+        H5Fflush(pDataSet->getId(), H5F_SCOPE_GLOBAL);
+        std::string fileName = pDataSet->getFileName();
+        std::string dataSetPath = pDataSet->getObjName();
+        for (int p = 0; p < nProcs; ++p) {
+            int pipeFds[2];
+            if (pipe(pipeFds) != 0)
+                break;
+            pid_t pid = fork();
+            if (pid < 0) {
+                close(pipeFds[0]);
+                close(pipeFds[1]);
+                break;
+            }
+            if (pid == 0) {
+                CPH5LibraryLock::resetAfterFork();
+                close(pipeFds[0]);
+                for (std::size_t i = 0; i < fds.size(); ++i)
+                    close(fds[i]);
+                // Fresh, read only handles of this worker's own. The
+                // inherited ones are left alone and never closed.
+                char ok = 0;
+                R partial = init;
+                hid_t fileId = H5Fopen(fileName.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+                hid_t dataSetId = fileId >= 0 ? H5Dopen2(fileId, dataSetPath.c_str(), H5P_DEFAULT) : -1;
+                if (dataSetId >= 0) {
+                    try {
+                        scan(dataSetId, partial, [&]() { return pNext->fetch_add(1); });
+                        ok = 1;
+                    } catch (...) {
+                        // Reported through the status byte
+                    }
+                }
+                // Status byte followed by the partial result.
+                char msg[1 + sizeof(R)];
+                msg[0] = ok;
+                memcpy(msg + 1, &partial, sizeof(R));
+                const char *pos = msg;
+                std::size_t left = sizeof(msg);
+                while (left > 0) {
+                    ssize_t n = write(pipeFds[1], pos, left);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0)
+                        break;
+                    pos += n;
+                    left -= static_cast<std::size_t>(n);
+                }
+                close(pipeFds[1]);
+                _exit(0);
+            }
+            close(pipeFds[1]);
+            pids.push_back(pid);
+            fds.push_back(pipeFds[0]);
+        }
+    }
+
+    // Collect every worker before deciding the outcome, so none is left
+    // behind as a zombie.
+    R result = init;
+    bool failed = false;
+    if (pids.empty()) {
+        // Could not fork at all, scan in this process instead.
+        R partial = init;
+        scan(pDataSet->getId(), partial, [&]() { return pNext->fetch_add(1); });
+        reduce(result, static_cast<const R&>(partial));
+    }
+    for (std::size_t i = 0; i < pids.size(); ++i) {
+        char msg[1 + sizeof(R)];
+        std::size_t got = 0;
+        while (got < sizeof(msg)) {
+            ssize_t n = read(fds[i], msg + got, sizeof(msg) - got);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            got += static_cast<std::size_t>(n);
+        }
+        close(fds[i]);
+        int status = 0;
+        while (waitpid(pids[i], &status, 0) < 0 && errno == EINTR) {} // NOOP
+        if (got != sizeof(msg) || msg[0] != 1 || !WIFEXITED(status)) {
+            failed = true;
+            continue;
+        }
+        R partial;
+        memcpy(&partial, msg + 1, sizeof(R));
+        reduce(result, static_cast<const R&>(partial));
+    }
+    munmap(shared, sizeof(std::atomic<hsize_t>));
+    if (failed) {
+        throw std::runtime_error("CPH5ProcessScan: a worker failed while scanning " + ds.getName());
+    }
+    return result;
+}
+
+#endif // _WIN32
+
+#endif // CPH5PROCSCAN_H
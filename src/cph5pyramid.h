@@ -0,0 +1,412 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5PYRAMID_H
+#define CPH5PYRAMID_H
+
+#include "cph5utilities.h"
+#include "cph5group.h"
+#include "cph5dataset.h"
+#include "cph5parallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+
+/*!
+ * \brief Resampling methods for reducing an image to half resolution. Each
+ *        overview pixel is computed from the (up to) 2 x 2 block of pixels
+ *        below it.
+ */
+enum CPH5Resampling
+{
+    CPH5_RESAMPLE_NEAREST = 0, //!< Top left pixel of the block
+    CPH5_RESAMPLE_AVERAGE,     //!< Mean of the block, rounded for integers
+    CPH5_RESAMPLE_MIN,         //!< Minimum of the block
+    CPH5_RESAMPLE_MAX          //!< Maximum of the block
+};
+
+
+/*!
+ * \brief The CPH5Pyramid class builds and reads reduced resolution overviews
+ *        of a two dimensional dataset, for quick look display of large
+ *        scenes.
+ *
+ * The overviews are sibling datasets of the source named
+ * <i>name</i>_ovr1 (1/2 resolution), <i>name</i>_ovr2 (1/4), and so on,
+ * each chunked in square tiles and tagged with the resampling method used.
+ * Level 0 is the source dataset itself. Every level is computed from the
+ * previous one a tile at a time on the global CPH5ThreadPool, so memory use
+ * is bounded by a few tiles per thread regardless of the size of the image.
+ *
+ * The pyramid holds HDF5 handles to the overviews, so it must be destroyed
+ * (or close() called) before the file is closed. The element type T must be
+ * a non-compound type.
+ *
+ * Example: <pre>
+ * CPH5Pyramid<uint16_t> pyramid(file.scene);
+ * pyramid.build(0, CPH5_RESAMPLE_AVERAGE);
+ * int level = pyramid.levelForSize(800, 600);
+ * </pre>
+ */
+template<typename T>
+class CPH5Pyramid
+{
+public:
+
+    /*!
+     * \brief Constructor. Opens the overviews already present in the file.
+     * \param source Root-order 2-D dataset, open, child of a group.
+     */
+    explicit CPH5Pyramid(CPH5Dataset<T, 2> &source)
+        : mSource(source),
+          mMethod(CPH5_RESAMPLE_AVERAGE),
+          mTileSize(256),
+          mDeflateLevel(0)
+    {
+        if (mSource.getGroupParent() == 0 || mSource.getDataSet() == 0) {
+            throw std::runtime_error("Pyramid source must be an open root-order dataset");
+        }
+        mMemType = H5::DataType(CPH5TypeProxy<T>());
+        openLevels();
+    }
+
+    /*!
+     * \brief Destructor. Closes the overview datasets.
+     */
+    ~CPH5Pyramid() {
+        close();
+    }
+
+    /*!
+     * \brief Closes the overview datasets.
+     */
+    void close() {
+        CPH5LibraryLock lock;
+        mLevels.clear();
+    }
+
+    /*!
+     * \brief Sets the tile size used for new overviews and for the work
+     *        units when building. Must be called before build.
+     * \param tileSize Rows and columns of each tile.
+     */
+    void setTileSize(hsize_t tileSize) {
+        mTileSize = tileSize;
+    }
+
+    /*!
+     * \brief Sets the compression of new overviews. Must be called before
+     *        build.
+     * \param level Integer with the level of compression (1-9) to use.
+     */
+    void setDeflateLevel(int level) {
+        mDeflateLevel = level;
+    }
+
+    /*!
+     * \brief Creates (replacing any existing ones) and computes the overview
+     *        levels.
+     * \param numLevels Number of overviews to build. 0 keeps halving until
+     *        the overview fits in a single tile.
+     * \param method Resampling method.
+     * \param nThreads Maximum number of threads to use, 0 for all of the
+     *        threads of the global CPH5ThreadPool.
+     */
+    void build(int numLevels = 0,
+               CPH5Resampling method = CPH5_RESAMPLE_AVERAGE,
+               unsigned nThreads = 0) {
+        CPH5Group *parent = mSource.getGroupParent();
+        {
+            CPH5LibraryLock lock;
+            mLevels.clear();
+            for (int level = 1; exists(levelName(level)); ++level) {
+                parent->getH5Group()->unlink(levelName(level));
+            }
+        }
+        mMethod = method;
+        hsize_t width, height;
+        getLevelSize(0, &width, &height);
+        H5::DataType fileType = mSource.getDataSet()->getDataType();
+        for (int level = 1; numLevels == 0 || level <= numLevels; ++level) {
+            if (numLevels == 0 && width <= mTileSize && height <= mTileSize)
+                break;
+            width = (width + 1) / 2;
+            height = (height + 1) / 2;
+            {
+                CPH5LibraryLock lock;
+                hsize_t dims[2] = {height, width};
+                hsize_t chunk[2] = {height < mTileSize ? height : mTileSize,
+                                    width < mTileSize ? width : mTileSize};
+                if (chunk[0] == 0) chunk[0] = 1;
+                if (chunk[1] == 0) chunk[1] = 1;
+                H5::DataSpace space(2, dims);
+                H5::DSetCreatPropList props;
+                props.setChunk(2, chunk);
+                if (mDeflateLevel > 0)
+                    props.setDeflate(mDeflateLevel);
+                H5::DataSet *ds = parent->createDataSet(levelName(level),
+                                                        fileType,
+                                                        space,
+                                                        props);
+                mLevels.push_back(std::unique_ptr<H5::DataSet>(ds));
+                uint8_t tag = static_cast<uint8_t>(method);
+                H5::Attribute attr = ds->createAttribute(RESAMPLING_ATTR,
+                                                         H5::PredType::NATIVE_UINT8,
+                                                         H5::DataSpace());
+                attr.write(H5::PredType::NATIVE_UINT8, &tag);
+            }
+            computeRegion(level, 0, 0, width, height, nThreads);
+        }
+    }
+
+    /*!
+     * \brief Recomputes the overview pixels affected by a change of a
+     *        region of the source, using the method stored with the
+     *        overviews.
+     * \param x First column of the changed region in the source.
+     * \param y First row of the changed region in the source.
+     * \param w Number of columns in the changed region.
+     * \param h Number of rows in the changed region.
+     * \param nThreads Maximum number of threads to use, 0 for all of the
+     *        threads of the global CPH5ThreadPool.
+     */
+    void updateRegion(hsize_t x, hsize_t y, hsize_t w, hsize_t h,
+                      unsigned nThreads = 0) {
+        if (w == 0 || h == 0)
+            return;
+        hsize_t x1 = x + w;
+        hsize_t y1 = y + h;
+        for (int level = 1; level <= getNumLevels(); ++level) {
+            x /= 2;
+            y /= 2;
+            x1 = (x1 + 1) / 2;
+            y1 = (y1 + 1) / 2;
+            computeRegion(level, x, y, x1 - x, y1 - y, nThreads);
+        }
+    }
+
+    /*!
+     * \brief Returns the number of overview levels, not counting the source.
+     * \return Number of overviews.
+     */
+    int getNumLevels() const {
+        return static_cast<int>(mLevels.size());
+    }
+
+    /*!
+     * \brief Returns the resampling method of the overviews.
+     * \return Resampling method.
+     */
+    CPH5Resampling getResampling() const {
+        return mMethod;
+    }
+
+    /*!
+     * \brief Retrieves the size of a level.
+     * \param level Level, 0 for the source.
+     * \param width Set to the number of columns.
+     * \param height Set to the number of rows.
+     */
+    void getLevelSize(int level, hsize_t *width, hsize_t *height) const {
+        hsize_t dims[2];
+        CPH5LibraryLock lock;
+        levelDataSet(level)->getSpace().getSimpleExtentDims(dims);
+        *height = dims[0];
+        *width = dims[1];
+    }
+
+    /*!
+     * \brief Picks the level best suited to display the whole image at a
+     *        given size: the smallest level still at least as large as the
+     *        requested size in both directions.
+     * \param width Requested number of columns.
+     * \param height Requested number of rows.
+     * \return Level to read, 0 for the source.
+     */
+    int levelForSize(hsize_t width, hsize_t height) const {
+        int best = 0;
+        for (int level = 1; level <= getNumLevels(); ++level) {
+            hsize_t w, h;
+            getLevelSize(level, &w, &h);
+            if (w < width || h < height)
+                break;
+            best = level;
+        }
+        return best;
+    }
+
+    /*!
+     * \brief Reads a region of a level with a single hyperslab selection.
+     * \param level Level, 0 for the source.
+     * \param x First column of the region, in the coordinates of the level.
+     * \param y First row of the region, in the coordinates of the level.
+     * \param w Number of columns in the region.
+     * \param h Number of rows in the region.
+     * \param dst Buffer of w * h elements, filled row major.
+     */
+    void readLevel(int level, hsize_t x, hsize_t y, hsize_t w, hsize_t h, T *dst) {
+        if (w == 0 || h == 0)
+            return;
+        CPH5LibraryLock lock;
+        readBlock(levelDataSet(level), x, y, w, h, dst);
+    }
+
+private:
+
+    // Disable copy & assignment
+    CPH5Pyramid(const CPH5Pyramid &other);
+    CPH5Pyramid &operator=(const CPH5Pyramid &other);
+
+    static constexpr const char *RESAMPLING_ATTR = "cph5_resampling";
+
+    std::string levelName(int level) const {
+        std::ostringstream name;
+        name << mSource.getName() << "_ovr" << level;
+        return name.str();
+    }
+
+    bool exists(const std::string &name) const {
+        return H5Lexists(mSource.getGroupParent()->getH5Group()->getId(),
+                         name.c_str(),
+                         H5P_DEFAULT) > 0;
+    }
+
+    void openLevels() {
+        CPH5LibraryLock lock;
+        for (int level = 1; exists(levelName(level)); ++level) {
+            H5::DataSet *ds = mSource.getGroupParent()->openDataSet(levelName(level));
+            mLevels.push_back(std::unique_ptr<H5::DataSet>(ds));
+            if (level == 1 && ds->attrExists(RESAMPLING_ATTR)) {
+                uint8_t tag;
+                ds->openAttribute(RESAMPLING_ATTR).read(H5::PredType::NATIVE_UINT8, &tag);
+                mMethod = static_cast<CPH5Resampling>(tag);
+            }
+        }
+    }
+
+    H5::DataSet *levelDataSet(int level) const {
+        if (level < 0 || level > getNumLevels()) {
+            throw std::runtime_error("No such pyramid level");
+        }
+        return level == 0 ? mSource.getDataSet() : mLevels[level - 1].get();
+    }
+
+    void readBlock(H5::DataSet *ds, hsize_t x, hsize_t y, hsize_t w, hsize_t h, T *dst) {
+        hsize_t start[2] = {y, x};
+        hsize_t count[2] = {h, w};
+        H5::DataSpace filespace(ds->getSpace());
+        filespace.selectHyperslab(H5S_SELECT_SET, count, start);
+        H5::DataSpace memspace(2, count);
+        ds->read(dst, mMemType, memspace, filespace);
+    }
+
+    void writeBlock(H5::DataSet *ds, hsize_t x, hsize_t y, hsize_t w, hsize_t h, const T *src) {
+        hsize_t start[2] = {y, x};
+        hsize_t count[2] = {h, w};
+        H5::DataSpace filespace(ds->getSpace());
+        filespace.selectHyperslab(H5S_SELECT_SET, count, start);
+        H5::DataSpace memspace(2, count);
+        ds->write(src, mMemType, memspace, filespace);
+    }
+
+    /*!
+     * \brief Recomputes the tiles of a level covering a region of it, in
+     *        parallel. Each task reads the 2x larger block of the level
+     *        below, reduces it and writes its tile.
+     */
+    void computeRegion(int level, hsize_t x, hsize_t y, hsize_t w, hsize_t h,
+                       unsigned nThreads) {
+        hsize_t width, height, srcWidth, srcHeight;
+        getLevelSize(level, &width, &height);
+        getLevelSize(level - 1, &srcWidth, &srcHeight);
+        if (x + w > width) w = width - x;
+        if (y + h > height) h = height - y;
+        if (w == 0 || h == 0)
+            return;
+        hsize_t tx0 = x / mTileSize, tx1 = (x + w - 1) / mTileSize;
+        hsize_t ty0 = y / mTileSize, ty1 = (y + h - 1) / mTileSize;
+        hsize_t tilesX = tx1 - tx0 + 1;
+        std::size_t numTiles = static_cast<std::size_t>(tilesX * (ty1 - ty0 + 1));
+        H5::DataSet *src = levelDataSet(level - 1);
+        H5::DataSet *dst = levelDataSet(level);
+        CPH5ThreadPool::global().parallelFor(numTiles, [&](std::size_t i) {
+            hsize_t ox = (tx0 + i % tilesX) * mTileSize;
+            hsize_t oy = (ty0 + i / tilesX) * mTileSize;
+            hsize_t ow = ox + mTileSize <= width ? mTileSize : width - ox;
+            hsize_t oh = oy + mTileSize <= height ? mTileSize : height - oy;
+            hsize_t iw = 2 * ow <= srcWidth - 2 * ox ? 2 * ow : srcWidth - 2 * ox;
+            hsize_t ih = 2 * oh <= srcHeight - 2 * oy ? 2 * oh : srcHeight - 2 * oy;
+            std::vector<T> in(iw * ih);
+            std::vector<T> out(ow * oh);
+            {
+                CPH5LibraryLock lock;
+                readBlock(src, 2 * ox, 2 * oy, iw, ih, in.data());
+            }
+            reduce(in.data(), iw, ih, out.data(), ow, oh);
+            {
+                CPH5LibraryLock lock;
+                writeBlock(dst, ox, oy, ow, oh, out.data());
+            }
+        }, nThreads);
+    }
+
+    /*!
+     * \brief Reduces an iw x ih block to ow x oh, ow = ceil(iw / 2) and
+     *        oh = ceil(ih / 2). Blocks on the right and bottom edges may
+     *        have only one column or row.
+     */
+    void reduce(const T *in, hsize_t iw, hsize_t ih, T *out, hsize_t ow, hsize_t oh) const {
+        for (hsize_t oy = 0; oy < oh; ++oy) {
+            const T *row0 = in + 2 * oy * iw;
+            const T *row1 = 2 * oy + 1 < ih ? row0 + iw : row0;
+            T *o = out + oy * ow;
+            for (hsize_t ox = 0; ox < ow; ++ox) {
+                hsize_t c0 = 2 * ox;
+                hsize_t c1 = c0 + 1 < iw ? c0 + 1 : c0;
+                T a = row0[c0], b = row0[c1], c = row1[c0], d = row1[c1];
+                switch (mMethod) {
+                case CPH5_RESAMPLE_NEAREST:
+                    o[ox] = a;
+                    break;
+                case CPH5_RESAMPLE_MIN:
+                    o[ox] = std::min(std::min(a, b), std::min(c, d));
+                    break;
+                case CPH5_RESAMPLE_MAX:
+                    o[ox] = std::max(std::max(a, b), std::max(c, d));
+                    break;
+                default:
+                {
+                    // Duplicated edge samples weigh the same, so the mean
+                    // of the four is the mean of the distinct ones.
+                    double mean = (static_cast<double>(a) + b + c + d) / 4.0;
+                    o[ox] = std::is_integral<T>::value
+                            ? static_cast<T>(std::floor(mean + 0.5))
+                            : static_cast<T>(mean);
+                    break;
+                }
+                }
+            }
+        }
+    }
+
+    CPH5Dataset<T, 2> &mSource;
+    std::vector<std::unique_ptr<H5::DataSet> > mLevels;
+    H5::DataType mMemType;
+    CPH5Resampling mMethod;
+    hsize_t mTileSize;
+    int mDeflateLevel;
+};
+
+
+#endif // CPH5PYRAMID_H
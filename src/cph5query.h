@@ -0,0 +1,490 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5QUERY_H
+#define CPH5QUERY_H
+
+#include "cph5utilities.h"
+#include "cph5comptype.h"
+#include "cph5dataset.h"
+#include "cph5parallel.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+
+/*!
+ * \brief The CPH5Query class selects the rows of a 1-D compound dataset
+ *        that satisfy a predicate over its members, such as
+ *        "status != 0 && temperature > 80".
+ *
+ * The expression compares top level numeric members (integer or floating
+ * point) with each other or with numbers, using == != < <= > >=, and
+ * combines comparisons with &&, || and !, with parentheses as needed. A
+ * member on its own means member != 0.
+ *
+ * The dataset is read in blocks of rows (one chunk tall for a chunked
+ * dataset) in the native layout of its type, which needs no conversion by
+ * HDF5. Since chunks hold whole records, this costs no more I/O than a
+ * partial compound type and avoids the slow compound subset conversion.
+ * Only the members the expression names are then copied out of the block,
+ * converted to double, into one array per member, and the expression is
+ * evaluated over the whole block a comparison at a time, as tight loops
+ * over contiguous arrays producing byte masks, which the compiler
+ * vectorizes. Integers beyond 2^53 lose precision in the conversion.
+ *
+ * With setNumThreads, blocks are evaluated on the CPH5ThreadPool; the reads
+ * themselves hold the CPH5LibraryLock.
+ *
+ * Example: <pre>
+ * CPH5Query<Telemetry> query(file.telemetry, "status != 0 && temperature > 80");
+ * std::vector<hsize_t> rows = query.findRows();
+ * std::vector<Telemetry> hot(rows.size());
+ * query.gather(rows, hot.data());
+ * </pre>
+ */
+template<class C>
+class CPH5Query
+{
+public:
+
+    /*!
+     * \brief Constructor. Parses the expression and checks its members
+     *        against the type of the dataset; throws std::runtime_error on
+     *        a syntax error or an unknown or non-numeric member.
+     * \param ds Root-order 1-D compound dataset, open.
+     * \param expression Predicate over member names.
+     */
+    CPH5Query(CPH5Dataset<C, 1> &ds, const std::string &expression)
+        : mDataset(ds),
+          mBlockRows(0),
+          mNumThreads(1),
+          mText(expression),
+          mPos(0)
+    {
+        H5::DataSet *pDataSet = mDataset.getDataSet();
+        if (pDataSet == 0) {
+            throw std::runtime_error("CPH5Query: dataset " + mDataset.getName() + " is not open");
+        }
+        H5::CompType fileType = pDataSet->getCompType();
+        hid_t nativeId = H5Tget_native_type(fileType.getId(), H5T_DIR_ASCEND);
+        if (nativeId < 0) {
+            throw std::runtime_error("CPH5Query: no native type for " + mDataset.getName());
+        }
+        mNativeType = H5::CompType(nativeId);
+        H5Tclose(nativeId);
+        mRoot = parseOr();
+        skipSpace();
+        if (mPos != mText.size()) {
+            syntaxError("unexpected text");
+        }
+    }
+
+    /*!
+     * \brief Sets the number of rows read and evaluated at a time.
+     * \param rows Rows per block, 0 (default) for the chunk height of a
+     *        chunked dataset, or 65536 rows.
+     */
+    void setBlockRows(hsize_t rows) {
+        mBlockRows = rows;
+    }
+
+    /*!
+     * \brief Sets the number of threads evaluating blocks.
+     * \param numThreads Number of threads including the calling one, 0 for
+     *        all the threads of the global pool. 1 by default.
+     */
+    void setNumThreads(int numThreads) {
+        mNumThreads = numThreads;
+    }
+
+    /*!
+     * \brief Returns the names of the members the expression reads.
+     * \return Member names, in order of first use.
+     */
+    const std::vector<std::string> &getColumns() const {
+        return mColumns;
+    }
+
+    /*!
+     * \brief Finds the rows that satisfy the predicate.
+     * \return Indices of the matching rows, ascending.
+     */
+    std::vector<hsize_t> findRows() {
+        return findRows(0, static_cast<hsize_t>(mDataset.getDimSize()));
+    }
+
+    /*!
+     * \brief Finds the rows of a range that satisfy the predicate.
+     * \param start First row of the range.
+     * \param count Number of rows in the range.
+     * \return Indices of the matching rows, ascending.
+     */
+    std::vector<hsize_t> findRows(hsize_t start, hsize_t count) {
+        std::vector<hsize_t> rows;
+        scan(start, count, &rows);
+        return rows;
+    }
+
+    /*!
+     * \brief Counts the rows that satisfy the predicate.
+     * \return Number of matching rows.
+     */
+    hsize_t count() {
+        return scan(0, static_cast<hsize_t>(mDataset.getDimSize()), 0);
+    }
+
+    /*!
+     * \brief Reads whole records of the given rows, packed in the memory
+     *        layout of the dataset type.
+     * \param rows Row indices, e.g. from findRows.
+     * \param dst Buffer of rows.size() records of the dataset type.
+     */
+    void gatherRaw(const std::vector<hsize_t> &rows, void *dst) {
+        if (rows.empty())
+            return;
+        CPH5LibraryLock lock;
+        H5::DataSet *pDataSet = mDataset.getDataSet();
+        H5::DataSpace filespace(pDataSet->getSpace());
+        filespace.selectElements(H5S_SELECT_SET, rows.size(), rows.data());
+        hsize_t n = static_cast<hsize_t>(rows.size());
+        H5::DataSpace memspace(1, &n);
+        pDataSet->read(dst, mDataset.getDataType(), memspace, filespace);
+    }
+
+    /*!
+     * \brief Reads whole records of the given rows into compound objects.
+     * \param rows Row indices, e.g. from findRows.
+     * \param dst Array of rows.size() objects.
+     */
+    void gather(const std::vector<hsize_t> &rows, C *dst) {
+        if (rows.empty())
+            return;
+        std::vector<char> buf(C().getTotalMemorySize() * rows.size());
+        gatherRaw(rows, buf.data());
+        char *p = buf.data();
+        for (std::size_t i = 0; i < rows.size(); ++i) {
+            dst[i].latchAllAndMove(p);
+        }
+    }
+
+private:
+
+    // Disable copy & assignment
+    CPH5Query(const CPH5Query &other);
+    CPH5Query &operator=(const CPH5Query &other);
+
+    enum Op { OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE, OP_AND, OP_OR, OP_NOT };
+
+    // Node of the expression. Comparisons hold two operands, each either a
+    // column index or a constant; logic nodes hold children.
+    struct Node
+    {
+        Op op;
+        int leftColumn;
+        int rightColumn;
+        double leftValue;
+        double rightValue;
+        std::unique_ptr<Node> a;
+        std::unique_ptr<Node> b;
+    };
+
+    typedef std::unique_ptr<Node> NodePtr;
+
+    // Parser
+    void skipSpace() {
+        while (mPos < mText.size() && isspace(static_cast<unsigned char>(mText[mPos])))
+            ++mPos;
+    }
+
+    bool accept(const char *token) {
+        skipSpace();
+        std::size_t len = strlen(token);
+        if (mText.compare(mPos, len, token) == 0) {
+            mPos += len;
+            return true;
+        }
+        return false;
+    }
+
+    void syntaxError(const std::string &what) const {
+        throw std::runtime_error("CPH5Query: " + what + " at position "
+                                 + std::to_string(mPos) + " of \"" + mText + "\"");
+    }
+
+    NodePtr logic(Op op, NodePtr a, NodePtr b) {
+        NodePtr n(new Node());
+        n->op = op;
+        n->a = std::move(a);
+        n->b = std::move(b);
+        return n;
+    }
+
+    NodePtr parseOr() {
+        NodePtr left = parseAnd();
+        while (accept("||"))
+            left = logic(OP_OR, std::move(left), parseAnd());
+        return left;
+    }
+
+    NodePtr parseAnd() {
+        NodePtr left = parseUnary();
+        while (accept("&&"))
+            left = logic(OP_AND, std::move(left), parseUnary());
+        return left;
+    }
+
+    NodePtr parseUnary() {
+        skipSpace();
+        if (mPos < mText.size() && mText[mPos] == '!' && mText.compare(mPos, 2, "!=") != 0) {
+            ++mPos;
+            return logic(OP_NOT, parseUnary(), NodePtr());
+        }
+        if (accept("(")) {
+            NodePtr inner = parseOr();
+            if (!accept(")"))
+                syntaxError("missing )");
+            return inner;
+        }
+        return parseComparison();
+    }
+
+    NodePtr parseComparison() {
+        NodePtr n(new Node());
+        parseOperand(n->leftColumn, n->leftValue);
+        if (accept("==")) n->op = OP_EQ;
+        else if (accept("!=")) n->op = OP_NE;
+        else if (accept("<=")) n->op = OP_LE;
+        else if (accept(">=")) n->op = OP_GE;
+        else if (accept("<")) n->op = OP_LT;
+        else if (accept(">")) n->op = OP_GT;
+        else {
+            // A member on its own is true when non zero.
+            if (n->leftColumn < 0)
+                syntaxError("expected a comparison");
+            n->op = OP_NE;
+            n->rightColumn = -1;
+            n->rightValue = 0.0;
+            return n;
+        }
+        parseOperand(n->rightColumn, n->rightValue);
+        return n;
+    }
+
+    void parseOperand(int &column, double &value) {
+        skipSpace();
+        column = -1;
+        value = 0.0;
+        if (mPos >= mText.size())
+            syntaxError("expected a member or number");
+        char ch = mText[mPos];
+        if (isalpha(static_cast<unsigned char>(ch)) || ch == '_') {
+            std::size_t end = mPos;
+            while (end < mText.size()
+                   && (isalnum(static_cast<unsigned char>(mText[end])) || mText[end] == '_'))
+                ++end;
+            column = columnIndex(mText.substr(mPos, end - mPos));
+            mPos = end;
+            return;
+        }
+        const char *begin = mText.c_str() + mPos;
+        char *end = 0;
+        value = strtod(begin, &end);
+        if (end == begin)
+            syntaxError("expected a member or number");
+        mPos += static_cast<std::size_t>(end - begin);
+    }
+
+    int columnIndex(const std::string &name) {
+        for (std::size_t i = 0; i < mColumns.size(); ++i) {
+            if (mColumns[i] == name)
+                return static_cast<int>(i);
+        }
+        int member = H5Tget_member_index(mNativeType.getId(), name.c_str());
+        if (member < 0) {
+            throw std::runtime_error("CPH5Query: no member " + name + " in " + mDataset.getName());
+        }
+        unsigned index = static_cast<unsigned>(member);
+        CPH5NumericField column;
+        if (!column.init(mNativeType.getMemberDataType(index), mNativeType.getMemberOffset(index))) {
+            throw std::runtime_error("CPH5Query: member " + name + " is not numeric");
+        }
+        mColumns.push_back(name);
+        mColumnInfo.push_back(column);
+        return static_cast<int>(mColumns.size() - 1);
+    }
+
+    // Evaluation over a block of n rows, cols[c] holding column c.
+    void eval(const Node *node, const std::vector<std::vector<double> > &cols,
+              std::size_t n, uint8_t *mask) const {
+        switch (node->op) {
+        case OP_AND:
+        case OP_OR: {
+            std::vector<uint8_t> other(n);
+            eval(node->a.get(), cols, n, mask);
+            eval(node->b.get(), cols, n, other.data());
+            if (node->op == OP_AND) {
+                for (std::size_t i = 0; i < n; ++i)
+                    mask[i] &= other[i];
+            } else {
+                for (std::size_t i = 0; i < n; ++i)
+                    mask[i] |= other[i];
+            }
+            return;
+        }
+        case OP_NOT:
+            eval(node->a.get(), cols, n, mask);
+            for (std::size_t i = 0; i < n; ++i)
+                mask[i] ^= 1;
+            return;
+        default:
+            break;
+        }
+        if (node->leftColumn >= 0 && node->rightColumn >= 0) {
+            compare(node->op, cols[node->leftColumn].data(), 1,
+                    cols[node->rightColumn].data(), 1, n, mask);
+        } else if (node->leftColumn >= 0) {
+            compare(node->op, cols[node->leftColumn].data(), 1,
+                    &node->rightValue, 0, n, mask);
+        } else if (node->rightColumn >= 0) {
+            compare(node->op, &node->leftValue, 0,
+                    cols[node->rightColumn].data(), 1, n, mask);
+        } else {
+            compare(node->op, &node->leftValue, 0, &node->rightValue, 0, n, mask);
+        }
+    }
+
+    // The operands step by sa / sb (1 for a column, 0 for a constant).
+    static void compare(Op op, const double *a, std::size_t sa,
+                        const double *b, std::size_t sb,
+                        std::size_t n, uint8_t *mask) {
+        if (sa == 1 && sb == 0) {
+            compareConst(op, a, *b, n, mask);
+            return;
+        }
+        switch (op) {
+        case OP_EQ: for (std::size_t i = 0; i < n; ++i) mask[i] = a[i * sa] == b[i * sb]; break;
+        case OP_NE: for (std::size_t i = 0; i < n; ++i) mask[i] = a[i * sa] != b[i * sb]; break;
+        case OP_LT: for (std::size_t i = 0; i < n; ++i) mask[i] = a[i * sa] <  b[i * sb]; break;
+        case OP_LE: for (std::size_t i = 0; i < n; ++i) mask[i] = a[i * sa] <= b[i * sb]; break;
+        case OP_GT: for (std::size_t i = 0; i < n; ++i) mask[i] = a[i * sa] >  b[i * sb]; break;
+        case OP_GE: for (std::size_t i = 0; i < n; ++i) mask[i] = a[i * sa] >= b[i * sb]; break;
+        default: break;
+        }
+    }
+
+    // The common column-against-constant case, kept separate so the loops
+    // have unit stride and vectorize.
+    static void compareConst(Op op, const double *a, double v, std::size_t n, uint8_t *mask) {
+        switch (op) {
+        case OP_EQ: for (std::size_t i = 0; i < n; ++i) mask[i] = a[i] == v; break;
+        case OP_NE: for (std::size_t i = 0; i < n; ++i) mask[i] = a[i] != v; break;
+        case OP_LT: for (std::size_t i = 0; i < n; ++i) mask[i] = a[i] <  v; break;
+        case OP_LE: for (std::size_t i = 0; i < n; ++i) mask[i] = a[i] <= v; break;
+        case OP_GT: for (std::size_t i = 0; i < n; ++i) mask[i] = a[i] >  v; break;
+        case OP_GE: for (std::size_t i = 0; i < n; ++i) mask[i] = a[i] >= v; break;
+        default: break;
+        }
+    }
+
+    // Reads and evaluates [start, start + count) block by block. Appends
+    // the matching rows to rows if given; returns the number of matches.
+    hsize_t scan(hsize_t start, hsize_t count, std::vector<hsize_t> *rows) {
+        hsize_t total = static_cast<hsize_t>(mDataset.getDimSize());
+        if (start + count > total) {
+            throw std::runtime_error("CPH5Query: range out of bounds for " + mDataset.getName());
+        }
+        if (count == 0)
+            return 0;
+        hsize_t blockRows = mBlockRows;
+        if (blockRows == 0) {
+            hsize_t chunk[1];
+            blockRows = mDataset.getChunkDims(chunk) ? chunk[0] : 65536;
+        }
+        // Blocks line up with multiples of blockRows so that each one
+        // covers whole chunks.
+        hsize_t firstBlock = start / blockRows;
+        hsize_t numBlocks = (start + count - 1) / blockRows - firstBlock + 1;
+        std::vector<std::vector<hsize_t> > found(numBlocks);
+        std::vector<hsize_t> numFound(numBlocks, 0);
+        std::size_t numCols = mColumns.size();
+
+        auto evalBlock = [&](std::size_t b) {
+            hsize_t lo = (firstBlock + b) * blockRows;
+            hsize_t hi = lo + blockRows;
+            if (lo < start)
+                lo = start;
+            if (hi > start + count)
+                hi = start + count;
+            std::size_t n = static_cast<std::size_t>(hi - lo);
+            std::vector<std::vector<double> > cols(numCols);
+            if (numCols > 0) {
+                std::vector<char> records(n * mNativeType.getSize());
+                {
+                    CPH5LibraryLock lock;
+                    hsize_t n64 = static_cast<hsize_t>(n);
+                    mDataset.readRawBlockUntracked(&lo, &n64, records.data(), mNativeType);
+                }
+                for (std::size_t c = 0; c < numCols; ++c) {
+                    cols[c].resize(n);
+                    mColumnInfo[c].extract(records.data(), mNativeType.getSize(), n, cols[c].data());
+                }
+            }
+            std::vector<uint8_t> mask(n);
+            eval(mRoot.get(), cols, n, mask.data());
+            hsize_t matches = 0;
+            for (std::size_t i = 0; i < n; ++i)
+                matches += mask[i];
+            numFound[b] = matches;
+            if (rows != 0) {
+                found[b].reserve(static_cast<std::size_t>(matches));
+                for (std::size_t i = 0; i < n; ++i) {
+                    if (mask[i])
+                        found[b].push_back(lo + i);
+                }
+            }
+        };
+
+        if (mNumThreads == 1 || numBlocks == 1) {
+            for (std::size_t b = 0; b < numBlocks; ++b)
+                evalBlock(b);
+        } else {
+            CPH5ThreadPool::global().parallelFor(
+                        static_cast<std::size_t>(numBlocks), evalBlock,
+                        mNumThreads > 0 ? static_cast<unsigned>(mNumThreads) : 0);
+        }
+
+        hsize_t matches = 0;
+        for (std::size_t b = 0; b < numBlocks; ++b)
+            matches += numFound[b];
+        if (rows != 0) {
+            rows->reserve(rows->size() + static_cast<std::size_t>(matches));
+            for (std::size_t b = 0; b < numBlocks; ++b)
+                rows->insert(rows->end(), found[b].begin(), found[b].end());
+        }
+        return matches;
+    }
+
+    CPH5Dataset<C, 1> &mDataset;
+    hsize_t mBlockRows;
+    int mNumThreads;
+    std::string mText;
+    std::size_t mPos;
+    H5::CompType mNativeType;
+    std::vector<std::string> mColumns;
+    std::vector<CPH5NumericField> mColumnInfo;
+    NodePtr mRoot;
+};
+
+
+#endif // CPH5QUERY_H
@@ -0,0 +1,318 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5RAGGED_H
+#define CPH5RAGGED_H
+
+#include "cph5utilities.h"
+#include "cph5group.h"
+#include "cph5dataset.h"
+#include "cph5parallel.h"
+
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+/*!
+ * \brief The CPH5RaggedArray class stores a list of rows of differing
+ *        length, such as a variable number of hits per event, in a group
+ *        holding two chunked, extendible datasets:
+ *        <ul>
+ *           <li>values  - every element of every row, back to back</li>
+ *           <li>offsets - uint64 prefix sums, offsets[i] is the index in
+ *                         values one past the end of row i</li>
+ *        </ul>
+ *        Both datasets are written and read sequentially and can be
+ *        compressed, unlike a list of variable length sequences. Reading a
+ *        row, or a range of rows, is two hyperslab reads.
+ *
+ * The element type T must be a non-compound type: the values are moved as
+ * raw blocks of T.
+ *
+ * Example: <pre>
+ * struct EventFile : public CPH5Group {
+ *     EventFile() : CPH5Group(), hits(this, "hits") {}
+ *     CPH5RaggedArray<float> hits;
+ * };
+ * ...
+ * file.hits.append(eventHits.data(), eventHits.size());
+ * </pre>
+ */
+template<typename T>
+class CPH5RaggedArray : public CPH5Group
+{
+public:
+
+    /*!
+     * \brief Constructor, with the element type taken from CPH5TypeProxy.
+     * \param parent The group to which this ragged array belongs.
+     * \param name The name of the group visible in the HDF5 file.
+     */
+    CPH5RaggedArray(CPH5Group *parent, std::string name)
+        : CPH5Group(parent, name),
+          mValues(this, "values"),
+          mOffsets(this, "offsets", H5::PredType::NATIVE_UINT64),
+          mNumRows(0),
+          mNumValues(0),
+          mRowsPerChunk(1024)
+    {
+        init();
+    }
+
+    /*!
+     * \brief Constructor with an explicit element type.
+     * \param parent The group to which this ragged array belongs.
+     * \param name The name of the group visible in the HDF5 file.
+     * \param type The HDF5 DataType to store the elements with.
+     */
+    CPH5RaggedArray(CPH5Group *parent, std::string name, H5::DataType type)
+        : CPH5Group(parent, name),
+          mValues(this, "values", type),
+          mOffsets(this, "offsets", H5::PredType::NATIVE_UINT64),
+          mNumRows(0),
+          mNumValues(0),
+          mRowsPerChunk(1024)
+    {
+        init();
+    }
+
+    /*!
+     * \brief Sets the chunk sizes of the two datasets. Must be called before
+     *        the file is created.
+     * \param valuesPerChunk Number of elements in each chunk of values.
+     * \param rowsPerChunk Number of rows in each chunk of offsets. This is
+     *        also the number of rows handled by each task of forEachRow.
+     */
+    void setChunkSizes(hsize_t valuesPerChunk, hsize_t rowsPerChunk) {
+        mValues.setChunkSize(&valuesPerChunk);
+        mOffsets.setChunkSize(&rowsPerChunk);
+        mRowsPerChunk = rowsPerChunk;
+    }
+
+    /*!
+     * \brief Sets the compression of both datasets. Must be called before
+     *        the file is created.
+     * \param level Integer with the level of compression (1-9) to use.
+     */
+    void setDeflateLevel(int level) {
+        mValues.setDeflateLevel(level);
+        mOffsets.setDeflateLevel(level);
+    }
+
+    /*!
+     * \brief Returns the number of rows.
+     * \return Number of rows.
+     */
+    hsize_t getNumRows() const {
+        return mNumRows;
+    }
+
+    /*!
+     * \brief Returns the total number of elements in all the rows.
+     * \return Number of elements.
+     */
+    hsize_t getNumValues() const {
+        return mNumValues;
+    }
+
+    /*!
+     * \brief Appends one row.
+     * \param data Elements of the row.
+     * \param n Number of elements in the row, may be 0.
+     * \return Index of the new row.
+     */
+    hsize_t append(const T *data, hsize_t n) {
+        return appendRows(data, &n, 1);
+    }
+
+    /*!
+     * \brief Appends a batch of rows with one extend and one write of each
+     *        dataset.
+     * \param data Elements of all the rows, back to back.
+     * \param rowSizes Number of elements in each row.
+     * \param nRows Number of rows.
+     * \return Index of the first new row.
+     */
+    hsize_t appendRows(const T *data, const hsize_t *rowSizes, hsize_t nRows) {
+        checkOpen();
+        hsize_t firstRow = mNumRows;
+        if (nRows == 0)
+            return firstRow;
+        std::vector<uint64_t> ends(nRows);
+        hsize_t total = 0;
+        for (hsize_t i = 0; i < nRows; ++i) {
+            total += rowSizes[i];
+            ends[i] = mNumValues + total;
+        }
+        if (total > 0) {
+            mValues.extend(total);
+            mValues.writeRawBlock(&mNumValues, &total, data);
+        }
+        mOffsets.extend(nRows);
+        mOffsets.writeRawBlock(&mNumRows, &nRows, ends.data());
+        mNumValues += total;
+        mNumRows += nRows;
+        return firstRow;
+    }
+
+    /*!
+     * \brief Returns the number of elements in row i.
+     * \param i Row index.
+     * \return Number of elements.
+     */
+    hsize_t getRowSize(hsize_t i) {
+        hsize_t start, end;
+        rowBounds(i, i + 1, &start, &end);
+        return end - start;
+    }
+
+    /*!
+     * \brief Reads row i.
+     * \param i Row index.
+     * \param dst Vector resized to and filled with the elements of the row.
+     */
+    void read(hsize_t i, std::vector<T> &dst) {
+        std::vector<hsize_t> rowStarts;
+        readRange(i, i + 1, dst, rowStarts);
+    }
+
+    /*!
+     * \brief Reads rows [i, j).
+     * \param i First row.
+     * \param j One past the last row.
+     * \param dst Vector resized to and filled with the elements of the rows.
+     * \param rowStarts Vector resized to j - i + 1 entries, row i + k
+     *        occupies dst[rowStarts[k]] up to dst[rowStarts[k+1]].
+     */
+    void readRange(hsize_t i,
+                   hsize_t j,
+                   std::vector<T> &dst,
+                   std::vector<hsize_t> &rowStarts) {
+        checkOpen();
+        if (i > j || j > mNumRows) {
+            throw std::runtime_error("Row range out of bounds for " + getName());
+        }
+        rowStarts.assign(j - i + 1, 0);
+        if (i == j) {
+            dst.clear();
+            return;
+        }
+        hsize_t first = readEnds(i, j, rowStarts.data());
+        for (std::size_t k = 0; k < rowStarts.size(); ++k) {
+            rowStarts[k] -= first;
+        }
+        hsize_t count = rowStarts.back();
+        dst.resize(count);
+        if (count > 0) {
+            mValues.readRawBlock(&first, &count, dst.data());
+        }
+    }
+
+    /*!
+     * \brief Calls fn(row, data, size) for every row, in parallel. The rows
+     *        are handed out a chunk of offsets at a time; each task reads
+     *        its offsets and the matching values under the CPH5LibraryLock
+     *        and then calls fn for its rows outside of it, so fn must be
+     *        safe to call from several threads at once.
+     * \param fn Function to call for each row.
+     * \param nThreads Maximum number of threads to use, 0 for all of the
+     *        threads of the global CPH5ThreadPool.
+     */
+    void forEachRow(const std::function<void(hsize_t, const T*, hsize_t)> &fn,
+                    unsigned nThreads = 0) {
+        checkOpen();
+        hsize_t numRows = mNumRows;
+        hsize_t rowsPerTask = mRowsPerChunk;
+        std::size_t numTasks = static_cast<std::size_t>(
+                    (numRows + rowsPerTask - 1) / rowsPerTask);
+        CPH5ThreadPool::global().parallelFor(numTasks, [&](std::size_t task) {
+            hsize_t i = task * rowsPerTask;
+            hsize_t j = i + rowsPerTask < numRows ? i + rowsPerTask : numRows;
+            std::vector<T> values;
+            std::vector<hsize_t> rowStarts;
+            {
+                CPH5LibraryLock lock;
+                readRange(i, j, values, rowStarts);
+            }
+            for (hsize_t r = i; r < j; ++r) {
+                hsize_t k = r - i;
+                fn(r, values.data() + rowStarts[k], rowStarts[k+1] - rowStarts[k]);
+            }
+        }, nThreads);
+    }
+
+protected:
+
+    /*!
+     * \brief Opens the group and both datasets, then picks up the number of
+     *        rows, elements and the chunking of the offsets.
+     * \param create Flag for whether to create or open the group.
+     */
+    void openR(bool create) {
+        CPH5Group::openR(create);
+        if (mOffsets.getDataSet() == 0 || mValues.getDataSet() == 0)
+            return;
+        mOffsets.getDataSet()->getSpace().getSimpleExtentDims(&mNumRows);
+        mValues.getDataSet()->getSpace().getSimpleExtentDims(&mNumValues);
+        H5::DSetCreatPropList props(mOffsets.getDataSet()->getCreatePlist());
+        if (props.getLayout() == H5D_CHUNKED) {
+            props.getChunk(1, &mRowsPerChunk);
+        }
+    }
+
+private:
+
+    void init() {
+        hsize_t dims[1] = {0};
+        hsize_t maxDims[1] = {H5S_UNLIMITED};
+        mValues.setDimensions(dims, maxDims);
+        mOffsets.setDimensions(dims, maxDims);
+        setChunkSizes(16384, mRowsPerChunk);
+    }
+
+    void checkOpen() const {
+        if (mValues.getDataSet() == 0 || mOffsets.getDataSet() == 0) {
+            throw std::runtime_error("Ragged array " + getName() + " is not open");
+        }
+    }
+
+    /*!
+     * \brief Reads the ends of rows [i, j) into ends[1..j-i] and the start
+     *        of row i into ends[0], with one hyperslab read.
+     * \return The start of row i.
+     */
+    hsize_t readEnds(hsize_t i, hsize_t j, hsize_t *ends) {
+        static_assert(sizeof(hsize_t) == sizeof(uint64_t), "hsize_t is not 64 bits");
+        hsize_t start = i == 0 ? 0 : i - 1;
+        hsize_t count = j - start;
+        mOffsets.readRawBlock(&start, &count, i == 0 ? ends + 1 : ends);
+        if (i == 0)
+            ends[0] = 0;
+        return ends[0];
+    }
+
+    void rowBounds(hsize_t i, hsize_t j, hsize_t *start, hsize_t *end) {
+        checkOpen();
+        if (i >= j || j > mNumRows) {
+            throw std::runtime_error("Row range out of bounds for " + getName());
+        }
+        std::vector<hsize_t> ends(j - i + 1);
+        *start = readEnds(i, j, ends.data());
+        *end = ends.back();
+    }
+
+    CPH5Dataset<T, 1> mValues;
+    CPH5Dataset<uint64_t, 1> mOffsets;
+    hsize_t mNumRows;
+    hsize_t mNumValues;
+    hsize_t mRowsPerChunk;
+};
+
+
+#endif // CPH5RAGGED_H
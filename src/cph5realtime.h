@@ -0,0 +1,338 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5REALTIME_H
+#define CPH5REALTIME_H
+
+#include "cph5utilities.h"
+#include "cph5dataset.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include <stdint.h>
+
+
+/*!
+ * \brief The CPH5RealTimeWriter class writes rows of a fixed size dataset
+ *        with a bounded, repeatable cost per write.
+ *
+ * Everything a write needs is set up by the constructor: the dataset id,
+ * a private copy of the memory type, a memory space of one row, a file
+ * space with the row selection already made, and the transfer property
+ * list. A write then only moves the selection with H5Soffset_simple and
+ * calls H5Dwrite; it does not touch the heap, build selections, extend the
+ * dataset, or throw.
+ *
+ * For the file side to be just as predictable, the dataset should be given
+ * its full size up front and setRealTimeMode() before the file is opened, so
+ * its storage is allocated at creation and never filled. A contiguous
+ * layout (no setChunkSize) also skips the chunk index and chunk cache.
+ * The first few writes warm the free lists of the HDF5 library; write a
+ * row ahead of the time critical section if that matters.
+ *
+ * The dataset must stay open while the writer is in use.
+ *
+ * Example: <pre>
+ * file.telemetry.setDimensions(dims, dims); // e.g. {3600000, 16}
+ * file.telemetry.setRealTimeMode();
+ * file.createOrOverwriteFile("run.h5");
+ * CPH5RealTimeWriter writer(file.telemetry);
+ * ...
+ * writer.append(sample);              // 16 values, no allocation
+ * </pre>
+ */
+class CPH5RealTimeWriter
+{
+public:
+
+    /*!
+     * \brief Constructor.
+     * \param ds Root-order dataset, open, of rank 1 or more. A row is
+     *        one index of the first dimension and all of the others.
+     */
+    template<class DS>
+    explicit CPH5RealTimeWriter(DS &ds)
+        : mDataSetId(-1),
+          mMemTypeId(-1),
+          mMemSpaceId(-1),
+          mFileSpaceId(-1),
+          mXferId(-1),
+          mRank(0),
+          mNumRows(0),
+          mCursor(0),
+          mWrap(false)
+    {
+        H5::DataSet *pDataSet = ds.getDataSet();
+        if (pDataSet == 0) {
+            throw std::runtime_error("CPH5RealTimeWriter: dataset " + ds.getName() + " is not open");
+        }
+        mDataSetId = pDataSet->getId();
+        H5Iinc_ref(mDataSetId);
+        mFileSpaceId = H5Dget_space(mDataSetId);
+        int rank = H5Sget_simple_extent_ndims(mFileSpaceId);
+        if (rank < 1 || rank > CPH_5_MAX_DIMS) {
+            release();
+            throw std::runtime_error("CPH5RealTimeWriter: dataset " + ds.getName() + " is not an array");
+        }
+        mRank = rank;
+        hsize_t dims[CPH_5_MAX_DIMS];
+        H5Sget_simple_extent_dims(mFileSpaceId, dims, 0);
+        mNumRows = dims[0];
+        hsize_t start[CPH_5_MAX_DIMS] = {};
+        dims[0] = 1;
+        H5Sselect_hyperslab(mFileSpaceId, H5S_SELECT_SET, start, 0, dims, 0);
+        mMemSpaceId = H5Screate_simple(mRank, dims, 0);
+        mMemTypeId = H5Tcopy(ds.getDataType().getId());
+        mXferId = H5Pcreate(H5P_DATASET_XFER);
+        for (int d = 0; d < CPH_5_MAX_DIMS; ++d)
+            mOffset[d] = 0;
+    }
+
+    ~CPH5RealTimeWriter() {
+        release();
+    }
+
+    /*!
+     * \brief Writes one row.
+     * \param row Index in the first dimension.
+     * \param src Buffer holding one row in the dataset type.
+     * \return True on success, false if the row is out of range or HDF5
+     *         reported an error.
+     */
+    bool writeRow(hsize_t row, const void *src) {
+        if (row >= mNumRows)
+            return false;
+        mOffset[0] = static_cast<hssize_t>(row);
+        if (H5Soffset_simple(mFileSpaceId, mOffset) < 0)
+            return false;
+        return H5Dwrite(mDataSetId, mMemTypeId, mMemSpaceId,
+                        mFileSpaceId, mXferId, src) >= 0;
+    }
+
+    /*!
+     * \brief Writes one row at the cursor and advances it. When the cursor
+     *        reaches the end of the dataset it either wraps back to row 0
+     *        (see setWrap) or further appends fail.
+     * \param src Buffer holding one row in the dataset type.
+     * \return True on success, false if the dataset is full or HDF5
+     *         reported an error.
+     */
+    bool append(const void *src) {
+        if (mCursor >= mNumRows) {
+            if (!mWrap || mNumRows == 0)
+                return false;
+            mCursor = 0;
+        }
+        if (!writeRow(mCursor, src))
+            return false;
+        ++mCursor;
+        return true;
+    }
+
+    /*!
+     * \brief Sets whether append wraps around to row 0 at the end of the
+     *        dataset, turning it into a ring buffer. Off by default.
+     * \param wrap True to wrap.
+     */
+    void setWrap(bool wrap) {
+        mWrap = wrap;
+    }
+
+    /*!
+     * \brief Moves the append cursor.
+     * \param row Next row append writes.
+     */
+    void setCursor(hsize_t row) {
+        mCursor = row;
+    }
+
+    /*!
+     * \brief Returns the row the next append writes.
+     * \return Cursor position.
+     */
+    hsize_t getCursor() const {
+        return mCursor;
+    }
+
+    /*!
+     * \brief Returns the number of rows of the dataset.
+     * \return Size of the first dimension.
+     */
+    hsize_t getNumRows() const {
+        return mNumRows;
+    }
+
+private:
+
+    // Disable copy & assignment
+    CPH5RealTimeWriter(const CPH5RealTimeWriter &other);
+    CPH5RealTimeWriter &operator=(const CPH5RealTimeWriter &other);
+
+    void release() {
+        if (mXferId >= 0)
+            H5Pclose(mXferId);
+        if (mMemTypeId >= 0)
+            H5Tclose(mMemTypeId);
+        if (mMemSpaceId >= 0)
+            H5Sclose(mMemSpaceId);
+        if (mFileSpaceId >= 0)
+            H5Sclose(mFileSpaceId);
+        if (mDataSetId >= 0)
+            H5Idec_ref(mDataSetId);
+        mXferId = mMemTypeId = mMemSpaceId = mFileSpaceId = mDataSetId = -1;
+    }
+
+    hid_t mDataSetId;
+    hid_t mMemTypeId;
+    hid_t mMemSpaceId;
+    hid_t mFileSpaceId;
+    hid_t mXferId;
+    int mRank;
+    hsize_t mNumRows;
+    hsize_t mCursor;
+    bool mWrap;
+    hssize_t mOffset[CPH_5_MAX_DIMS];
+};
+
+
+/*!
+ * \brief The CPH5LatencyRecorder class collects a histogram of durations,
+ *        in nanoseconds, for checking the worst case and tail latencies of
+ *        a write loop.
+ *
+ * The buckets are allocated by the constructor; record is a few integer
+ * operations with no allocation, so it can sit inside the loop it measures.
+ * Values up to 1024ns are kept exactly, larger ones in 512 buckets per
+ * power of two (within 0.2%). Percentiles report the upper edge of their
+ * bucket; the maximum is exact.
+ */
+class CPH5LatencyRecorder
+{
+public:
+
+    CPH5LatencyRecorder()
+        : mCounts(NUM_BUCKETS, 0),
+          mCount(0),
+          mSum(0),
+          mMin(UINT64_MAX),
+          mMax(0) {} // NOOP
+
+    /*!
+     * \brief Adds one duration.
+     * \param ns Duration in nanoseconds.
+     */
+    void record(uint64_t ns) {
+        ++mCounts[bucketOf(ns)];
+        ++mCount;
+        mSum += ns;
+        if (ns < mMin)
+            mMin = ns;
+        if (ns > mMax)
+            mMax = ns;
+    }
+
+    /*!
+     * \brief Returns the duration below or at which the given fraction of
+     *        the recorded durations fall.
+     * \param percent Percentile, e.g. 50, 99 or 99.99.
+     * \return Duration in nanoseconds, 0 if nothing was recorded.
+     */
+    uint64_t getPercentile(double percent) const {
+        if (mCount == 0)
+            return 0;
+        uint64_t rank = static_cast<uint64_t>(percent / 100.0 * static_cast<double>(mCount) + 0.5);
+        if (rank < 1)
+            rank = 1;
+        if (rank >= mCount)
+            return mMax;
+        uint64_t seen = 0;
+        for (std::size_t i = 0; i < mCounts.size(); ++i) {
+            seen += mCounts[i];
+            if (seen >= rank) {
+                uint64_t upper = bucketUpper(i);
+                return upper < mMax ? upper : mMax;
+            }
+        }
+        return mMax;
+    }
+
+    /*!
+     * \brief Returns the number of recorded durations.
+     * \return Count.
+     */
+    uint64_t getCount() const {
+        return mCount;
+    }
+
+    /*!
+     * \brief Returns the shortest recorded duration.
+     * \return Duration in nanoseconds, 0 if nothing was recorded.
+     */
+    uint64_t getMin() const {
+        return mCount == 0 ? 0 : mMin;
+    }
+
+    /*!
+     * \brief Returns the longest recorded duration.
+     * \return Duration in nanoseconds.
+     */
+    uint64_t getMax() const {
+        return mMax;
+    }
+
+    /*!
+     * \brief Returns the mean of the recorded durations.
+     * \return Mean in nanoseconds, 0 if nothing was recorded.
+     */
+    double getMean() const {
+        return mCount == 0 ? 0.0 : static_cast<double>(mSum) / static_cast<double>(mCount);
+    }
+
+    /*!
+     * \brief Forgets every recorded duration.
+     */
+    void reset() {
+        std::fill(mCounts.begin(), mCounts.end(), 0);
+        mCount = 0;
+        mSum = 0;
+        mMin = UINT64_MAX;
+        mMax = 0;
+    }
+
+private:
+
+    static const int SUB_BITS = 9;
+    static const std::size_t NUM_BUCKETS = ((64 - SUB_BITS) << SUB_BITS) + (1 << SUB_BITS);
+
+    static std::size_t bucketOf(uint64_t v) {
+        if (v < (2u << SUB_BITS))
+            return static_cast<std::size_t>(v);
+        int msb = 63;
+        while (!(v >> msb))
+            --msb;
+        int e = msb - SUB_BITS;
+        return (static_cast<std::size_t>(e) << SUB_BITS) + static_cast<std::size_t>(v >> e);
+    }
+
+    static uint64_t bucketUpper(std::size_t i) {
+        if (i < (2u << SUB_BITS))
+            return i;
+        int e = static_cast<int>(i >> SUB_BITS) - 1;
+        uint64_t m = i - (static_cast<std::size_t>(e) << SUB_BITS);
+        return ((m + 1) << e) - 1;
+    }
+
+    std::vector<uint64_t> mCounts;
+    uint64_t mCount;
+    uint64_t mSum;
+    uint64_t mMin;
+    uint64_t mMax;
+};
+
+
+#endif // CPH5REALTIME_H
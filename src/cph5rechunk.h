@@ -0,0 +1,884 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5RECHUNK_H
+#define CPH5RECHUNK_H
+
+#include "cph5utilities.h"
+#include "cph5group.h"
+#include "cph5dataset.h"
+#include "cph5parallel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(CPH5_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+
+/*!
+ * \brief The CPH5RechunkReport struct describes what a CPH5Rechunker run
+ *        chose and what it measured.
+ */
+struct CPH5RechunkReport
+{
+    std::vector<hsize_t> oldChunk;  //!< Chunk shape before, empty if not chunked
+    std::vector<hsize_t> newChunk;  //!< Chunk shape chosen
+    bool rewritten;                 //!< False if the dataset was left alone
+    bool direct;                    //!< True if chunks were written with H5Dwrite_chunk
+    uint64_t numReads;              //!< Number of reads in the histogram
+    double expectedSpeedup;         //!< Modelled read cost, old over new
+    double oldReadSeconds;          //!< Time to replay the sample reads before
+    double newReadSeconds;          //!< Time to replay them after
+    double measuredSpeedup;         //!< oldReadSeconds over newReadSeconds
+};
+
+
+/*!
+ * \brief The CPH5Rechunker class rewrites a dataset with the chunk shape
+ *        that best fits the way it is read, as recorded by
+ *        CPH5Dataset::setAccessTracking.
+ *
+ * The chunk shape is chosen with a cost model over the histogram of read
+ * shapes: a read of a block costs the number of chunks it is expected to
+ * touch (for a block at a random position) times the size of a chunk plus
+ * a fixed overhead per chunk. Chunks are kept between setMinChunkBytes and
+ * setMaxChunkBytes. The shape of least cost is searched for one dimension
+ * at a time from several starting points: unit chunks, the current chunks
+ * and each recorded read shape.
+ *
+ * run rewrites the dataset into a sibling with the same type, extent,
+ * filters, fill value and attributes, a block of chunks at a time so that
+ * memory stays within setMemoryBudget. When the filters are only shuffle
+ * and deflate (deflate needs CPH5_HAVE_ZLIB, defined by the CMake target
+ * when zlib is found) and HDF5 is 1.10.3 or later, the chunks are packed
+ * and compressed on the global CPH5ThreadPool and written with
+ * H5Dwrite_chunk, so only the raw reads and writes are serialized by the
+ * CPH5LibraryLock. Otherwise the blocks are copied through HDF5 on the
+ * calling thread.
+ *
+ * A sample of reads drawn from the histogram is then replayed on the old
+ * and new datasets and timed, so the report holds both the expected and
+ * the measured speedup. Finally the old dataset is unlinked and the new one
+ * takes its name, and the CPH5Dataset is reopened on it. The space of the
+ * old dataset is not reclaimed in the file until it is repacked (h5repack).
+ * With setOutputName the new dataset is kept under that name instead and
+ * the source is not touched.
+ *
+ * Example: <pre>
+ * file.cube.setAccessTracking(true);
+ * ... reads ...
+ * file.cube.getAccessStats()->save(*file.cube.getDataSet());
+ * ...
+ * CPH5Rechunker<float, 3> rechunker(file.cube);
+ * CPH5RechunkReport report = rechunker.run();
+ * </pre>
+ */
+template<typename T, const int nDims>
+class CPH5Rechunker
+{
+public:
+
+    /*!
+     * \brief Constructor. Starts from the histogram of the dataset's
+     *        getAccessStats if tracking is on, otherwise from the one saved
+     *        in its ACCESS_ATTR attribute.
+     * \param ds Root-order dataset, open, child of a group.
+     */
+    explicit CPH5Rechunker(CPH5Dataset<T, nDims> &ds)
+        : mDataset(ds),
+          mElemSize(0),
+          mMinChunkBytes(8192),
+          mMaxChunkBytes(1048576),
+          mChunkOverhead(16384),
+          mMemoryBudget(268435456),
+          mNumReplays(64),
+          mMinSpeedup(1.1)
+    {
+        if (ds.getGroupParent() == 0 || ds.getDataSet() == 0) {
+            throw std::runtime_error("CPH5Rechunker: dataset " + ds.getName() + " is not open");
+        }
+        CPH5LibraryLock lock;
+        H5::DataSet *pDataSet = ds.getDataSet();
+        pDataSet->getSpace().getSimpleExtentDims(mDims, mMaxDims);
+        mElemSize = pDataSet->getDataType().getSize();
+        CPH5AccessStats *pStats = ds.getAccessStats();
+        if (pStats != 0) {
+            addAccessStats(*pStats);
+        } else {
+            CPH5AccessStats saved;
+            if (saved.load(*pDataSet)) {
+                addAccessStats(saved);
+            }
+        }
+    }
+
+    /*!
+     * \brief Adds the reads of a histogram to the one used by this object.
+     * \param stats Histogram of reads of the dataset.
+     */
+    void addAccessStats(const CPH5AccessStats &stats) {
+        CPH5AccessStats::ShapeMap shapes = stats.getShapes();
+        for (CPH5AccessStats::ShapeMap::const_iterator it = shapes.begin();
+             it != shapes.end();
+             ++it) {
+            if (it->first.size() == static_cast<std::size_t>(nDims)) {
+                mStats.record(nDims, it->first.data(), it->second);
+            }
+        }
+    }
+
+    /*!
+     * \brief Adds reads of a given shape, e.g. an access pattern known in
+     *        advance.
+     * \param count Array of nDims sizes of the block read.
+     * \param times Number of reads.
+     */
+    void addShape(const hsize_t *count, uint64_t times = 1) {
+        mStats.record(nDims, count, times);
+    }
+
+    /*!
+     * \brief Sets the largest chunk the model may pick.
+     * \param bytes Size in bytes of an uncompressed chunk, 1MB by default.
+     */
+    void setMaxChunkBytes(std::size_t bytes) {
+        mMaxChunkBytes = bytes;
+    }
+
+    /*!
+     * \brief Sets the smallest chunk the model may pick, unless the whole
+     *        dataset, or half of the largest chunk, is smaller. Keeps the
+     *        chunk index from growing out of proportion for narrow reads.
+     * \param bytes Size in bytes of an uncompressed chunk, 8KB by default.
+     */
+    void setMinChunkBytes(std::size_t bytes) {
+        mMinChunkBytes = bytes;
+    }
+
+    /*!
+     * \brief Sets the fixed cost of touching one chunk in the model (index
+     *        lookup, filter call, I/O request), as a number of bytes read.
+     * \param bytes Overhead in bytes, 16KB by default.
+     */
+    void setChunkOverhead(std::size_t bytes) {
+        mChunkOverhead = bytes;
+    }
+
+    /*!
+     * \brief Sets the memory used for the blocks in flight during the copy
+     *        and for the replayed reads.
+     * \param bytes Budget in bytes, 256MB by default.
+     */
+    void setMemoryBudget(std::size_t bytes) {
+        mMemoryBudget = bytes;
+    }
+
+    /*!
+     * \brief Sets how many reads are replayed on each layout to measure
+     *        the speedup, 0 to skip the measurement.
+     * \param num Number of reads, 64 by default.
+     */
+    void setNumReplays(unsigned num) {
+        mNumReplays = num;
+    }
+
+    /*!
+     * \brief Sets the expected speedup below which run leaves the dataset
+     *        alone. Not used when an output name is set.
+     * \param speedup Ratio of modelled costs, 1.1 by default.
+     */
+    void setMinSpeedup(double speedup) {
+        mMinSpeedup = speedup;
+    }
+
+    /*!
+     * \brief Writes the new dataset under the given name in the same group
+     *        instead of replacing the source.
+     * \param name Name of the new dataset, empty (default) to replace.
+     */
+    void setOutputName(const std::string &name) {
+        mOutputName = name;
+    }
+
+    /*!
+     * \brief Returns the histogram used by this object.
+     * \return Reference to the histogram.
+     */
+    const CPH5AccessStats &getAccessStats() const {
+        return mStats;
+    }
+
+    /*!
+     * \brief Returns the modelled cost of reading the histogram with the
+     *        given chunk shape, in bytes.
+     * \param chunk Array of nDims chunk sizes.
+     * \return Cost, comparable between chunk shapes.
+     */
+    double cost(const hsize_t *chunk) const {
+        return costOf(mStats.getShapes(), chunk);
+    }
+
+    /*!
+     * \brief Picks the chunk shape of least modelled cost.
+     * \param chunk Array of nDims set to the chunk sizes.
+     * \return False if no reads were recorded, chunk is then unchanged.
+     */
+    bool chooseChunk(hsize_t *chunk) const {
+        CPH5AccessStats::ShapeMap shapes = mStats.getShapes();
+        if (shapes.empty())
+            return false;
+
+        std::vector<hsize_t> candidates[nDims];
+        for (int d = 0; d < nDims; ++d) {
+            hsize_t n = extent(d);
+            for (hsize_t c = 1; c < n; c *= 2) {
+                candidates[d].push_back(c);
+            }
+            candidates[d].push_back(n);
+            for (CPH5AccessStats::ShapeMap::const_iterator it = shapes.begin();
+                 it != shapes.end();
+                 ++it) {
+                candidates[d].push_back(std::max<hsize_t>(1, std::min(it->first[d], n)));
+            }
+            std::sort(candidates[d].begin(), candidates[d].end());
+            candidates[d].erase(std::unique(candidates[d].begin(), candidates[d].end()),
+                                candidates[d].end());
+        }
+
+        std::vector<std::vector<hsize_t> > starts;
+        starts.push_back(std::vector<hsize_t>(nDims, 1));
+        hsize_t current[nDims];
+        if (currentChunk(current)) {
+            starts.push_back(std::vector<hsize_t>(current, current + nDims));
+        }
+        for (CPH5AccessStats::ShapeMap::const_iterator it = shapes.begin();
+             it != shapes.end();
+             ++it) {
+            starts.push_back(it->first);
+        }
+
+        double bestCost = -1.0;
+        bool bestFits = false;
+        for (std::size_t s = 0; s < starts.size(); ++s) {
+            hsize_t trial[nDims];
+            for (int d = 0; d < nDims; ++d) {
+                trial[d] = std::max<hsize_t>(1, std::min(starts[s][d], extent(d)));
+            }
+            fitChunk(shapes, trial);
+            double trialCost = costOf(shapes, trial);
+            bool trialFits = fits(trial);
+            // Coordinate descent, one dimension at a time. A shape within
+            // the size limits always beats one outside them.
+            for (int round = 0; round < 32; ++round) {
+                bool improved = false;
+                for (int d = 0; d < nDims; ++d) {
+                    hsize_t keep = trial[d];
+                    for (std::size_t c = 0; c < candidates[d].size(); ++c) {
+                        hsize_t old = trial[d];
+                        trial[d] = candidates[d][c];
+                        double candidateCost = costOf(shapes, trial);
+                        if (fits(trial)
+                                && (!trialFits || candidateCost < trialCost * (1.0 - 1e-9))) {
+                            trialCost = candidateCost;
+                            trialFits = true;
+                            keep = trial[d];
+                        }
+                        trial[d] = old;
+                    }
+                    if (keep != trial[d]) {
+                        trial[d] = keep;
+                        improved = true;
+                    }
+                }
+                if (!improved)
+                    break;
+            }
+            if (bestCost < 0 || (trialFits && !bestFits)
+                    || (trialFits == bestFits && trialCost < bestCost)) {
+                bestCost = trialCost;
+                bestFits = trialFits;
+                std::copy(trial, trial + nDims, chunk);
+            }
+        }
+        return true;
+    }
+
+    /*!
+     * \brief Chooses the chunk shape, rewrites the dataset with it if the
+     *        expected speedup is large enough, and measures the speedup.
+     *        Must not be called while other threads use the dataset.
+     * \param nThreads Maximum number of threads to use, 0 for all of the
+     *        threads of the global CPH5ThreadPool.
+     * \return Report of the chunk shapes and speedups.
+     */
+    CPH5RechunkReport run(unsigned nThreads = 0) {
+        CPH5RechunkReport report;
+        report.rewritten = false;
+        report.direct = false;
+        report.numReads = mStats.getNumReads();
+        report.expectedSpeedup = 1.0;
+        report.oldReadSeconds = 0.0;
+        report.newReadSeconds = 0.0;
+        report.measuredSpeedup = 1.0;
+
+        hsize_t chunk[nDims];
+        if (!chooseChunk(chunk)) {
+            throw std::runtime_error("CPH5Rechunker: no reads recorded for " + mDataset.getName());
+        }
+        report.newChunk.assign(chunk, chunk + nDims);
+        hsize_t current[nDims];
+        double oldCost;
+        if (currentChunk(current)) {
+            report.oldChunk.assign(current, current + nDims);
+            oldCost = cost(current);
+        } else {
+            oldCost = contiguousCost(mStats.getShapes());
+        }
+        double newCost = cost(chunk);
+        if (newCost > 0.0) {
+            report.expectedSpeedup = oldCost / newCost;
+        }
+        if (mOutputName.empty() && !(report.expectedSpeedup >= mMinSpeedup)) {
+            return report;
+        }
+
+        CPH5Group *parent = mDataset.getGroupParent();
+        std::string newName = mOutputName.empty() ? mDataset.getName() + "_rechunk" : mOutputName;
+        std::unique_ptr<H5::DataSet> pNew;
+        {
+            CPH5LibraryLock lock;
+            if (H5Lexists(parent->getH5Group()->getId(), newName.c_str(), H5P_DEFAULT) > 0) {
+                throw std::runtime_error("CPH5Rechunker: " + newName + " already exists");
+            }
+            H5::DataSet *pOld = mDataset.getDataSet();
+            H5::DSetCreatPropList props(pOld->getCreatePlist());
+            props.setChunk(nDims, chunk);
+            H5::DataSpace space(nDims, mDims, mMaxDims);
+            pNew.reset(parent->createDataSet(newName, pOld->getDataType(), space, props));
+            copyAttributes(*pOld, *pNew);
+        }
+        report.direct = copyData(*mDataset.getDataSet(), *pNew, chunk, nThreads);
+        report.rewritten = true;
+
+        if (mNumReplays > 0) {
+            std::vector<Replay> replays = sampleReplays();
+            replay(*mDataset.getDataSet(), replays);
+            replay(*pNew, replays);
+            report.oldReadSeconds = replay(*mDataset.getDataSet(), replays);
+            report.newReadSeconds = replay(*pNew, replays);
+            if (report.newReadSeconds > 0.0) {
+                report.measuredSpeedup = report.oldReadSeconds / report.newReadSeconds;
+            }
+        }
+
+        if (mOutputName.empty()) {
+            CPH5LibraryLock lock;
+            pNew->close();
+            pNew.reset();
+            hid_t groupId = parent->getH5Group()->getId();
+            mDataset.closeR();
+            parent->getH5Group()->unlink(mDataset.getName());
+            if (H5Lmove(groupId, newName.c_str(), groupId, mDataset.getName().c_str(),
+                        H5P_DEFAULT, H5P_DEFAULT) < 0) {
+                throw std::runtime_error("CPH5Rechunker: could not rename " + newName);
+            }
+            mDataset.openR(false);
+        }
+        return report;
+    }
+
+private:
+
+    // Disable copy & assignment
+    CPH5Rechunker(const CPH5Rechunker &other);
+    CPH5Rechunker &operator=(const CPH5Rechunker &other);
+
+    /*!
+     * \brief One replayed read.
+     */
+    struct Replay
+    {
+        hsize_t start[nDims];
+        hsize_t count[nDims];
+    };
+
+    /*!
+     * \brief One filter of the pipeline applied by copyData itself.
+     */
+    struct Filter
+    {
+        H5Z_filter_t id;
+        int level;
+    };
+
+    hsize_t extent(int d) const {
+        return mDims[d] > 0 ? mDims[d] : 1;
+    }
+
+    double chunkBytes(const hsize_t *chunk) const {
+        double bytes = static_cast<double>(mElemSize);
+        for (int d = 0; d < nDims; ++d) {
+            bytes *= static_cast<double>(chunk[d]);
+        }
+        return bytes;
+    }
+
+    double costOf(const CPH5AccessStats::ShapeMap &shapes, const hsize_t *chunk) const {
+        double perChunk = static_cast<double>(mChunkOverhead) + chunkBytes(chunk);
+        double total = 0.0;
+        for (CPH5AccessStats::ShapeMap::const_iterator it = shapes.begin();
+             it != shapes.end();
+             ++it) {
+            if (it->first.size() != static_cast<std::size_t>(nDims))
+                continue;
+            double touched = 1.0;
+            for (int d = 0; d < nDims; ++d) {
+                hsize_t n = extent(d);
+                hsize_t s = std::max<hsize_t>(1, std::min(it->first[d], n));
+                // Chunks crossed by a block of s at a random offset
+                double expected = 1.0 + static_cast<double>(s - 1) / static_cast<double>(chunk[d]);
+                double most = static_cast<double>((n + chunk[d] - 1) / chunk[d]);
+                touched *= std::min(expected, most);
+            }
+            total += static_cast<double>(it->second) * touched * perChunk;
+        }
+        return total;
+    }
+
+    /*!
+     * \brief Cost of the histogram for a contiguous dataset: one overhead
+     *        per contiguous run of the block plus the bytes of the block.
+     */
+    double contiguousCost(const CPH5AccessStats::ShapeMap &shapes) const {
+        double total = 0.0;
+        for (CPH5AccessStats::ShapeMap::const_iterator it = shapes.begin();
+             it != shapes.end();
+             ++it) {
+            if (it->first.size() != static_cast<std::size_t>(nDims))
+                continue;
+            double runs = 1.0;
+            double bytes = static_cast<double>(mElemSize);
+            int partial = -1;
+            for (int d = 0; d < nDims; ++d) {
+                hsize_t s = std::max<hsize_t>(1, std::min(it->first[d], extent(d)));
+                bytes *= static_cast<double>(s);
+                if (s < extent(d))
+                    partial = d;
+            }
+            for (int d = 0; d < partial; ++d) {
+                runs *= static_cast<double>(std::max<hsize_t>(1, std::min(it->first[d], extent(d))));
+            }
+            total += static_cast<double>(it->second) * (runs * mChunkOverhead + bytes);
+        }
+        return total;
+    }
+
+    bool currentChunk(hsize_t *chunk) const {
+        CPH5LibraryLock lock;
+        H5::DSetCreatPropList props(mDataset.getDataSet()->getCreatePlist());
+        if (props.getLayout() != H5D_CHUNKED)
+            return false;
+        props.getChunk(nDims, chunk);
+        return true;
+    }
+
+    bool fits(const hsize_t *chunk) const {
+        double bytes = chunkBytes(chunk);
+        double least = std::min(static_cast<double>(std::min(mMinChunkBytes, mMaxChunkBytes / 2)),
+                                chunkBytes(mDims));
+        return bytes <= mMaxChunkBytes && bytes >= least;
+    }
+
+    /*!
+     * \brief Brings a starting chunk shape within the size limits: halves
+     *        its largest dimension while it is too large, then doubles the
+     *        dimension that adds the least cost while it is too small.
+     */
+    void fitChunk(const CPH5AccessStats::ShapeMap &shapes, hsize_t *chunk) const {
+        while (chunkBytes(chunk) > mMaxChunkBytes) {
+            int largest = 0;
+            for (int d = 1; d < nDims; ++d) {
+                if (chunk[d] > chunk[largest])
+                    largest = d;
+            }
+            if (chunk[largest] <= 1)
+                break;
+            chunk[largest] = (chunk[largest] + 1) / 2;
+        }
+        while (!fits(chunk)) {
+            int cheapest = -1;
+            double cheapestCost = 0.0;
+            for (int d = 0; d < nDims; ++d) {
+                if (chunk[d] >= extent(d))
+                    continue;
+                hsize_t old = chunk[d];
+                chunk[d] = std::min(2 * old, extent(d));
+                double grownCost = costOf(shapes, chunk);
+                if (cheapest < 0 || grownCost < cheapestCost) {
+                    cheapest = d;
+                    cheapestCost = grownCost;
+                }
+                chunk[d] = old;
+            }
+            if (cheapest < 0)
+                break;
+            chunk[cheapest] = std::min(2 * chunk[cheapest], extent(cheapest));
+        }
+    }
+
+    static void copyAttributes(H5::DataSet &src, H5::DataSet &dst) {
+        int numAttrs = src.getNumAttrs();
+        for (int i = 0; i < numAttrs; ++i) {
+            H5::Attribute attr = src.openAttribute(static_cast<unsigned>(i));
+            H5::DataType type = attr.getDataType();
+            H5::DataSpace space = attr.getSpace();
+            H5::Attribute copy = dst.createAttribute(attr.getName(), type, space);
+            hssize_t numPoints = space.getSimpleExtentNpoints();
+            if (numPoints <= 0)
+                continue;
+            std::vector<char> buf(static_cast<std::size_t>(numPoints) * type.getSize());
+            H5Aread(attr.getId(), type.getId(), buf.data());
+            H5Awrite(copy.getId(), type.getId(), buf.data());
+            if (isVariable(type)) {
+                H5Dvlen_reclaim(type.getId(), space.getId(), H5P_DEFAULT, buf.data());
+            }
+        }
+    }
+
+    static bool isVariable(const H5::DataType &type) {
+        return H5Tdetect_class(type.getId(), H5T_VLEN) > 0
+                || (type.getClass() == H5T_STRING && H5Tis_variable_str(type.getId()) > 0);
+    }
+
+    /*!
+     * \brief Fills filters with the pipeline of the dataset if copyData can
+     *        apply all of it itself.
+     */
+    static bool directFilters(const H5::DataSet &ds, std::vector<Filter> &filters) {
+#if H5_VERSION_GE(1, 10, 3)
+        if (isVariable(ds.getDataType()))
+            return false;
+        H5::DSetCreatPropList props(ds.getCreatePlist());
+        int numFilters = props.getNfilters();
+        for (int i = 0; i < numFilters; ++i) {
+            unsigned flags;
+            std::size_t numValues = 8;
+            unsigned values[8];
+            unsigned config;
+            H5Z_filter_t id = H5Pget_filter2(props.getId(), static_cast<unsigned>(i), &flags,
+                                             &numValues, values, 0, 0, &config);
+            Filter filter;
+            filter.id = id;
+            filter.level = 0;
+            if (id == H5Z_FILTER_SHUFFLE) {
+                filters.push_back(filter);
+#if defined(CPH5_HAVE_ZLIB)
+            } else if (id == H5Z_FILTER_DEFLATE) {
+                filter.level = numValues > 0 ? static_cast<int>(values[0]) : 6;
+                filters.push_back(filter);
+#endif
+            } else {
+                return false;
+            }
+        }
+        return true;
+#else
+        (void)ds;
+        (void)filters;
+        return false;
+#endif
+    }
+
+    /*!
+     * \brief Copies the intersection of a box with two row-major blocks.
+     */
+    void copyBox(const char *src, const hsize_t *srcStart, const hsize_t *srcCount,
+                 char *dst, const hsize_t *dstStart, const hsize_t *dstCount,
+                 const hsize_t *boxStart, const hsize_t *boxCount) const {
+        hsize_t index[nDims];
+        std::copy(boxStart, boxStart + nDims, index);
+        std::size_t runBytes = boxCount[nDims - 1] * mElemSize;
+        while (true) {
+            hsize_t srcOffset = 0;
+            hsize_t dstOffset = 0;
+            for (int d = 0; d < nDims; ++d) {
+                srcOffset = srcOffset * srcCount[d] + (index[d] - srcStart[d]);
+                dstOffset = dstOffset * dstCount[d] + (index[d] - dstStart[d]);
+            }
+            memcpy(dst + dstOffset * mElemSize, src + srcOffset * mElemSize, runBytes);
+            int d = nDims - 2;
+            for (; d >= 0; --d) {
+                if (++index[d] < boxStart[d] + boxCount[d])
+                    break;
+                index[d] = boxStart[d];
+            }
+            if (d < 0)
+                break;
+        }
+    }
+
+    /*!
+     * \brief Copies the data from src to dst a block of chunks of dst at a
+     *        time.
+     * \return True if the chunks were filtered and written directly.
+     */
+    bool copyData(H5::DataSet &src, H5::DataSet &dst, const hsize_t *chunk, unsigned nThreads) {
+        hsize_t grid[nDims];
+        for (int d = 0; d < nDims; ++d) {
+            if (mDims[d] == 0)
+                return false;
+            grid[d] = (mDims[d] + chunk[d] - 1) / chunk[d];
+        }
+        std::vector<Filter> filters;
+        bool direct;
+        H5::DataType fileType;
+        {
+            CPH5LibraryLock lock;
+            direct = directFilters(dst, filters);
+            fileType = src.getDataType();
+        }
+        bool variable = isVariable(fileType);
+
+        unsigned concurrency = nThreads;
+        unsigned poolSize = CPH5ThreadPool::global().getNumThreads() + 1;
+        if (concurrency == 0 || concurrency > poolSize)
+            concurrency = poolSize;
+        if (!direct)
+            concurrency = 1;
+
+        // Blocks of chunks small enough for the budget and for a few blocks
+        // per thread.
+        double total = chunkBytes(mDims);
+        double perBlock = static_cast<double>(mMemoryBudget) / concurrency;
+        perBlock = std::min(perBlock, total / (4.0 * concurrency));
+        hsize_t blockChunks[nDims];
+        std::fill(blockChunks, blockChunks + nDims, hsize_t(1));
+        double inner = chunkBytes(chunk);
+        for (int d = nDims - 1; d >= 0; --d) {
+            double fit = perBlock / inner;
+            blockChunks[d] = std::max<hsize_t>(1, std::min<hsize_t>(grid[d], static_cast<hsize_t>(fit)));
+            if (blockChunks[d] < grid[d])
+                break;
+            inner *= static_cast<double>(blockChunks[d]);
+        }
+        hsize_t blockGrid[nDims];
+        std::size_t numBlocks = 1;
+        for (int d = 0; d < nDims; ++d) {
+            blockGrid[d] = (grid[d] + blockChunks[d] - 1) / blockChunks[d];
+            numBlocks *= blockGrid[d];
+        }
+
+        hid_t dstId = dst.getId();
+        auto copyBlock = [&](std::size_t b) {
+            hsize_t blockIndex[nDims];
+            std::size_t rest = b;
+            for (int d = nDims - 1; d >= 0; --d) {
+                blockIndex[d] = rest % blockGrid[d];
+                rest /= blockGrid[d];
+            }
+            hsize_t start[nDims];
+            hsize_t count[nDims];
+            hsize_t numElements = 1;
+            for (int d = 0; d < nDims; ++d) {
+                start[d] = blockIndex[d] * blockChunks[d] * chunk[d];
+                count[d] = std::min(blockChunks[d] * chunk[d], mDims[d] - start[d]);
+                numElements *= count[d];
+            }
+            std::vector<char> block(numElements * mElemSize);
+            H5::DataSpace memspace(nDims, count);
+            {
+                CPH5LibraryLock lock;
+                H5::DataSpace filespace(src.getSpace());
+                filespace.selectHyperslab(H5S_SELECT_SET, count, start);
+                src.read(block.data(), fileType, memspace, filespace);
+                if (!direct) {
+                    H5::DataSpace dstspace(dst.getSpace());
+                    dstspace.selectHyperslab(H5S_SELECT_SET, count, start);
+                    dst.write(block.data(), fileType, memspace, dstspace);
+                    if (variable) {
+                        H5Dvlen_reclaim(fileType.getId(), memspace.getId(), H5P_DEFAULT, block.data());
+                    }
+                    return;
+                }
+            }
+#if H5_VERSION_GE(1, 10, 3)
+            std::size_t rawBytes = static_cast<std::size_t>(chunkBytes(chunk));
+            std::vector<char> raw(rawBytes);
+            std::vector<char> work;
+            hsize_t inBlock[nDims];
+            std::fill(inBlock, inBlock + nDims, hsize_t(0));
+            while (true) {
+                hsize_t chunkStart[nDims];
+                hsize_t chunkCount[nDims];
+                bool inside = true;
+                bool partial = false;
+                for (int d = 0; d < nDims; ++d) {
+                    chunkStart[d] = start[d] + inBlock[d] * chunk[d];
+                    if (chunkStart[d] >= start[d] + count[d])
+                        inside = false;
+                    else
+                        chunkCount[d] = std::min(chunk[d], start[d] + count[d] - chunkStart[d]);
+                    if (inside && chunkCount[d] < chunk[d])
+                        partial = true;
+                }
+                if (inside) {
+                    if (partial)
+                        std::fill(raw.begin(), raw.end(), char(0));
+                    copyBox(block.data(), start, count, raw.data(), chunkStart, chunk,
+                            chunkStart, chunkCount);
+                    const char *data = raw.data();
+                    std::size_t size = rawBytes;
+                    applyFilters(filters, data, size, work);
+                    CPH5LibraryLock lock;
+                    if (H5Dwrite_chunk(dstId, H5P_DEFAULT, 0, chunkStart, size, data) < 0) {
+                        throw std::runtime_error("CPH5Rechunker: H5Dwrite_chunk failed");
+                    }
+                }
+                int d = nDims - 1;
+                for (; d >= 0; --d) {
+                    if (++inBlock[d] < blockChunks[d])
+                        break;
+                    inBlock[d] = 0;
+                }
+                if (d < 0)
+                    break;
+            }
+#endif
+        };
+        if (concurrency > 1) {
+            CPH5ThreadPool::global().parallelFor(numBlocks, copyBlock, concurrency);
+        } else {
+            for (std::size_t b = 0; b < numBlocks; ++b) {
+                copyBlock(b);
+            }
+        }
+        return direct;
+    }
+
+    /*!
+     * \brief Runs the chunk through the pipeline. data and size are updated
+     *        to the filtered bytes, which may live in work.
+     */
+    void applyFilters(const std::vector<Filter> &filters,
+                      const char *&data,
+                      std::size_t &size,
+                      std::vector<char> &work) const {
+        std::vector<char> out;
+        for (std::size_t f = 0; f < filters.size(); ++f) {
+            if (filters[f].id == H5Z_FILTER_SHUFFLE) {
+                if (mElemSize <= 1)
+                    continue;
+                std::size_t numElements = size / mElemSize;
+                out.resize(size);
+                for (std::size_t i = 0; i < numElements; ++i) {
+                    for (std::size_t b = 0; b < mElemSize; ++b) {
+                        out[b * numElements + i] = data[i * mElemSize + b];
+                    }
+                }
+#if defined(CPH5_HAVE_ZLIB)
+            } else if (filters[f].id == H5Z_FILTER_DEFLATE) {
+                uLongf outSize = compressBound(static_cast<uLong>(size));
+                out.resize(outSize);
+                if (compress2(reinterpret_cast<Bytef *>(out.data()), &outSize,
+                              reinterpret_cast<const Bytef *>(data), static_cast<uLong>(size),
+                              filters[f].level) != Z_OK) {
+                    throw std::runtime_error("CPH5Rechunker: deflate failed");
+                }
+                out.resize(outSize);
+#endif
+            }
+            work.swap(out);
+            data = work.data();
+            size = work.size();
+        }
+    }
+
+    /*!
+     * \brief Draws reads from the histogram, in proportion to their
+     *        counts, at random positions.
+     */
+    std::vector<Replay> sampleReplays() const {
+        CPH5AccessStats::ShapeMap shapes = mStats.getShapes();
+        uint64_t numReads = 0;
+        for (CPH5AccessStats::ShapeMap::const_iterator it = shapes.begin();
+             it != shapes.end();
+             ++it) {
+            numReads += it->second;
+        }
+        std::vector<Replay> replays;
+        std::mt19937_64 random(20170101);
+        for (CPH5AccessStats::ShapeMap::const_iterator it = shapes.begin();
+             it != shapes.end();
+             ++it) {
+            Replay replay;
+            hsize_t numElements = 1;
+            for (int d = 0; d < nDims; ++d) {
+                replay.count[d] = std::max<hsize_t>(1, std::min(it->first[d], mDims[d]));
+                numElements *= replay.count[d];
+            }
+            if (numElements * mElemSize > mMemoryBudget || chunkBytes(mDims) == 0.0)
+                continue;
+            double share = static_cast<double>(mNumReplays) * it->second / numReads;
+            std::size_t num = static_cast<std::size_t>(std::ceil(share));
+            for (std::size_t i = 0; i < num; ++i) {
+                for (int d = 0; d < nDims; ++d) {
+                    hsize_t room = mDims[d] - replay.count[d] + 1;
+                    replay.start[d] = random() % room;
+                }
+                replays.push_back(replay);
+            }
+        }
+        return replays;
+    }
+
+    double replay(H5::DataSet &ds, const std::vector<Replay> &replays) const {
+        CPH5LibraryLock lock;
+        H5::DataType fileType = ds.getDataType();
+        std::vector<char> buf;
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < replays.size(); ++i) {
+            hsize_t numElements = 1;
+            for (int d = 0; d < nDims; ++d) {
+                numElements *= replays[i].count[d];
+            }
+            buf.resize(numElements * mElemSize);
+            H5::DataSpace filespace(ds.getSpace());
+            filespace.selectHyperslab(H5S_SELECT_SET, replays[i].count, replays[i].start);
+            H5::DataSpace memspace(nDims, replays[i].count);
+            ds.read(buf.data(), fileType, memspace, filespace);
+            if (isVariable(fileType)) {
+                H5Dvlen_reclaim(fileType.getId(), memspace.getId(), H5P_DEFAULT, buf.data());
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+        return elapsed.count();
+    }
+
+    CPH5Dataset<T, nDims> &mDataset;
+    hsize_t mDims[nDims];
+    hsize_t mMaxDims[nDims];
+    std::size_t mElemSize;
+    CPH5AccessStats mStats;
+    std::size_t mMinChunkBytes;
+    std::size_t mMaxChunkBytes;
+    std::size_t mChunkOverhead;
+    std::size_t mMemoryBudget;
+    unsigned mNumReplays;
+    double mMinSpeedup;
+    std::string mOutputName;
+};
+
+#endif // CPH5RECHUNK_H
@@ -0,0 +1,558 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5RESAMPLE_H
+#define CPH5RESAMPLE_H
+
+#include "cph5utilities.h"
+#include "cph5dataset.h"
+#include "cph5parallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+/*!
+ * \brief The CPH5TimeResampling enum selects how CPH5Resampler computes the
+ *        value at a grid point.
+ */
+enum CPH5TimeResampling
+{
+    CPH5_TIME_NEAREST = 0, //!< Sample closest in time
+    CPH5_TIME_LINEAR,      //!< Linear interpolation between the samples around
+    CPH5_TIME_MEAN         //!< Mean of the samples within half a period
+};
+
+
+/*!
+ * \brief The CPH5Resampler class resamples a timestamped dataset onto a
+ *        uniform time grid and appends the result to another dataset.
+ *
+ * The source is either a 1-D compound dataset with a timestamp member and
+ * one or more value members, or a 2-D primitive dataset whose column 0 is
+ * the timestamp and whose other columns are the values. Timestamps must
+ * not decrease. All members are numeric and are resampled as double.
+ *
+ * The grid runs from the first timestamp (or setGrid's start) every period
+ * up to the last timestamp (or setGrid's end). Grid points outside of the
+ * samples, across a gap longer than setMaxGap, or (for CPH5_TIME_MEAN)
+ * with no sample within half a period, are NaN.
+ *
+ * The source is read in blocks of rows (one chunk tall for a chunked
+ * dataset), keeping only the samples still needed by the grid points not
+ * yet computed. The grid points a block resolves are split into segments
+ * computed on the CPH5ThreadPool. Each segment first finds, for every
+ * point, the two samples and the weight to combine them with, and then
+ * runs one branch free loop per channel over those, which the compiler
+ * vectorizes. The output is appended in batches to a 1-D (one channel) or
+ * 2-D ([points][channels]) extendible dataset of any numeric type.
+ *
+ * Example: <pre>
+ * CPH5Resampler resampler(file.imu, "time", {"ax", "ay", "az"});
+ * resampler.setGrid(0.01);
+ * resampler.setMethod(CPH5_TIME_LINEAR);
+ * resampler.run(out.imu100Hz);
+ * </pre>
+ */
+class CPH5Resampler
+{
+public:
+
+    /*!
+     * \brief Constructor for a compound source.
+     * \param ds Root-order 1-D compound dataset, open.
+     * \param timeMember Name of the timestamp member.
+     * \param valueMembers Names of the members to resample.
+     */
+    template<typename C>
+    CPH5Resampler(CPH5Dataset<C, 1> &ds,
+                  const std::string &timeMember,
+                  const std::vector<std::string> &valueMembers)
+        : CPH5Resampler()
+    {
+        H5::DataSet *pDataSet = openSource(ds);
+        H5::CompType type(pDataSet->getCompType());
+        mType = nativeType(type);
+        H5::CompType nativeComp(mType.getId());
+        mRecordSize = mType.getSize();
+        mTime = member(nativeComp, timeMember);
+        for (std::size_t c = 0; c < valueMembers.size(); ++c) {
+            mValues.push_back(member(nativeComp, valueMembers[c]));
+        }
+        if (mValues.empty()) {
+            throw std::runtime_error("CPH5Resampler: no value members for " + mName);
+        }
+        hsize_t chunk[1];
+        mChunkRows = ds.getChunkDims(chunk) ? chunk[0] : 0;
+        H5::DataType memType = mType;
+        CPH5Dataset<C, 1> *pDs = &ds;
+        mRead = [pDs, memType](hsize_t first, hsize_t count, void *dst) {
+            pDs->readRawBlockUntracked(&first, &count, dst, memType);
+        };
+    }
+
+    /*!
+     * \brief Constructor for a primitive source, column 0 holding the
+     *        timestamps and the other columns the values.
+     * \param ds Root-order 2-D dataset, open.
+     */
+    template<typename T>
+    explicit CPH5Resampler(CPH5Dataset<T, 2> &ds)
+        : CPH5Resampler()
+    {
+        H5::DataSet *pDataSet = openSource(ds);
+        hsize_t dims[2];
+        pDataSet->getSpace().getSimpleExtentDims(dims);
+        if (dims[1] < 2) {
+            throw std::runtime_error("CPH5Resampler: " + mName + " has no value columns");
+        }
+        mType = nativeType(pDataSet->getDataType());
+        std::size_t elemSize = mType.getSize();
+        mRecordSize = elemSize * static_cast<std::size_t>(dims[1]);
+        if (!mTime.init(mType, 0)) {
+            throw std::runtime_error("CPH5Resampler: " + mName + " is not numeric");
+        }
+        for (hsize_t c = 1; c < dims[1]; ++c) {
+            CPH5NumericField field;
+            field.init(mType, static_cast<std::size_t>(c) * elemSize);
+            mValues.push_back(field);
+        }
+        hsize_t chunk[2];
+        mChunkRows = ds.getChunkDims(chunk) ? chunk[0] : 0;
+        H5::DataType memType = mType;
+        CPH5Dataset<T, 2> *pDs = &ds;
+        hsize_t numCols = dims[1];
+        mRead = [pDs, memType, numCols](hsize_t first, hsize_t count, void *dst) {
+            hsize_t start[2] = {first, 0};
+            hsize_t counts[2] = {count, numCols};
+            pDs->readRawBlockUntracked(start, counts, dst, memType);
+        };
+    }
+
+    /*!
+     * \brief Sets the time grid. Must be called before run.
+     * \param period Time between grid points, in the units of the
+     *        timestamps.
+     * \param start Time of the first grid point, NaN (default) for the
+     *        first timestamp.
+     * \param end Latest time of a grid point, NaN (default) for the last
+     *        timestamp.
+     */
+    void setGrid(double period,
+                 double start = std::numeric_limits<double>::quiet_NaN(),
+                 double end = std::numeric_limits<double>::quiet_NaN()) {
+        mPeriod = period;
+        mStart = start;
+        mEnd = end;
+    }
+
+    /*!
+     * \brief Sets how a grid point is computed from the samples.
+     * \param method Resampling method, CPH5_TIME_LINEAR by default.
+     */
+    void setMethod(CPH5TimeResampling method) {
+        mMethod = method;
+    }
+
+    /*!
+     * \brief Sets the longest gap between samples to interpolate across with
+     *        CPH5_TIME_NEAREST or CPH5_TIME_LINEAR; grid points within a
+     *        longer gap are NaN.
+     * \param gap Longest gap, negative for no limit (default).
+     */
+    void setMaxGap(double gap) {
+        mMaxGap = gap;
+    }
+
+    /*!
+     * \brief Sets the number of source rows read at a time, which is also
+     *        the number of output rows appended at a time.
+     * \param rows Rows per block, 0 (default) for the chunk height of a
+     *        chunked source, or 65536 rows.
+     */
+    void setBlockRows(hsize_t rows) {
+        mBlockRows = rows;
+    }
+
+    /*!
+     * \brief Returns the number of value channels.
+     * \return Number of channels.
+     */
+    std::size_t getNumChannels() const {
+        return mValues.size();
+    }
+
+    /*!
+     * \brief Returns the time of the first grid point of the last run.
+     * \return Start time.
+     */
+    double getStartTime() const {
+        return mGridStart;
+    }
+
+    /*!
+     * \brief Resamples the source and appends the grid points to a dataset.
+     * \param out Root-order extendible dataset, 1-D for a single channel or
+     *        2-D with getNumChannels() columns.
+     * \param nThreads Maximum number of threads to use, 0 for all of the
+     *        threads of the global CPH5ThreadPool.
+     * \return Number of grid points appended.
+     */
+    template<typename O, int nOut>
+    hsize_t run(CPH5Dataset<O, nOut> &out, unsigned nThreads = 0) {
+        static_assert(nOut == 1 || nOut == 2, "CPH5Resampler: output must be 1-D or 2-D");
+        if (!(mPeriod > 0.0)) {
+            throw std::runtime_error("CPH5Resampler: no grid period set");
+        }
+        std::size_t numChannels = mValues.size();
+        if (out.getDataSet() == 0) {
+            throw std::runtime_error("CPH5Resampler: output " + out.getName() + " is not open");
+        }
+        hsize_t outDims[2] = {0, 1};
+        {
+            CPH5LibraryLock lock;
+            out.getDataSet()->getSpace().getSimpleExtentDims(outDims);
+        }
+        if ((nOut == 1 && numChannels != 1) || (nOut == 2 && outDims[1] != numChannels)) {
+            throw std::runtime_error("CPH5Resampler: output " + out.getName()
+                                     + " does not have " + std::to_string(numChannels) + " channels");
+        }
+        hsize_t outRows = outDims[0];
+
+        hsize_t blockRows = mBlockRows > 0 ? mBlockRows : (mChunkRows > 0 ? mChunkRows : 65536);
+        std::vector<char> block;
+        mWindowTimes.clear();
+        mWindowValues.assign(numChannels, std::vector<double>());
+        std::vector<double> pending;
+        hsize_t numPending = 0;
+        hsize_t written = 0;
+        auto flush = [&]() {
+            if (numPending == 0)
+                return;
+            CPH5LibraryLock lock;
+            hsize_t start[2] = {outRows, 0};
+            hsize_t count[2] = {numPending, static_cast<hsize_t>(numChannels)};
+            out.extend(numPending);
+            out.writeRawBlock(start, count, pending.data(), H5::PredType::NATIVE_DOUBLE);
+            outRows += numPending;
+            written += numPending;
+            numPending = 0;
+            pending.clear();
+        };
+
+        hsize_t next = 0;
+        hsize_t row = 0;
+        bool started = false;
+        do {
+            hsize_t n = mNumRows - row < blockRows ? mNumRows - row : blockRows;
+            appendBlock(row, n, block);
+            row += n;
+            if (mWindowTimes.empty())
+                break;
+            if (!started) {
+                mGridStart = std::isnan(mStart) ? mWindowTimes.front() : mStart;
+                started = true;
+            }
+            bool last = row == mNumRows;
+
+            hsize_t end;
+            if (last) {
+                // The real end of the grid, points within rounding of it
+                // included.
+                end = pointsUpTo(std::isnan(mEnd) ? mWindowTimes.back() : mEnd);
+            } else {
+                // Only the points the samples so far fully determine, so
+                // the output does not depend on the block size.
+                double reach = mMethod == CPH5_TIME_MEAN ? mPeriod / 2 : 0.0;
+                end = pointsAtOrBefore(mWindowTimes.back(), reach);
+                if (!std::isnan(mEnd)) {
+                    hsize_t gridEnd = pointsUpTo(mEnd);
+                    if (gridEnd < end)
+                        end = gridEnd;
+                }
+            }
+            if (end > next) {
+                std::size_t numPoints = static_cast<std::size_t>(end - next);
+                pending.resize(static_cast<std::size_t>(numPending + numPoints) * numChannels);
+                compute(next, numPoints, pending.data() + numPending * numChannels, nThreads);
+                numPending += numPoints;
+                next = end;
+                if (numPending >= blockRows)
+                    flush();
+            }
+            // The grid ends before the source does: the rest is not needed.
+            if (!std::isnan(mEnd) && next >= pointsUpTo(mEnd))
+                break;
+            dropSamplesBefore(gridTime(next));
+        } while (row < mNumRows);
+        flush();
+        return written;
+    }
+
+private:
+
+    // Disable copy & assignment
+    CPH5Resampler(const CPH5Resampler &other);
+    CPH5Resampler &operator=(const CPH5Resampler &other);
+
+    // Points computed by one task.
+    static constexpr std::size_t SEGMENT = 4096;
+
+    // Relative rounding allowed at the end of the grid.
+    static constexpr double GRID_TOLERANCE = 1e-12;
+
+    CPH5Resampler()
+        : mRecordSize(0),
+          mNumRows(0),
+          mChunkRows(0),
+          mMethod(CPH5_TIME_LINEAR),
+          mPeriod(0.0),
+          mStart(std::numeric_limits<double>::quiet_NaN()),
+          mEnd(std::numeric_limits<double>::quiet_NaN()),
+          mMaxGap(-1.0),
+          mBlockRows(0),
+          mGridStart(0.0)
+    {} // NOOP
+
+    template<typename T, int nDims>
+    H5::DataSet *openSource(CPH5Dataset<T, nDims> &ds) {
+        mName = ds.getName();
+        H5::DataSet *pDataSet = ds.getDataSet();
+        if (pDataSet == 0) {
+            throw std::runtime_error("CPH5Resampler: dataset " + mName + " is not open");
+        }
+        hsize_t dims[nDims];
+        pDataSet->getSpace().getSimpleExtentDims(dims);
+        mNumRows = dims[0];
+        return pDataSet;
+    }
+
+    H5::DataType nativeType(const H5::DataType &fileType) const {
+        hid_t nativeId = H5Tget_native_type(fileType.getId(), H5T_DIR_ASCEND);
+        if (nativeId < 0) {
+            throw std::runtime_error("CPH5Resampler: no native type for " + mName);
+        }
+        H5::DataType type(nativeId);
+        H5Tclose(nativeId);
+        return type;
+    }
+
+    CPH5NumericField member(const H5::CompType &type, const std::string &name) const {
+        int index = H5Tget_member_index(type.getId(), name.c_str());
+        if (index < 0) {
+            throw std::runtime_error("CPH5Resampler: no member " + name + " in " + mName);
+        }
+        unsigned i = static_cast<unsigned>(index);
+        CPH5NumericField field;
+        if (!field.init(type.getMemberDataType(i), type.getMemberOffset(i))) {
+            throw std::runtime_error("CPH5Resampler: member " + name + " is not numeric");
+        }
+        return field;
+    }
+
+    // Time of grid point k, computed the same way everywhere.
+    double gridTime(hsize_t k) const {
+        return mGridStart + static_cast<double>(k) * mPeriod;
+    }
+
+    // Number of grid points at or before t, counting a point that is
+    // after t only by rounding. For the end of the grid.
+    hsize_t pointsUpTo(double t) const {
+        if (t < mGridStart)
+            return 0;
+        double k = std::floor((t - mGridStart) / mPeriod * (1.0 + GRID_TOLERANCE));
+        return static_cast<hsize_t>(k) + 1;
+    }
+
+    // Number of grid points whose time plus reach is at or before t,
+    // exactly, with no tolerance.
+    hsize_t pointsAtOrBefore(double t, double reach) const {
+        hsize_t k = pointsUpTo(t - reach);
+        while (k > 0 && gridTime(k - 1) + reach > t)
+            --k;
+        while (gridTime(k) + reach <= t)
+            ++k;
+        return k;
+    }
+
+    // Reads n source rows and appends them to the window.
+    void appendBlock(hsize_t row, hsize_t n, std::vector<char> &block) {
+        if (n == 0)
+            return;
+        std::size_t count = static_cast<std::size_t>(n);
+        block.resize(count * mRecordSize);
+        {
+            CPH5LibraryLock lock;
+            mRead(row, n, block.data());
+        }
+        std::size_t old = mWindowTimes.size();
+        mWindowTimes.resize(old + count);
+        mTime.extract(block.data(), mRecordSize, count, mWindowTimes.data() + old);
+        for (std::size_t c = 0; c < mValues.size(); ++c) {
+            mWindowValues[c].resize(old + count);
+            mValues[c].extract(block.data(), mRecordSize, count, mWindowValues[c].data() + old);
+        }
+        for (std::size_t i = old > 0 ? old : 1; i < old + count; ++i) {
+            if (mWindowTimes[i] < mWindowTimes[i - 1]) {
+                throw std::runtime_error("CPH5Resampler: timestamps of " + mName
+                                         + " decrease at row " + std::to_string(row + i - old));
+            }
+        }
+    }
+
+    // Drops the samples no grid point from time t on needs.
+    void dropSamplesBefore(double t) {
+        std::vector<double>::iterator it;
+        if (mMethod == CPH5_TIME_MEAN) {
+            it = std::lower_bound(mWindowTimes.begin(), mWindowTimes.end(), t - mPeriod / 2);
+        } else {
+            it = std::upper_bound(mWindowTimes.begin(), mWindowTimes.end(), t);
+            if (it != mWindowTimes.begin())
+                --it;
+        }
+        std::size_t keep = static_cast<std::size_t>(it - mWindowTimes.begin());
+        if (keep == 0)
+            return;
+        mWindowTimes.erase(mWindowTimes.begin(), it);
+        for (std::size_t c = 0; c < mWindowValues.size(); ++c) {
+            mWindowValues[c].erase(mWindowValues[c].begin(), mWindowValues[c].begin() + keep);
+        }
+    }
+
+    // Computes numPoints grid points from first on, [point][channel].
+    void compute(hsize_t first, std::size_t numPoints, double *dst, unsigned nThreads) const {
+        std::size_t numSegments = (numPoints + SEGMENT - 1) / SEGMENT;
+        auto segment = [&](std::size_t s) {
+            std::size_t begin = s * SEGMENT;
+            std::size_t n = numPoints - begin < SEGMENT ? numPoints - begin : SEGMENT;
+            if (mMethod == CPH5_TIME_MEAN)
+                computeMean(first + begin, n, dst + begin * mValues.size());
+            else
+                computeInterpolated(first + begin, n, dst + begin * mValues.size());
+        };
+        if (nThreads == 1 || numSegments == 1) {
+            for (std::size_t s = 0; s < numSegments; ++s)
+                segment(s);
+        } else {
+            CPH5ThreadPool::global().parallelFor(numSegments, segment, nThreads);
+        }
+    }
+
+    // Nearest and linear: every point is lo + (hi - lo) * weight, with
+    // weight 0 for nearest and NaN for no value.
+    void computeInterpolated(hsize_t first, std::size_t n, double *dst) const {
+        const double nan = std::numeric_limits<double>::quiet_NaN();
+        const std::vector<double> &times = mWindowTimes;
+        std::size_t numSamples = times.size();
+        std::size_t numChannels = mValues.size();
+        std::vector<std::size_t> lo(n), hi(n);
+        std::vector<double> weight(n);
+        double t = gridTime(first);
+        std::size_t j = static_cast<std::size_t>(
+                    std::upper_bound(times.begin(), times.end(), t) - times.begin());
+        for (std::size_t i = 0; i < n; ++i) {
+            t = gridTime(first + i);
+            while (j < numSamples && times[j] <= t)
+                ++j;
+            // times[j - 1] <= t < times[j]
+            lo[i] = 0;
+            hi[i] = 0;
+            weight[i] = nan;
+            if (j == 0)
+                continue;
+            std::size_t a = j - 1;
+            if (times[a] == t) {
+                lo[i] = hi[i] = a;
+                weight[i] = 0.0;
+                continue;
+            }
+            if (j == numSamples) {
+                // Last point of the grid, after the last sample only by
+                // rounding (see pointsUpTo): takes that sample.
+                if (t - times[a] <= (t - mGridStart) * GRID_TOLERANCE) {
+                    lo[i] = hi[i] = a;
+                    weight[i] = 0.0;
+                }
+                continue;
+            }
+            double gap = times[j] - times[a];
+            if (mMaxGap >= 0.0 && gap > mMaxGap)
+                continue;
+            if (mMethod == CPH5_TIME_NEAREST) {
+                lo[i] = hi[i] = (t - times[a] <= times[j] - t) ? a : j;
+                weight[i] = 0.0;
+            } else {
+                lo[i] = a;
+                hi[i] = j;
+                weight[i] = (t - times[a]) / gap;
+            }
+        }
+        for (std::size_t c = 0; c < numChannels; ++c) {
+            const double *v = mWindowValues[c].data();
+            double *out = dst + c;
+            for (std::size_t i = 0; i < n; ++i) {
+                double a = v[lo[i]];
+                out[i * numChannels] = a + (v[hi[i]] - a) * weight[i];
+            }
+        }
+    }
+
+    // Mean: the samples within half a period of every point.
+    void computeMean(hsize_t first, std::size_t n, double *dst) const {
+        const std::vector<double> &times = mWindowTimes;
+        std::size_t numChannels = mValues.size();
+        double half = mPeriod / 2;
+        double t = gridTime(first);
+        std::size_t lo = static_cast<std::size_t>(
+                    std::lower_bound(times.begin(), times.end(), t - half) - times.begin());
+        std::size_t hi = lo;
+        for (std::size_t i = 0; i < n; ++i) {
+            t = gridTime(first + i);
+            while (lo < times.size() && times[lo] < t - half)
+                ++lo;
+            if (hi < lo)
+                hi = lo;
+            while (hi < times.size() && times[hi] < t + half)
+                ++hi;
+            double scale = hi > lo ? 1.0 / static_cast<double>(hi - lo)
+                                   : std::numeric_limits<double>::quiet_NaN();
+            for (std::size_t c = 0; c < numChannels; ++c) {
+                const double *v = mWindowValues[c].data();
+                double sum = 0.0;
+                for (std::size_t k = lo; k < hi; ++k)
+                    sum += v[k];
+                dst[i * numChannels + c] = sum * scale;
+            }
+        }
+    }
+
+    std::string mName;
+    H5::DataType mType;
+    std::size_t mRecordSize;
+    hsize_t mNumRows;
+    hsize_t mChunkRows;
+    CPH5NumericField mTime;
+    std::vector<CPH5NumericField> mValues;
+    std::function<void(hsize_t, hsize_t, void*)> mRead;
+    CPH5TimeResampling mMethod;
+    double mPeriod;
+    double mStart;
+    double mEnd;
+    double mMaxGap;
+    hsize_t mBlockRows;
+    double mGridStart;
+    std::vector<double> mWindowTimes;
+    std::vector<std::vector<double> > mWindowValues;
+};
+
+
+#endif // CPH5RESAMPLE_H
@@ -0,0 +1,446 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5SORT_H
+#define CPH5SORT_H
+
+#include "cph5utilities.h"
+#include "cph5dataset.h"
+#include "cph5parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#endif
+
+
+/*!
+ * \brief The CPH5ExternalSort class sorts a 1-D dataset by a key into
+ *        another dataset, with a bounded amount of memory.
+ *
+ * The key is a numeric member of a compound type, or the value itself for a
+ * primitive type. Keys are compared in their own type, so 64 bit integer
+ * timestamps sort exactly; NaN keys go last. The sort is stable: records
+ * with equal keys keep their order in the source.
+ *
+ * The source is split into runs that fit the memory budget. Runs are read,
+ * sorted and written to a temporary file in parallel on the CPH5ThreadPool
+ * (each thread holding one run, the reads under the CPH5LibraryLock), and
+ * are then merged with a k-way merge through a buffer per run into the
+ * destination, which is written in large blocks. A source that fits the
+ * budget is sorted in memory and written directly. The merge buffers do
+ * not go below 64KB per run and 4MB for the output, whatever the budget.
+ *
+ * Records move through memory and the temporary file in the native layout
+ * of the source type; the destination may have any type HDF5 converts
+ * that to. It is extended to the size of the source if it is smaller.
+ *
+ * Example: <pre>
+ * CPH5ExternalSort sort(file.packets, "timestamp");
+ * sort.setMemoryBudget(1 << 30);
+ * sort.run(sorted.packets);
+ * </pre>
+ */
+class CPH5ExternalSort
+{
+public:
+
+    /*!
+     * \brief Constructor.
+     * \param ds Root-order 1-D dataset to sort, open.
+     * \param keyMember Name of the key member for a compound type, ignored
+     *        (may be empty) for a primitive type.
+     */
+    template<typename T>
+    explicit CPH5ExternalSort(CPH5Dataset<T, 1> &ds, const std::string &keyMember = std::string())
+        : mName(ds.getName()),
+          mRecordSize(0),
+          mNumRows(0),
+          mKeyOffset(0),
+          mKeyKind(KEY_NONE),
+          mMemoryBudget(268435456),
+          mNumRuns(0)
+    {
+        H5::DataSet *pDataSet = ds.getDataSet();
+        if (pDataSet == 0) {
+            throw std::runtime_error("CPH5ExternalSort: dataset " + mName + " is not open");
+        }
+        pDataSet->getSpace().getSimpleExtentDims(&mNumRows);
+        hid_t nativeId = H5Tget_native_type(pDataSet->getDataType().getId(), H5T_DIR_ASCEND);
+        if (nativeId < 0) {
+            throw std::runtime_error("CPH5ExternalSort: no native type for " + mName);
+        }
+        mType = H5::DataType(nativeId);
+        H5Tclose(nativeId);
+        mRecordSize = mType.getSize();
+
+        H5::DataType keyType = mType;
+        if (mType.getClass() == H5T_COMPOUND) {
+            H5::CompType compType(mType.getId());
+            int member = H5Tget_member_index(compType.getId(), keyMember.c_str());
+            if (member < 0) {
+                throw std::runtime_error("CPH5ExternalSort: no member " + keyMember + " in " + mName);
+            }
+            keyType = compType.getMemberDataType(static_cast<unsigned>(member));
+            mKeyOffset = compType.getMemberOffset(static_cast<unsigned>(member));
+        }
+        mKeyKind = keyKind(keyType);
+        if (mKeyKind == KEY_NONE) {
+            throw std::runtime_error("CPH5ExternalSort: key of " + mName + " is not numeric");
+        }
+
+        CPH5Dataset<T, 1> *pDs = &ds;
+        H5::DataType memType = mType;
+        mRead = [pDs, memType](hsize_t first, hsize_t count, void *dst) {
+            pDs->readRawBlockUntracked(&first, &count, dst, memType);
+        };
+    }
+
+    /*!
+     * \brief Sets the memory used for runs and merge buffers.
+     * \param bytes Budget in bytes, 256MB by default.
+     */
+    void setMemoryBudget(std::size_t bytes) {
+        mMemoryBudget = bytes;
+    }
+
+    /*!
+     * \brief Sets the directory of the temporary file.
+     * \param directory Directory, empty (default) for the system temporary
+     *        file location.
+     */
+    void setTempDirectory(const std::string &directory) {
+        mTempDirectory = directory;
+    }
+
+    /*!
+     * \brief Returns the number of sorted runs of the last run call.
+     * \return Number of runs, 1 if the source was sorted in memory.
+     */
+    std::size_t getNumRuns() const {
+        return mNumRuns;
+    }
+
+    /*!
+     * \brief Sorts the source into a dataset.
+     * \param out Root-order 1-D dataset, open for writing, either at least
+     *        as large as the source or extendible.
+     * \param nThreads Maximum number of threads building runs, 0 for all of
+     *        the threads of the global CPH5ThreadPool.
+     * \return Number of records written.
+     */
+    template<typename O>
+    hsize_t run(CPH5Dataset<O, 1> &out, unsigned nThreads = 0) {
+        if (out.getDataSet() == 0) {
+            throw std::runtime_error("CPH5ExternalSort: output " + out.getName() + " is not open");
+        }
+        {
+            CPH5LibraryLock lock;
+            hsize_t size;
+            out.getDataSet()->getSpace().getSimpleExtentDims(&size);
+            if (size < mNumRows)
+                out.extend(mNumRows - size);
+        }
+        CPH5Dataset<O, 1> *pOut = &out;
+        H5::DataType memType = mType;
+        Writer write = [pOut, memType](hsize_t first, hsize_t count, const void *src) {
+            CPH5LibraryLock lock;
+            pOut->writeRawBlock(&first, &count, src, memType);
+        };
+        switch (mKeyKind) {
+        case KEY_I8: return sortAs<int8_t>(write, nThreads);
+        case KEY_U8: return sortAs<uint8_t>(write, nThreads);
+        case KEY_I16: return sortAs<int16_t>(write, nThreads);
+        case KEY_U16: return sortAs<uint16_t>(write, nThreads);
+        case KEY_I32: return sortAs<int32_t>(write, nThreads);
+        case KEY_U32: return sortAs<uint32_t>(write, nThreads);
+        case KEY_I64: return sortAs<int64_t>(write, nThreads);
+        case KEY_U64: return sortAs<uint64_t>(write, nThreads);
+        case KEY_F32: return sortAs<float>(write, nThreads);
+        case KEY_F64: return sortAs<double>(write, nThreads);
+        default: return 0;
+        }
+    }
+
+private:
+
+    // Disable copy & assignment
+    CPH5ExternalSort(const CPH5ExternalSort &other);
+    CPH5ExternalSort &operator=(const CPH5ExternalSort &other);
+
+    enum KeyKind { KEY_NONE, KEY_I8, KEY_U8, KEY_I16, KEY_U16, KEY_I32,
+                   KEY_U32, KEY_I64, KEY_U64, KEY_F32, KEY_F64 };
+
+    typedef std::function<void(hsize_t, hsize_t, const void*)> Writer;
+
+    static const std::size_t MIN_RUN_BUFFER = 65536;
+    static const std::size_t MIN_OUT_BUFFER = 4194304;
+
+    // Temporary file holding the runs, removed when done.
+    struct TempFile
+    {
+        TempFile() : file(0) {} // NOOP
+        ~TempFile() {
+            if (file != 0)
+                fclose(file);
+            if (!path.empty())
+                remove(path.c_str());
+        }
+        FILE *file;
+        std::string path;
+        std::mutex mutex;
+    };
+
+    static KeyKind keyKind(const H5::DataType &type) {
+        std::size_t size = type.getSize();
+        H5T_class_t cls = type.getClass();
+        if (cls == H5T_INTEGER) {
+            bool isSigned = H5Tget_sign(type.getId()) != H5T_SGN_NONE;
+            switch (size) {
+            case 1: return isSigned ? KEY_I8 : KEY_U8;
+            case 2: return isSigned ? KEY_I16 : KEY_U16;
+            case 4: return isSigned ? KEY_I32 : KEY_U32;
+            case 8: return isSigned ? KEY_I64 : KEY_U64;
+            default: return KEY_NONE;
+            }
+        }
+        if (cls == H5T_FLOAT) {
+            if (size == sizeof(float))
+                return KEY_F32;
+            if (size == sizeof(double))
+                return KEY_F64;
+        }
+        return KEY_NONE;
+    }
+
+    // Strict weak order that puts NaN last.
+    template<typename K>
+    static bool keyLess(K a, K b) {
+        return a < b || (a == a && b != b);
+    }
+
+    template<typename K>
+    K keyOf(const char *record) const {
+        K key;
+        memcpy(&key, record + mKeyOffset, sizeof(K));
+        return key;
+    }
+
+    static void seek(FILE *file, uint64_t offset) {
+#ifdef _WIN32
+        int err = _fseeki64(file, static_cast<__int64>(offset), SEEK_SET);
+#else
+        int err = fseeko(file, static_cast<off_t>(offset), SEEK_SET);
+#endif
+        if (err != 0) {
+            throw std::runtime_error("CPH5ExternalSort: could not seek in the temporary file");
+        }
+    }
+
+    void openTemp(TempFile &temp) const {
+        if (mTempDirectory.empty()) {
+            temp.file = tmpfile();
+        } else {
+            static std::atomic<unsigned> counter(0);
+            long long stamp = static_cast<long long>(
+                        std::chrono::steady_clock::now().time_since_epoch().count());
+            temp.path = mTempDirectory + "/cph5sort-" + std::to_string(stamp)
+                        + "-" + std::to_string(counter++) + ".tmp";
+            temp.file = fopen(temp.path.c_str(), "w+b");
+        }
+        if (temp.file == 0) {
+            temp.path.clear();
+            throw std::runtime_error("CPH5ExternalSort: could not create a temporary file");
+        }
+    }
+
+    // Reads count records from first on and sorts them into sorted.
+    template<typename K>
+    void sortBlock(hsize_t first, std::size_t count,
+                   std::vector<char> &records, std::vector<char> &sorted) const {
+        records.resize(count * mRecordSize);
+        sorted.resize(count * mRecordSize);
+        {
+            CPH5LibraryLock lock;
+            mRead(first, static_cast<hsize_t>(count), records.data());
+        }
+        std::vector<std::pair<K, uint32_t> > order(count);
+        for (std::size_t i = 0; i < count; ++i) {
+            order[i].first = keyOf<K>(records.data() + i * mRecordSize);
+            order[i].second = static_cast<uint32_t>(i);
+        }
+        std::stable_sort(order.begin(), order.end(),
+                         [](const std::pair<K, uint32_t> &a, const std::pair<K, uint32_t> &b) {
+            return keyLess(a.first, b.first);
+        });
+        for (std::size_t i = 0; i < count; ++i) {
+            memcpy(sorted.data() + i * mRecordSize,
+                   records.data() + static_cast<std::size_t>(order[i].second) * mRecordSize,
+                   mRecordSize);
+        }
+    }
+
+    template<typename K>
+    hsize_t sortAs(const Writer &write, unsigned nThreads) {
+        mNumRuns = 0;
+        if (mNumRows == 0)
+            return 0;
+        unsigned concurrency = nThreads;
+        unsigned poolSize = CPH5ThreadPool::global().getNumThreads() + 1;
+        if (concurrency == 0 || concurrency > poolSize)
+            concurrency = poolSize;
+
+        // A run holds the records twice plus a key and index per record.
+        std::size_t perRecord = 2 * mRecordSize + sizeof(std::pair<K, uint32_t>);
+        hsize_t runRows = static_cast<hsize_t>(mMemoryBudget / perRecord);
+        if (runRows >= mNumRows) {
+            std::vector<char> records, sorted;
+            sortBlock<K>(0, static_cast<std::size_t>(mNumRows), records, sorted);
+            write(0, mNumRows, sorted.data());
+            mNumRuns = 1;
+            return mNumRows;
+        }
+        runRows /= concurrency;
+        if (runRows == 0)
+            runRows = 1;
+        if (runRows > 0xFFFFFFFFu)
+            runRows = 0xFFFFFFFFu;
+        std::size_t numRuns = static_cast<std::size_t>((mNumRows + runRows - 1) / runRows);
+        mNumRuns = numRuns;
+
+        TempFile temp;
+        openTemp(temp);
+        auto buildRun = [&](std::size_t r) {
+            hsize_t first = static_cast<hsize_t>(r) * runRows;
+            std::size_t count = static_cast<std::size_t>(
+                        first + runRows > mNumRows ? mNumRows - first : runRows);
+            std::vector<char> records, sorted;
+            sortBlock<K>(first, count, records, sorted);
+            std::lock_guard<std::mutex> lock(temp.mutex);
+            seek(temp.file, first * mRecordSize);
+            if (fwrite(sorted.data(), mRecordSize, count, temp.file) != count) {
+                throw std::runtime_error("CPH5ExternalSort: could not write the temporary file");
+            }
+        };
+        if (concurrency == 1) {
+            for (std::size_t r = 0; r < numRuns; ++r)
+                buildRun(r);
+        } else {
+            CPH5ThreadPool::global().parallelFor(numRuns, buildRun, concurrency);
+        }
+        merge<K>(temp, runRows, numRuns, write);
+        return mNumRows;
+    }
+
+    // Merges the sorted runs of the temporary file into the output.
+    template<typename K>
+    void merge(TempFile &temp, hsize_t runRows, std::size_t numRuns, const Writer &write) {
+        // The buffers have a floor so that a small budget with many runs
+        // does not turn into tiny reads and writes.
+        std::size_t bufRows = mMemoryBudget / ((numRuns + 1) * mRecordSize);
+        std::size_t minRows = MIN_RUN_BUFFER / mRecordSize + 1;
+        if (bufRows < minRows)
+            bufRows = minRows;
+        if (bufRows > runRows)
+            bufRows = static_cast<std::size_t>(runRows);
+        std::size_t outRows = bufRows;
+        minRows = MIN_OUT_BUFFER / mRecordSize + 1;
+        if (outRows < minRows)
+            outRows = minRows;
+        if (outRows > mNumRows)
+            outRows = static_cast<std::size_t>(mNumRows);
+
+        struct Run
+        {
+            hsize_t next;   // Next row of the run to load
+            hsize_t end;
+            std::vector<char> buffer;
+            std::size_t pos;
+            std::size_t count;
+        };
+        std::vector<Run> runs(numRuns);
+        auto fill = [&](Run &run) {
+            std::size_t count = static_cast<std::size_t>(
+                        run.end - run.next < bufRows ? run.end - run.next : bufRows);
+            run.buffer.resize(count * mRecordSize);
+            seek(temp.file, run.next * mRecordSize);
+            if (fread(run.buffer.data(), mRecordSize, count, temp.file) != count) {
+                throw std::runtime_error("CPH5ExternalSort: could not read the temporary file");
+            }
+            run.next += count;
+            run.pos = 0;
+            run.count = count;
+        };
+
+        // Min-heap on the key, ties going to the earlier run for stability.
+        typedef std::pair<K, std::size_t> HeapEntry;
+        auto greater = [](const HeapEntry &a, const HeapEntry &b) {
+            return keyLess(b.first, a.first)
+                    || (!keyLess(a.first, b.first) && a.second > b.second);
+        };
+        std::priority_queue<HeapEntry, std::vector<HeapEntry>, decltype(greater)> heap(greater);
+        for (std::size_t r = 0; r < numRuns; ++r) {
+            Run &run = runs[r];
+            run.next = static_cast<hsize_t>(r) * runRows;
+            run.end = run.next + runRows > mNumRows ? mNumRows : run.next + runRows;
+            fill(run);
+            heap.push(HeapEntry(keyOf<K>(run.buffer.data()), r));
+        }
+
+        std::vector<char> out(outRows * mRecordSize);
+        std::size_t numOut = 0;
+        hsize_t written = 0;
+        while (!heap.empty()) {
+            std::size_t r = heap.top().second;
+            heap.pop();
+            Run &run = runs[r];
+            memcpy(out.data() + numOut * mRecordSize,
+                   run.buffer.data() + run.pos * mRecordSize, mRecordSize);
+            if (++numOut == outRows) {
+                write(written, static_cast<hsize_t>(numOut), out.data());
+                written += numOut;
+                numOut = 0;
+            }
+            if (++run.pos == run.count) {
+                if (run.next == run.end) {
+                    std::vector<char>().swap(run.buffer);
+                    continue;
+                }
+                fill(run);
+            }
+            heap.push(HeapEntry(keyOf<K>(run.buffer.data() + run.pos * mRecordSize), r));
+        }
+        if (numOut > 0)
+            write(written, static_cast<hsize_t>(numOut), out.data());
+    }
+
+    std::string mName;
+    H5::DataType mType;
+    std::size_t mRecordSize;
+    hsize_t mNumRows;
+    std::size_t mKeyOffset;
+    KeyKind mKeyKind;
+    std::function<void(hsize_t, hsize_t, void*)> mRead;
+    std::size_t mMemoryBudget;
+    std::string mTempDirectory;
+    std::size_t mNumRuns;
+};
+
+
+#endif // CPH5SORT_H
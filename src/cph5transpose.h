@@ -0,0 +1,230 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright 2017 Ball Aerospace & Technologies Corp. All Rights Reserved.
+//
+// This program is free software; you can modify and/or redistribute it under
+// the terms found in the accompanying LICENSE.txt file.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CPH5TRANSPOSE_H
+#define CPH5TRANSPOSE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#endif
+
+
+/*!
+ * \brief The CPH5Transpose namespace holds the in memory transpose kernels
+ *        used by the interleave and axis permuting reads.
+ *
+ * The matrices are walked in square blocks small enough for a block of the
+ * source and a block of the destination to stay in L1 cache. Within a
+ * block, 2 and 4 byte elements are transposed 8x8 and 4x4 at a time in SSE
+ * registers when SSE2 is available; other sizes (including compound
+ * elements) are moved one element at a time.
+ */
+namespace CPH5Transpose {
+
+    /*!
+     * \brief Side of the square blocks, in elements.
+     */
+    static const std::size_t BLOCK = 32;
+
+    /*!
+     * \cond
+     */
+
+    template<typename U>
+    inline static void scalarBlock(const U *src, U *dst,
+                                   std::size_t rows, std::size_t cols,
+                                   std::size_t srcStride, std::size_t dstStride)
+    {
+        for (std::size_t r = 0; r < rows; ++r) {
+            const U *s = src + r * srcStride;
+            for (std::size_t c = 0; c < cols; ++c) {
+                dst[c * dstStride + r] = s[c];
+            }
+        }
+    }
+
+    inline static void block(const uint32_t *src, uint32_t *dst,
+                             std::size_t rows, std::size_t cols,
+                             std::size_t srcStride, std::size_t dstStride)
+    {
+#if defined(__SSE2__)
+        std::size_t r4 = rows & ~static_cast<std::size_t>(3);
+        std::size_t c4 = cols & ~static_cast<std::size_t>(3);
+        for (std::size_t r = 0; r < r4; r += 4) {
+            for (std::size_t c = 0; c < c4; c += 4) {
+                const float *s = reinterpret_cast<const float*>(src + r * srcStride + c);
+                __m128 a0 = _mm_loadu_ps(s);
+                __m128 a1 = _mm_loadu_ps(s + srcStride);
+                __m128 a2 = _mm_loadu_ps(s + 2 * srcStride);
+                __m128 a3 = _mm_loadu_ps(s + 3 * srcStride);
+                _MM_TRANSPOSE4_PS(a0, a1, a2, a3);
+                float *d = reinterpret_cast<float*>(dst + c * dstStride + r);
+                _mm_storeu_ps(d, a0);
+                _mm_storeu_ps(d + dstStride, a1);
+                _mm_storeu_ps(d + 2 * dstStride, a2);
+                _mm_storeu_ps(d + 3 * dstStride, a3);
+            }
+        }
+        // Right and bottom remainders
+        scalarBlock(src + c4, dst + c4 * dstStride, r4, cols - c4, srcStride, dstStride);
+        scalarBlock(src + r4 * srcStride, dst + r4, rows - r4, cols, srcStride, dstStride);
+#else
+        scalarBlock(src, dst, rows, cols, srcStride, dstStride);
+#endif
+    }
+
+    inline static void block(const uint16_t *src, uint16_t *dst,
+                             std::size_t rows, std::size_t cols,
+                             std::size_t srcStride, std::size_t dstStride)
+    {
+#if defined(__SSE2__)
+        std::size_t r8 = rows & ~static_cast<std::size_t>(7);
+        std::size_t c8 = cols & ~static_cast<std::size_t>(7);
+        for (std::size_t r = 0; r < r8; r += 8) {
+            for (std::size_t c = 0; c < c8; c += 8) {
+                const uint16_t *s = src + r * srcStride + c;
+                __m128i a[8];
+                for (int i = 0; i < 8; ++i) {
+                    a[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i * srcStride));
+                }
+                __m128i t[8], u[8];
+                for (int i = 0; i < 4; ++i) {
+                    t[2*i] = _mm_unpacklo_epi16(a[2*i], a[2*i+1]);
+                    t[2*i+1] = _mm_unpackhi_epi16(a[2*i], a[2*i+1]);
+                }
+                u[0] = _mm_unpacklo_epi32(t[0], t[2]);
+                u[1] = _mm_unpackhi_epi32(t[0], t[2]);
+                u[2] = _mm_unpacklo_epi32(t[1], t[3]);
+                u[3] = _mm_unpackhi_epi32(t[1], t[3]);
+                u[4] = _mm_unpacklo_epi32(t[4], t[6]);
+                u[5] = _mm_unpackhi_epi32(t[4], t[6]);
+                u[6] = _mm_unpacklo_epi32(t[5], t[7]);
+                u[7] = _mm_unpackhi_epi32(t[5], t[7]);
+                uint16_t *d = dst + c * dstStride + r;
+                for (int i = 0; i < 4; ++i) {
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(d + (2*i) * dstStride),
+                                     _mm_unpacklo_epi64(u[i], u[i+4]));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(d + (2*i+1) * dstStride),
+                                     _mm_unpackhi_epi64(u[i], u[i+4]));
+                }
+            }
+        }
+        // Right and bottom remainders
+        scalarBlock(src + c8, dst + c8 * dstStride, r8, cols - c8, srcStride, dstStride);
+        scalarBlock(src + r8 * srcStride, dst + r8, rows - r8, cols, srcStride, dstStride);
+#else
+        scalarBlock(src, dst, rows, cols, srcStride, dstStride);
+#endif
+    }
+
+    inline static void block(const uint8_t *src, uint8_t *dst,
+                             std::size_t rows, std::size_t cols,
+                             std::size_t srcStride, std::size_t dstStride)
+    {
+        scalarBlock(src, dst, rows, cols, srcStride, dstStride);
+    }
+
+    inline static void block(const uint64_t *src, uint64_t *dst,
+                             std::size_t rows, std::size_t cols,
+                             std::size_t srcStride, std::size_t dstStride)
+    {
+        scalarBlock(src, dst, rows, cols, srcStride, dstStride);
+    }
+
+    template<typename U>
+    inline static void blocked(const U *src, U *dst,
+                               std::size_t rows, std::size_t cols,
+                               std::size_t srcStride, std::size_t dstStride)
+    {
+        for (std::size_t r = 0; r < rows; r += BLOCK) {
+            std::size_t nr = rows - r < BLOCK ? rows - r : BLOCK;
+            for (std::size_t c = 0; c < cols; c += BLOCK) {
+                std::size_t nc = cols - c < BLOCK ? cols - c : BLOCK;
+                block(src + r * srcStride + c, dst + c * dstStride + r,
+                      nr, nc, srcStride, dstStride);
+            }
+        }
+    }
+
+    /*!
+     * \endcond
+     */
+
+    /*!
+     * \brief Transposes a rows x cols matrix of elements of any size:
+     *        element (r, c) of the source is stored as element (c, r) of
+     *        the destination. The buffers must not overlap.
+     * \param src First element of the source matrix.
+     * \param dst First element of the destination matrix.
+     * \param rows Number of rows of the source.
+     * \param cols Number of columns of the source.
+     * \param srcStride Distance in elements between source rows.
+     * \param dstStride Distance in elements between destination rows.
+     * \param elemSize Size of each element in bytes.
+     */
+    inline static void transpose(const void *src, void *dst,
+                                 std::size_t rows, std::size_t cols,
+                                 std::size_t srcStride, std::size_t dstStride,
+                                 std::size_t elemSize)
+    {
+        switch (elemSize) {
+        case 1:
+            blocked(static_cast<const uint8_t*>(src), static_cast<uint8_t*>(dst),
+                    rows, cols, srcStride, dstStride);
+            return;
+        case 2:
+            blocked(static_cast<const uint16_t*>(src), static_cast<uint16_t*>(dst),
+                    rows, cols, srcStride, dstStride);
+            return;
+        case 4:
+            blocked(static_cast<const uint32_t*>(src), static_cast<uint32_t*>(dst),
+                    rows, cols, srcStride, dstStride);
+            return;
+        case 8:
+            blocked(static_cast<const uint64_t*>(src), static_cast<uint64_t*>(dst),
+                    rows, cols, srcStride, dstStride);
+            return;
+        default:
+            break;
+        }
+        const char *s = static_cast<const char*>(src);
+        char *d = static_cast<char*>(dst);
+        for (std::size_t r = 0; r < rows; r += BLOCK) {
+            std::size_t nr = rows - r < BLOCK ? rows - r : BLOCK;
+            for (std::size_t c = 0; c < cols; c += BLOCK) {
+                std::size_t nc = cols - c < BLOCK ? cols - c : BLOCK;
+                for (std::size_t i = r; i < r + nr; ++i) {
+                    for (std::size_t j = c; j < c + nc; ++j) {
+                        memcpy(d + (j * dstStride + i) * elemSize,
+                               s + (i * srcStride + j) * elemSize,
+                               elemSize);
+                    }
+                }
+            }
+        }
+    }
+
+    /*!
+     * \brief Typed convenience overload of transpose for elements of type T.
+     */
+    template<typename T>
+    inline static void transpose(const T *src, T *dst,
+                                 std::size_t rows, std::size_t cols,
+                                 std::size_t srcStride, std::size_t dstStride)
+    {
+        transpose(static_cast<const void*>(src), static_cast<void*>(dst),
+                  rows, cols, srcStride, dstStride, sizeof(T));
+    }
+}
+
+
+#endif // CPH5TRANSPOSE_H
@@ -11,6 +11,14 @@
 #include "H5Cpp.h"
 #include <vector>
 #include <memory>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
 
 #define CPH_5_MAX_DIMS (32)
 
@@ -105,6 +113,453 @@ namespace CPH5Swappers {
 }
 
 
+namespace CPH5HalfConverters {
+    
+    /*!
+     * \brief Converts a single IEEE 754 half precision value (given as its
+     *        raw 16 bits) to a float. Subnormals, infinities and NaNs are
+     *        preserved.
+     * \param h Raw bits of the half precision value.
+     * \return The equivalent float.
+     */
+    inline static float halfToFloat(uint16_t h)
+    {
+        uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+        uint32_t exponent = (h >> 10) & 0x1F;
+        uint32_t mantissa = h & 0x3FF;
+        uint32_t bits;
+        if (exponent == 0) {
+            if (mantissa == 0) {
+                bits = sign;
+            } else {
+                // Subnormal half, renormalize for the float representation
+                exponent = 127 - 15 + 1;
+                while ((mantissa & 0x400) == 0) {
+                    mantissa <<= 1;
+                    --exponent;
+                }
+                mantissa &= 0x3FF;
+                bits = sign | (exponent << 23) | (mantissa << 13);
+            }
+        } else if (exponent == 0x1F) {
+            bits = sign | 0x7F800000 | (mantissa << 13);
+        } else {
+            bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+        }
+        float ret;
+        memcpy(&ret, &bits, sizeof(ret));
+        return ret;
+    }
+    
+    /*!
+     * \brief Converts a float to the raw bits of an IEEE 754 half precision
+     *        value, rounding to nearest even. Values too large for a half
+     *        become infinity and NaNs become a quiet NaN.
+     * \param f Float to convert.
+     * \return Raw bits of the half precision value.
+     */
+    inline static uint16_t floatToHalf(float f)
+    {
+        const uint32_t f32Infinity = 255u << 23;
+        const uint32_t f16Max = (127u + 16u) << 23;
+        const uint32_t denormMagic = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+        uint32_t x;
+        memcpy(&x, &f, sizeof(x));
+        uint32_t sign = x & 0x80000000u;
+        x ^= sign;
+        uint16_t ret;
+        if (x >= f16Max) {
+            ret = (x > f32Infinity) ? 0x7E00 : 0x7C00;
+        } else if (x < (113u << 23)) {
+            // Result is subnormal (or zero), let the FPU do the rounding by
+            // adding a magic number that shifts the mantissa into place.
+            float xf, magic;
+            memcpy(&xf, &x, sizeof(xf));
+            memcpy(&magic, &denormMagic, sizeof(magic));
+            xf += magic;
+            uint32_t xb;
+            memcpy(&xb, &xf, sizeof(xb));
+            ret = static_cast<uint16_t>(xb - denormMagic);
+        } else {
+            uint32_t mantOdd = (x >> 13) & 1;
+            x += (static_cast<uint32_t>(15 - 127) << 23) + 0xFFF;
+            x += mantOdd;
+            ret = static_cast<uint16_t>(x >> 13);
+        }
+        return ret | static_cast<uint16_t>(sign >> 16);
+    }
+    
+    /*!
+     * \brief Converts an array of raw half precision values to floats. Uses
+     *        the F16C instructions eight elements at a time when the compiler
+     *        targets them, otherwise converts element by element.
+     * \param src Array of raw half precision bits.
+     * \param dst Array of floats to store into, at least n long.
+     * \param n Number of elements to convert.
+     */
+    inline static void toFloat(const uint16_t *src, float *dst, std::size_t n)
+    {
+        std::size_t i = 0;
+#if defined(__F16C__)
+        for (; i + 8 <= n; i += 8) {
+            __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+        }
+#endif
+        for (; i < n; ++i) {
+            dst[i] = halfToFloat(src[i]);
+        }
+    }
+    
+    /*!
+     * \brief Converts an array of floats to raw half precision values. Uses
+     *        the F16C instructions eight elements at a time when the compiler
+     *        targets them, otherwise converts element by element. Both paths
+     *        round to nearest even.
+     * \param src Array of floats to convert.
+     * \param dst Array of raw half precision bits to store into.
+     * \param n Number of elements to convert.
+     */
+    inline static void fromFloat(const float *src, uint16_t *dst, std::size_t n)
+    {
+        std::size_t i = 0;
+#if defined(__F16C__)
+        for (; i + 8 <= n; i += 8) {
+            __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i),
+                                        _MM_FROUND_TO_NEAREST_INT);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), h);
+        }
+#endif
+        for (; i < n; ++i) {
+            dst[i] = floatToHalf(src[i]);
+        }
+    }
+    
+}
+
+
+/*!
+ * \brief The CPH5Half struct is a 16-bit IEEE 754 half precision floating
+ *        point value. It only stores the raw bits, and converts to and from
+ *        float on assignment and cast. Arrays of CPH5Half have the same
+ *        memory layout as the half precision type in the target HDF5 file,
+ *        so they can be read and written without any conversion.
+ */
+struct CPH5Half
+{
+    /*!
+     * \brief Default constructor, initializes to positive zero.
+     */
+    CPH5Half()
+        : bits(0)
+    {} // NOOP
+    
+    /*!
+     * \brief Converting constructor from a float, rounds to nearest even.
+     * \param f Value to store.
+     */
+    CPH5Half(float f)
+        : bits(CPH5HalfConverters::floatToHalf(f))
+    {} // NOOP
+    
+    /*!
+     * \brief operator float Converts the stored value to a float.
+     */
+    operator float() const {
+        return CPH5HalfConverters::halfToFloat(bits);
+    }
+    
+    /*!
+     * \brief Creates a CPH5Half directly from its raw bits.
+     * \param b Raw bits of the half precision value.
+     * \return The half precision value.
+     */
+    static CPH5Half fromBits(uint16_t b) {
+        CPH5Half ret;
+        ret.bits = b;
+        return ret;
+    }
+    
+    uint16_t bits;
+};
+
+
+namespace CPH5Swappers {
+    
+    inline static void swap_in_place(CPH5Half *x) {
+        swap_in_place(&x->bits);
+    }
+    
+}
+
+
+
+/*!
+ * \brief The CPH5NumericField class copies one numeric field out of an array
+ *        of records in a native HDF5 layout, converting it to double. It is
+ *        used to look at a few members of compound records read in whole,
+ *        which is cheaper than having HDF5 convert to a partial compound
+ *        type.
+ */
+class CPH5NumericField
+{
+public:
+    
+    /*!
+     * \brief Default constructor, an invalid field.
+     */
+    CPH5NumericField()
+        : mOffset(0),
+          mKind(KIND_NONE)
+    {} // NOOP
+    
+    /*!
+     * \brief Sets the type and location of the field.
+     * \param type Native type of the field.
+     * \param offset Offset of the field from the start of a record.
+     * \return True if the type is a native integer or floating point type.
+     */
+    bool init(const H5::DataType &type, std::size_t offset) {
+        mOffset = offset;
+        mKind = KIND_NONE;
+        std::size_t size = type.getSize();
+        H5T_class_t cls = type.getClass();
+        if (cls == H5T_INTEGER) {
+            bool isSigned = H5Tget_sign(type.getId()) != H5T_SGN_NONE;
+            switch (size) {
+            case 1: mKind = isSigned ? KIND_I8 : KIND_U8; break;
+            case 2: mKind = isSigned ? KIND_I16 : KIND_U16; break;
+            case 4: mKind = isSigned ? KIND_I32 : KIND_U32; break;
+            case 8: mKind = isSigned ? KIND_I64 : KIND_U64; break;
+            default: break;
+            }
+        } else if (cls == H5T_FLOAT) {
+            if (size == sizeof(float))
+                mKind = KIND_F32;
+            else if (size == sizeof(double))
+                mKind = KIND_F64;
+        }
+        return mKind != KIND_NONE;
+    }
+    
+    /*!
+     * \brief Returns whether init accepted the type of the field.
+     * \return True if the field can be extracted.
+     */
+    bool isValid() const {
+        return mKind != KIND_NONE;
+    }
+    
+    /*!
+     * \brief Copies the field of n records into an array of doubles.
+     * \param records Pointer to the first record.
+     * \param recordSize Size of a record in bytes.
+     * \param n Number of records.
+     * \param dst Array of n doubles.
+     */
+    void extract(const char *records, std::size_t recordSize, std::size_t n, double *dst) const {
+        const char *src = records + mOffset;
+        switch (mKind) {
+        case KIND_I8: extractAs<int8_t>(src, recordSize, n, dst); break;
+        case KIND_U8: extractAs<uint8_t>(src, recordSize, n, dst); break;
+        case KIND_I16: extractAs<int16_t>(src, recordSize, n, dst); break;
+        case KIND_U16: extractAs<uint16_t>(src, recordSize, n, dst); break;
+        case KIND_I32: extractAs<int32_t>(src, recordSize, n, dst); break;
+        case KIND_U32: extractAs<uint32_t>(src, recordSize, n, dst); break;
+        case KIND_I64: extractAs<int64_t>(src, recordSize, n, dst); break;
+        case KIND_U64: extractAs<uint64_t>(src, recordSize, n, dst); break;
+        case KIND_F32: extractAs<float>(src, recordSize, n, dst); break;
+        case KIND_F64: extractAs<double>(src, recordSize, n, dst); break;
+        default: break;
+        }
+    }
+    
+private:
+    
+    enum Kind { KIND_NONE, KIND_I8, KIND_U8, KIND_I16, KIND_U16, KIND_I32,
+                KIND_U32, KIND_I64, KIND_U64, KIND_F32, KIND_F64 };
+    
+    template<typename M>
+    static void extractAs(const char *src, std::size_t recordSize, std::size_t n, double *dst) {
+        for (std::size_t i = 0; i < n; ++i) {
+            M value;
+            memcpy(&value, src + i * recordSize, sizeof(M));
+            dst[i] = static_cast<double>(value);
+        }
+    }
+    
+    std::size_t mOffset;
+    Kind mKind;
+};
+
+
+
+
+/*!
+ * \brief The CPH5AccessStats class is a histogram of the shapes of the
+ *        selections read from a dataset.
+ *
+ * Every read records the extent of the bounding box of its file selection,
+ * e.g. a read of dataset[5] from a 100x200 dataset is recorded as 1x200.
+ * The histogram can be stored in an attribute of the dataset and merged
+ * back in later runs, so that tools such as CPH5Rechunker can pick a chunk
+ * shape from how the data is actually read. Recording is thread safe.
+ */
+class CPH5AccessStats
+{
+public:
+    
+    typedef std::vector<hsize_t> Shape;
+    typedef std::map<Shape, uint64_t> ShapeMap;
+    
+    /*!
+     * \brief Name of the attribute used by save and load.
+     */
+    static constexpr const char *ACCESS_ATTR = "cph5_access_shapes";
+    
+    /*!
+     * \brief Constructor, creates an empty histogram.
+     */
+    CPH5AccessStats() {} // NOOP
+    
+    /*!
+     * \brief Records one read of the selection in the given file dataspace.
+     *        Empty selections are not recorded.
+     * \param filespace Dataspace with the selection of the read.
+     */
+    void record(const H5::DataSpace &filespace) {
+        int rank = filespace.getSimpleExtentNdims();
+        if (rank <= 0 || rank > CPH_5_MAX_DIMS)
+            return;
+        hsize_t lo[CPH_5_MAX_DIMS];
+        hsize_t hi[CPH_5_MAX_DIMS];
+        if (H5Sget_select_npoints(filespace.getId()) <= 0
+                || H5Sget_select_bounds(filespace.getId(), lo, hi) < 0)
+            return;
+        hsize_t count[CPH_5_MAX_DIMS];
+        for (int d = 0; d < rank; ++d) {
+            count[d] = hi[d] - lo[d] + 1;
+        }
+        record(rank, count, 1);
+    }
+    
+    /*!
+     * \brief Records reads of a block of the given shape.
+     * \param rank Number of dimensions of the shape.
+     * \param count Array of rank sizes of the block.
+     * \param times Number of reads to record.
+     */
+    void record(int rank, const hsize_t *count, uint64_t times) {
+        Shape shape(count, count + rank);
+        std::lock_guard<std::mutex> lock(mMutex);
+        mShapes[shape] += times;
+    }
+    
+    /*!
+     * \brief Returns a copy of the histogram, shape to number of reads.
+     */
+    ShapeMap getShapes() const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mShapes;
+    }
+    
+    /*!
+     * \brief Returns the total number of reads recorded.
+     */
+    uint64_t getNumReads() const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        uint64_t num = 0;
+        for (ShapeMap::const_iterator it = mShapes.begin(); it != mShapes.end(); ++it) {
+            num += it->second;
+        }
+        return num;
+    }
+    
+    /*!
+     * \brief Clears the histogram.
+     */
+    void reset() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mShapes.clear();
+    }
+    
+    /*!
+     * \brief Writes the histogram to the attribute named ACCESS_ATTR of
+     *        the given object, replacing any previous one. The attribute is
+     *        a uint64 array of one row per shape: the sizes of the shape
+     *        followed by its number of reads. Nothing is written while the
+     *        histogram is empty.
+     * \param obj Object to store the attribute in, usually the dataset.
+     */
+    void save(H5::H5Object &obj) const {
+        ShapeMap shapes = getShapes();
+        if (shapes.empty())
+            return;
+        std::size_t rank = shapes.begin()->first.size();
+        std::vector<uint64_t> rows;
+        hsize_t numRows = 0;
+        for (ShapeMap::const_iterator it = shapes.begin(); it != shapes.end(); ++it) {
+            if (it->first.size() != rank)
+                continue;
+            rows.insert(rows.end(), it->first.begin(), it->first.end());
+            rows.push_back(it->second);
+            ++numRows;
+        }
+        if (obj.attrExists(ACCESS_ATTR)) {
+            obj.removeAttr(ACCESS_ATTR);
+        }
+        hsize_t dims[2] = {numRows, rank + 1};
+        H5::DataSpace space(2, dims);
+        H5::Attribute attr = obj.createAttribute(ACCESS_ATTR,
+                                                 H5::PredType::STD_U64LE,
+                                                 space);
+        attr.write(H5::PredType::NATIVE_UINT64, rows.data());
+    }
+    
+    /*!
+     * \brief Adds the histogram stored by save in the given object to this
+     *        one.
+     * \param obj Object holding the attribute.
+     * \return False if the object has no (valid) histogram attribute.
+     */
+    bool load(const H5::H5Object &obj) {
+        if (!obj.attrExists(ACCESS_ATTR))
+            return false;
+        H5::Attribute attr = obj.openAttribute(ACCESS_ATTR);
+        H5::DataSpace space = attr.getSpace();
+        if (space.getSimpleExtentNdims() != 2)
+            return false;
+        hsize_t dims[2];
+        space.getSimpleExtentDims(dims);
+        if (dims[1] < 2 || dims[1] > CPH_5_MAX_DIMS + 1)
+            return false;
+        std::vector<uint64_t> rows(dims[0] * dims[1]);
+        if (!rows.empty()) {
+            attr.read(H5::PredType::NATIVE_UINT64, rows.data());
+        }
+        int rank = static_cast<int>(dims[1] - 1);
+        hsize_t count[CPH_5_MAX_DIMS];
+        for (hsize_t i = 0; i < dims[0]; ++i) {
+            const uint64_t *row = &rows[i * dims[1]];
+            for (int d = 0; d < rank; ++d) {
+                count[d] = row[d];
+            }
+            record(rank, count, row[rank]);
+        }
+        return true;
+    }
+    
+private:
+    
+    // Disable copy & assignment
+    CPH5AccessStats(const CPH5AccessStats &other);
+    CPH5AccessStats &operator=(const CPH5AccessStats &other);
+    
+    mutable std::mutex mMutex;
+    ShapeMap mShapes;
+};
+
+
 
 
 /*!
@@ -121,12 +576,23 @@ public:
      */
     CPH5IOFacility()
         : mpDataSet(0),
-          numDims(-1)
+          numDims(-1),
+          mpAccessStats(0)
     {
         
     }
     
     
+    /*!
+     * \brief Sets the histogram that every read through this IOFacility is
+     *        recorded in, or 0 to stop recording. Not owned.
+     * \param pStats Pointer to the histogram.
+     */
+    void setAccessStats(CPH5AccessStats *pStats) {
+        mpAccessStats = pStats;
+    }
+    
+    
     /*!
      * \brief Initializes the IOFacility with the necessary parameters to begin
      *        hyperslab selection.
@@ -238,6 +704,9 @@ public:
         }
         setupSpaces();
         mpDataSet->read(dst, mType, mMemspace, mFilespace);
+        if (mpAccessStats != 0) {
+            mpAccessStats->record(mFilespace);
+        }
     }
     
     
@@ -255,7 +724,9 @@ public:
         }
         setupSpaces();
         mpDataSet->read(dst, type, mMemspace, mFilespace);
-        
+        if (mpAccessStats != 0) {
+            mpAccessStats->record(mFilespace);
+        }
     }
     
     
@@ -383,6 +854,8 @@ private:
     
     H5::DataSpace mMemspace;
     H5::DataSpace mFilespace;
+    
+    CPH5AccessStats *mpAccessStats;
 };
 
 
@@ -448,7 +921,8 @@ public:
         LT_INT64,
         LT_FLOAT,
         LT_DOUBLE,
-        LT_STRING
+        LT_STRING,
+        LT_FLOAT16
     };
     
     // Utility structs for determing leaf based on type
@@ -525,6 +999,10 @@ template<>
 struct CPH5TreeNode::IsLeaf<std::string> {
     enum { Get = LT_STRING };
 };
+template<>
+struct CPH5TreeNode::IsLeaf<CPH5Half> {
+    enum { Get = LT_FLOAT16 };
+};
 
 /*!
  * \brief The CPH5GroupMember class is a base interface class
@@ -693,6 +1171,7 @@ public:
  *    <li>int32_t  - H5::PredType::NATIVE_INT32  </li>
  *    <li>int64_t  - H5::PredType::NATIVE_INT64  </li>
  *    <li>char     - H5::PredType::NATIVE_CHAR   </li>
+ *    <li>CPH5Half - 16-bit IEEE 754 half precision H5T_FLOAT </li>
  * </ul>
  * Instantiating this class without one of these types will result
  * in a compile error.
@@ -794,6 +1273,62 @@ public:
     }
 };
 
+template<>
+class CPH5TypeProxy<CPH5Half> {
+public:
+    operator H5::DataType() {
+        // HDF5 has no predefined half precision type, so derive one from
+        // the native float: sign at bit 15, 5 exponent bits at bit 10 and
+        // 10 mantissa bits at bit 0, with an exponent bias of 15.
+        H5::FloatType type;
+        type.copy(H5::PredType::NATIVE_FLOAT);
+        type.setFields(15, 10, 5, 0, 10);
+        type.setOffset(0);
+        type.setPrecision(16);
+        type.setSize(2);
+        type.setEbias(15);
+        return type;
+    }
+};
+
+/*!
+ * \endcond
+ */
+
+
+/*!
+ * \brief The CPH5NBitTypeProxy class is a pass-through class for integer
+ *        types that only use nBits of their storage, such as 12-bit sensor
+ *        samples held in a uint16_t. The resulting H5::DataType has its
+ *        precision (and optionally offset) set accordingly, which combined
+ *        with the N-Bit filter (see CPH5Dataset::setNBitFilter) packs the
+ *        values in the target HDF5 file. The memory representation is the
+ *        full width integer T.
+ * 
+ * Example: <pre>
+ * CPH5Dataset<uint16_t, 2> frame(this, "frame", CPH5NBitTypeProxy<uint16_t, 12>());
+ * </pre>
+ */
+template<typename T, const int nBits, const int offset = 0>
+class CPH5NBitTypeProxy {
+public:
+    operator H5::DataType() {
+        static_assert(nBits > 0 && nBits + offset <= static_cast<int>(sizeof(T)*8),
+                      "N-bit precision must fit inside the integer type");
+        H5::IntType type;
+        type.copy(static_cast<H5::DataType>(CPH5TypeProxy<T>()));
+        // The native type starts at offset 0, so shrink the precision first
+        // to keep the offset in range.
+        type.setPrecision(nBits);
+        type.setOffset(offset);
+        return type;
+    }
+};
+
+/*!
+ * \cond
+ */
+
 
 
 #include <iostream>
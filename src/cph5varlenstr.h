@@ -568,7 +568,7 @@ public:
         memset(mMaxDims, 0, nDims * 4);
         parent->registerChild(this);
 
-        mPropList = H5::DSetCreatPropList::DEFAULT;
+        mPropList = H5::DSetCreatPropList();
     }
 
     /*!
@@ -606,17 +606,10 @@ public:
         if (create)
         {
             H5::DataSpace space(nDims, mDims, mMaxDims);
-            if (mChunksSet)
-            {
-                mpDataSet = mpGroupParent->createDataSet(mName,
-                        this->mType,
-                        space,
-                        mPropList);
-            }
-            else
-            {
-                mpDataSet = mpGroupParent->createDataSet(mName, this->mType, space);
-            }
+            mpDataSet = mpGroupParent->createDataSet(mName,
+                    this->mType,
+                    space,
+                    mPropList);
         }
         else
         {
@@ -1133,7 +1126,7 @@ private:
         // INITIALIZER LIST. Property lists maintain static ID's
         // under the hood that force us to use the assignment
         // operator instead of the copy constructor.
-        mPropList = H5::DSetCreatPropList::DEFAULT;
+        mPropList = H5::DSetCreatPropList();
     }
 
     /*!
@@ -105,6 +105,9 @@ class CPH5Dynamic {
             } else if (size == sizeof(double)) {
                 dataSetPass<double>(rank, group, type, dsetname, dims, maxdims, chunks);
                 return;
+            } else if (size == sizeof(CPH5Half)) {
+                dataSetPass<CPH5Half>(rank, group, type, dsetname, dims, maxdims, chunks);
+                return;
             }
             throw "Should never happen 2";
         } else if (tClass == H5T_INTEGER) {